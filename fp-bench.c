@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rabin.h"
+#include "siphash.h"
+#include "vutil.h"
+
+/* Measures the CPU cost of fingerprinting a sender address with each of the
+ * fingerprints the VDBs can key on, and with each implementation of the Rabin
+ * fingerprint ("rabin" is whichever rabin_fingerprint picked). Addresses are
+ * generated once, with lengths spread over the range seen in practice, and
+ * each fingerprint is run over the same set.
+ */
+
+#define FP_BENCH_ADDRESSES 4096
+
+struct fp_bench_address {
+    char * addr;
+    size_t len;
+};
+
+static uint64_t fp_bench_siphash(const char *, size_t);
+static void     fp_bench_run(const char *, uint64_t (*)(const char *, size_t),
+            const struct fp_bench_address *, size_t, size_t);
+static void     usage(void);
+
+static const struct {
+    const char *name;
+    uint64_t (*fn)(const char *, size_t);
+} fp_bench_algorithms[] = {
+        {"rabin", rabin_fingerprint},
+        {"rabin-table", rabin_fingerprint_table},
+        {"rabin-shift", rabin_fingerprint_shift},
+        {"rabin-clmul", rabin_fingerprint_clmul},
+        {"siphash", fp_bench_siphash},
+};
+
+int
+main(int argc, char **argv) {
+    int                      ch;
+    size_t                   iterations = 1000, minlen = 8, maxlen = 64;
+    size_t                   i, j, bytes = 0;
+    size_t                   nalgorithms;
+    struct fp_bench_address *addrs;
+    const char *             chars = "abcdefghijklmnopqrstuvwxyz0123456789.-";
+
+    while ((ch = getopt(argc, argv, "l:n:")) != EOF) {
+        switch ((char)ch) {
+        case 'l':
+            if ((maxlen = strtoul(optarg, NULL, 10)) < 1) {
+                usage();
+            }
+            minlen = maxlen;
+            break;
+        case 'n':
+            if ((iterations = strtoul(optarg, NULL, 10)) < 1) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+    }
+
+    if ((addrs = calloc(FP_BENCH_ADDRESSES, sizeof(*addrs))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    /* A fixed seed keeps runs comparable. */
+    srand48(1);
+    for (i = 0; i < FP_BENCH_ADDRESSES; i++) {
+        addrs[ i ].len = minlen + (size_t)(drand48() * (maxlen - minlen + 1));
+        if ((addrs[ i ].addr = malloc(addrs[ i ].len + 1)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (j = 0; j < addrs[ i ].len; j++) {
+            addrs[ i ].addr[ j ] =
+                    chars[ (size_t)(drand48() * strlen(chars)) ];
+        }
+        addrs[ i ].addr[ j ] = '\0';
+        bytes += addrs[ i ].len;
+    }
+
+    printf("%zu addresses of %zu bytes on average, %zu passes\n",
+            (size_t)FP_BENCH_ADDRESSES, bytes / FP_BENCH_ADDRESSES,
+            iterations);
+    printf("%-12s %12s %12s\n", "", "ns/address", "MB/s");
+
+    nalgorithms =
+            sizeof(fp_bench_algorithms) / sizeof(fp_bench_algorithms[ 0 ]);
+    for (i = 0; i < nalgorithms; i++) {
+        if ((fp_bench_algorithms[ i ].fn == rabin_fingerprint_clmul) &&
+                !rabin_have_clmul()) {
+            continue;
+        }
+        fp_bench_run(fp_bench_algorithms[ i ].name,
+                fp_bench_algorithms[ i ].fn, addrs, bytes, iterations);
+    }
+
+    for (i = 0; i < FP_BENCH_ADDRESSES; i++) {
+        free(addrs[ i ].addr);
+    }
+    free(addrs);
+
+    exit(0);
+}
+
+static void
+fp_bench_run(const char *name, uint64_t (*fn)(const char *, size_t),
+        const struct fp_bench_address *addrs, size_t bytes,
+        size_t iterations) {
+    size_t            i, n;
+    double            start, elapsed;
+    volatile uint64_t sink = 0;
+
+    /* Warm the caches and the branch predictors first. */
+    for (i = 0; i < FP_BENCH_ADDRESSES; i++) {
+        sink ^= fn(addrs[ i ].addr, addrs[ i ].len);
+    }
+
+    start = monotonic_seconds();
+    for (n = 0; n < iterations; n++) {
+        for (i = 0; i < FP_BENCH_ADDRESSES; i++) {
+            sink ^= fn(addrs[ i ].addr, addrs[ i ].len);
+        }
+    }
+    elapsed = monotonic_seconds() - start;
+
+    printf("%-12s %12.1f %12.1f\n", name,
+            elapsed * 1e9 / ((double)iterations * FP_BENCH_ADDRESSES),
+            (double)bytes * iterations / elapsed / 1e6);
+}
+
+static uint64_t
+fp_bench_siphash(const char *addr, size_t len) {
+    static const uint8_t key[ SIPHASH_KEY_LEN ] = {0};
+    uint8_t              out[ 16 ];
+    uint64_t             v;
+
+    siphash(key, addr, len, out, sizeof(out));
+    memcpy(&v, out, sizeof(v));
+    return v;
+}
+
+static void
+usage(void) {
+    fprintf(stderr, "usage: fp-bench [-l length] [-n passes]\n");
+    exit(1);
+}
@@ -23,13 +23,46 @@
 /* This is an implementation of the Rabin fingerprinting scheme, and returns
  * an unsigned 64 bit integer with a provably small chance of collision. The
  * fingerprint is not cryptographically secure.
+ *
+ * The fingerprint is the input, read as a polynomial over GF(2) with the
+ * first byte most significant, modulo P = x^64 + x^4 + x^3 + x + 1. There are
+ * three implementations, which give identical results:
+ *
+ * - the original, which reduces eight bytes at a time through eight 256-entry
+ *   tables;
+ * - one that uses no tables. Because x^64 mod P is only x^4 + x^3 + x + 1,
+ *   multiplying by it is a handful of shifts;
+ * - one for x86-64 processors with carry-less multiplication, which folds
+ *   32 bytes at a time with independent multiplications by x^64, x^128,
+ *   x^192 and x^256 mod P, and reduces once per stride.
+ *
+ * rabin_fingerprint picks the fastest one available the first time it is
+ * called.
  */
 
 #include <config.h>
 
+#include <stdbool.h>
+
 #include "rabin.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RABIN_CLMUL 1
+#include <wmmintrin.h>
+#endif /* __x86_64__ */
+
+/* x^(64k) mod P, for folding k blocks at once. */
+#define RABIN_X64 0x1bULL
+#define RABIN_X128 0x145ULL
+#define RABIN_X192 0x1db7ULL
+#define RABIN_X256 0x11011ULL
+
 static uint64_t rh_lookup(uint64_t);
+static uint64_t rabin_mul_x64(uint64_t);
+static uint64_t rabin_load(const unsigned char *);
+static uint64_t rabin_fingerprint_select(const char *, size_t);
+
+static uint64_t (*rabin_impl)(const char *, size_t) = rabin_fingerprint_select;
 
 static uint64_t table32[ 256 ] = {
         0x0000000000000000,
@@ -2114,6 +2147,19 @@ rh_lookup(uint64_t rh) {
 
 uint64_t
 rabin_fingerprint(const char *s, size_t len) {
+    return rabin_impl(s, len);
+}
+
+static uint64_t
+rabin_fingerprint_select(const char *s, size_t len) {
+    /* Every thread that gets here picks the same one. */
+    rabin_impl = rabin_have_clmul() ? rabin_fingerprint_clmul
+                                    : rabin_fingerprint_shift;
+    return rabin_impl(s, len);
+}
+
+uint64_t
+rabin_fingerprint_table(const char *s, size_t len) {
     uint64_t rh = 0;
     int      i;
 
@@ -2134,3 +2180,113 @@ rabin_fingerprint(const char *s, size_t len) {
 
     return rh;
 }
+
+/* h * x^64 mod P. The product is h * (x^4 + x^3 + x + 1), and the few bits it
+ * carries past x^63 are reduced the same way, which can't carry again.
+ */
+static inline uint64_t
+rabin_mul_x64(uint64_t h) {
+    uint64_t over;
+
+    over = (h >> 63) ^ (h >> 61) ^ (h >> 60);
+    return h ^ (h << 1) ^ (h << 3) ^ (h << 4) ^ over ^ (over << 1) ^
+           (over << 3) ^ (over << 4);
+}
+
+/* Reads a block with the first byte most significant. */
+static inline uint64_t
+rabin_load(const unsigned char *p) {
+    return ((uint64_t)p[ 0 ] << 56) | ((uint64_t)p[ 1 ] << 48) |
+           ((uint64_t)p[ 2 ] << 40) | ((uint64_t)p[ 3 ] << 32) |
+           ((uint64_t)p[ 4 ] << 24) | ((uint64_t)p[ 5 ] << 16) |
+           ((uint64_t)p[ 6 ] << 8) | (uint64_t)p[ 7 ];
+}
+
+uint64_t
+rabin_fingerprint_shift(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    uint64_t             rh = 0;
+    size_t               i;
+
+    for (i = 0; i < (len % 8); i++) {
+        rh = (rh << 8) ^ p[ i ];
+    }
+
+    for (; i < len; i += 8) {
+        rh = rabin_mul_x64(rh) ^ rabin_load(p + i);
+    }
+
+    return rh;
+}
+
+#ifdef RABIN_CLMUL
+__attribute__((target("pclmul"))) static inline __m128i
+rabin_clmul(uint64_t a, uint64_t b) {
+    return _mm_clmulepi64_si128(
+            _mm_cvtsi64_si128((long long)a), _mm_cvtsi64_si128((long long)b),
+            0x00);
+}
+
+/* Reduces a 128 bit product: the high half is worth hi * x^64 mod P. */
+__attribute__((target("pclmul"))) static inline uint64_t
+rabin_clmul_reduce(__m128i v) {
+    return (uint64_t)_mm_cvtsi128_si64(v) ^
+           rabin_mul_x64((uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+}
+
+__attribute__((target("pclmul"))) uint64_t
+rabin_fingerprint_clmul(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    uint64_t             rh = 0;
+    size_t               i;
+    __m128i              acc;
+
+    if (!rabin_have_clmul()) {
+        return rabin_fingerprint_shift(s, len);
+    }
+
+    for (i = 0; i < (len % 8); i++) {
+        rh = (rh << 8) ^ p[ i ];
+    }
+
+    /* Only the multiplication of rh depends on the previous stride. */
+    for (; (len - i) >= 32; i += 32) {
+        acc = _mm_xor_si128(rabin_clmul(rh, RABIN_X256),
+                rabin_clmul(rabin_load(p + i), RABIN_X192));
+        acc = _mm_xor_si128(
+                acc, rabin_clmul(rabin_load(p + i + 8), RABIN_X128));
+        acc = _mm_xor_si128(
+                acc, rabin_clmul(rabin_load(p + i + 16), RABIN_X64));
+        rh = rabin_clmul_reduce(acc) ^ rabin_load(p + i + 24);
+    }
+
+    for (; i < len; i += 8) {
+        rh = rabin_mul_x64(rh) ^ rabin_load(p + i);
+    }
+
+    return rh;
+}
+
+bool
+rabin_have_clmul(void) {
+    static int have = -1;
+
+    if (have < 0) {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("pclmul") ? 1 : 0;
+    }
+
+    return have == 1;
+}
+
+#else  /* RABIN_CLMUL */
+uint64_t
+rabin_fingerprint_clmul(const char *s, size_t len) {
+    return rabin_fingerprint_shift(s, len);
+}
+
+bool
+rabin_have_clmul(void) {
+    return false;
+}
+#endif /* RABIN_CLMUL */
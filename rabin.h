@@ -2,8 +2,18 @@
 #define RABIN_RABIN_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 uint64_t rabin_fingerprint(const char *, size_t);
 
+/* The individual implementations, for testing and benchmarking.
+ * rabin_fingerprint_clmul falls back to rabin_fingerprint_shift when the
+ * processor doesn't support it.
+ */
+uint64_t rabin_fingerprint_table(const char *, size_t);
+uint64_t rabin_fingerprint_shift(const char *, size_t);
+uint64_t rabin_fingerprint_clmul(const char *, size_t);
+bool     rabin_have_clmul(void);
+
 #endif /* RABIN_RABIN_H */
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+/* A block of a recipient's recent senders, stored as a single value instead
+ * of a key per sender. Members are sorted by fingerprint and stored as
+ * struct-of-arrays behind a fixed header:
+ *
+ *   header | hi - base, in width bytes each | lo, when wide | ts - tbase
+ *
+ * Each fingerprint is kept as its offset from the smallest one in the
+ * block, in as few bytes as the largest offset needs, so the more members a
+ * recipient's blocks hold the narrower the offsets get. The offsets have a
+ * fixed width, so a lookup can binary search them without decoding the
+ * block. Timestamps are 32-bit offsets from the earliest one.
+ *
+ * Blocks are written in native byte order, like the rest of the LMDB
+ * values, except for the packed offsets, which are little-endian.
+ */
+
+#include <config.h>
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "senderset.h"
+
+#define SENDERSET_WIDE 0x01
+
+struct senderset_header {
+    uint64_t base;
+    int64_t  tbase;
+    uint32_t n;
+    uint8_t  width;
+    uint8_t  flags;
+    uint16_t reserved;
+};
+
+static const char *senderset_hex = "0123456789abcdefABCDEF";
+
+static size_t   senderset_len(size_t, unsigned, bool);
+static unsigned senderset_width(uint64_t);
+static bool     senderset_header(
+            const void *, size_t, struct senderset_header *);
+static uint64_t senderset_load(const uint8_t *, unsigned);
+static size_t   senderset_find(
+          const struct senderset *, uint64_t, uint64_t, bool *);
+
+/* Parses a fingerprint as made by vdb_fingerprint: bare hex for Rabin, or
+ * "v2-" and 32 hex digits for SipHash.
+ */
+bool
+senderset_parse_fp(const char *fp, uint64_t *hi, uint64_t *lo, bool *wide) {
+    char   half[ 17 ];
+    size_t len;
+
+    len = strlen(fp);
+
+    if (strncmp(fp, "v2-", 3) == 0) {
+        if ((len != 3 + 32) || (strspn(fp + 3, senderset_hex) != 32)) {
+            return false;
+        }
+        memcpy(half, fp + 3, 16);
+        half[ 16 ] = '\0';
+        *hi = strtoull(half, NULL, 16);
+        *lo = strtoull(fp + 3 + 16, NULL, 16);
+        *wide = true;
+        return true;
+    }
+
+    if ((len == 0) || (len > 16) || (strspn(fp, senderset_hex) != len)) {
+        return false;
+    }
+    *hi = strtoull(fp, NULL, 16);
+    *lo = 0;
+    *wide = false;
+    return true;
+}
+
+yastr
+senderset_format_fp(const struct senderset_member *m, bool wide) {
+    if (wide) {
+        return yaslcatprintf(yaslempty(), "v2-%016llx%016llx",
+                (unsigned long long)m->hi, (unsigned long long)m->lo);
+    }
+    return yaslcatprintf(yaslempty(), "%llx", (unsigned long long)m->hi);
+}
+
+/* Looks a fingerprint up in an encoded block without decoding it. */
+bool
+senderset_lookup(
+        const void *block, size_t len, uint64_t hi, uint64_t lo, time_t *ts) {
+    struct senderset_header h;
+    const uint8_t *         offs;
+    uint64_t                target, lo_i;
+    uint32_t                ts_i;
+    size_t                  i, n, half;
+
+    if (!senderset_header(block, len, &h) || (h.n == 0) || (hi < h.base)) {
+        return false;
+    }
+
+    offs = (const uint8_t *)block + sizeof(h);
+    target = hi - h.base;
+
+    /* A branchless lower bound: the loop runs the same number of times
+     * whatever the data, and the comparison compiles to a conditional move
+     * instead of a branch that mispredicts half the time.
+     */
+    i = 0;
+    for (n = h.n; n > 1; n -= half) {
+        half = n / 2;
+        i = (senderset_load(offs + ((i + half) * h.width), h.width) < target)
+                    ? i + half
+                    : i;
+    }
+    i += (senderset_load(offs + (i * h.width), h.width) < target);
+
+    /* Only wide members can share an offset, and then only by a 64-bit
+     * collision.
+     */
+    for (; (i < h.n) &&
+            (senderset_load(offs + (i * h.width), h.width) == target);
+            i++) {
+        if (h.flags & SENDERSET_WIDE) {
+            memcpy(&lo_i,
+                    offs + ((size_t)h.n * h.width) + (i * sizeof(uint64_t)),
+                    sizeof(uint64_t));
+            if (lo_i != lo) {
+                continue;
+            }
+        }
+        memcpy(&ts_i, (const uint8_t *)block + len - (h.n - i) * sizeof(ts_i),
+                sizeof(ts_i));
+        *ts = h.tbase + ts_i;
+        return true;
+    }
+
+    return false;
+}
+
+vac_result
+senderset_decode(const void *block, size_t len, struct senderset *set) {
+    struct senderset_header h;
+    const uint8_t *         offs, *los, *tss;
+    uint32_t                ts_i;
+    size_t                  i;
+
+    memset(set, 0, sizeof(*set));
+
+    if (!senderset_header(block, len, &h)) {
+        syslog(LOG_ALERT, "senderset_decode: bad block");
+        return VAC_RESULT_PERMFAIL;
+    }
+
+    if ((set->members = calloc(h.n + 1, sizeof(*set->members))) == NULL) {
+        syslog(LOG_ALERT, "senderset_decode: calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+    set->alloc = h.n + 1;
+    set->n = h.n;
+    set->wide = h.flags & SENDERSET_WIDE;
+
+    offs = (const uint8_t *)block + sizeof(h);
+    los = offs + ((size_t)h.n * h.width);
+    tss = (const uint8_t *)block + len - ((size_t)h.n * sizeof(ts_i));
+
+    for (i = 0; i < h.n; i++) {
+        set->members[ i ].hi =
+                h.base + senderset_load(offs + (i * h.width), h.width);
+        if (set->wide) {
+            memcpy(&set->members[ i ].lo, los + (i * sizeof(uint64_t)),
+                    sizeof(uint64_t));
+        }
+        memcpy(&ts_i, tss + (i * sizeof(ts_i)), sizeof(ts_i));
+        set->members[ i ].ts = h.tbase + ts_i;
+    }
+
+    return VAC_RESULT_OK;
+}
+
+/* The size of count members starting at start, encoded as one block. */
+size_t
+senderset_encoded_len(const struct senderset *set, size_t start, size_t count) {
+    if (count == 0) {
+        return sizeof(struct senderset_header);
+    }
+    return senderset_len(count,
+            senderset_width(set->members[ start + count - 1 ].hi -
+                            set->members[ start ].hi),
+            set->wide);
+}
+
+/* The largest block LMDB keeps on a leaf page of page_size bytes, next to a
+ * key of key_len bytes, instead of moving it to overflow pages. This mirrors
+ * LMDB's me_nodemax: a page must fit two nodes after its 16 byte header,
+ * less a 2 byte index slot, and each node has an 8 byte header of its own.
+ */
+size_t
+senderset_block_max(size_t page_size, size_t key_len) {
+    return (((page_size - 16) / 2) & ~(size_t)1) - sizeof(uint16_t) - 8 -
+           key_len;
+}
+
+/* Encodes count members starting at start into buf, which must hold
+ * senderset_encoded_len bytes.
+ */
+void
+senderset_encode(
+        const struct senderset *set, size_t start, size_t count, void *buf) {
+    struct senderset_header        h;
+    const struct senderset_member *m = set->members + start;
+    uint8_t *                      offs, *los, *tss;
+    uint64_t                       off;
+    uint32_t                       ts_i;
+    size_t                         i;
+    unsigned                       b;
+
+    memset(&h, 0, sizeof(h));
+    h.n = count;
+    h.flags = set->wide ? SENDERSET_WIDE : 0;
+    if (count > 0) {
+        h.base = m[ 0 ].hi;
+        h.width = senderset_width(m[ count - 1 ].hi - h.base);
+        h.tbase = m[ 0 ].ts;
+        for (i = 1; i < count; i++) {
+            if (m[ i ].ts < h.tbase) {
+                h.tbase = m[ i ].ts;
+            }
+        }
+    } else {
+        h.width = 1;
+    }
+    memcpy(buf, &h, sizeof(h));
+
+    offs = (uint8_t *)buf + sizeof(h);
+    los = offs + (count * h.width);
+    tss = los + (set->wide ? count * sizeof(uint64_t) : 0);
+
+    for (i = 0; i < count; i++) {
+        off = m[ i ].hi - h.base;
+        for (b = 0; b < h.width; b++) {
+            offs[ (i * h.width) + b ] = (uint8_t)(off >> (8 * b));
+        }
+        if (set->wide) {
+            memcpy(los + (i * sizeof(uint64_t)), &m[ i ].lo, sizeof(uint64_t));
+        }
+        /* 32 bits of seconds is over a century, far beyond any interval. */
+        ts_i = ((m[ i ].ts - h.tbase) > UINT32_MAX)
+                       ? UINT32_MAX
+                       : (uint32_t)(m[ i ].ts - h.tbase);
+        memcpy(tss + (i * sizeof(ts_i)), &ts_i, sizeof(ts_i));
+    }
+}
+
+/* Records ts for a member, adding it if it isn't there. With keep_newer an
+ * existing member is only updated if ts is newer. changed is set if the set
+ * was modified.
+ */
+vac_result
+senderset_update(struct senderset *set, uint64_t hi, uint64_t lo, time_t ts,
+        bool keep_newer, bool *changed) {
+    struct senderset_member *members;
+    size_t                   i;
+    bool                     found;
+
+    *changed = false;
+    i = senderset_find(set, hi, lo, &found);
+
+    if (found) {
+        if (!keep_newer || (set->members[ i ].ts < ts)) {
+            set->members[ i ].ts = ts;
+            *changed = true;
+        }
+        return VAC_RESULT_OK;
+    }
+
+    if (set->n == set->alloc) {
+        if ((members = realloc(set->members,
+                     (set->alloc * 2 + 8) * sizeof(*members))) == NULL) {
+            syslog(LOG_ALERT, "senderset_update: realloc: %m");
+            return VAC_RESULT_TEMPFAIL;
+        }
+        set->members = members;
+        set->alloc = set->alloc * 2 + 8;
+    }
+
+    memmove(set->members + i + 1, set->members + i,
+            (set->n - i) * sizeof(*set->members));
+    set->members[ i ].hi = hi;
+    set->members[ i ].lo = lo;
+    set->members[ i ].ts = ts;
+    set->n++;
+    *changed = true;
+
+    return VAC_RESULT_OK;
+}
+
+/* Removes members recorded before a time, and returns how many there were. */
+size_t
+senderset_expire(struct senderset *set, time_t before) {
+    size_t i, n = 0;
+
+    for (i = 0; i < set->n; i++) {
+        if (set->members[ i ].ts >= before) {
+            set->members[ n++ ] = set->members[ i ];
+        }
+    }
+
+    i = set->n - n;
+    set->n = n;
+    return i;
+}
+
+void
+senderset_free(struct senderset *set) {
+    free(set->members);
+    memset(set, 0, sizeof(*set));
+}
+
+static size_t
+senderset_len(size_t n, unsigned width, bool wide) {
+    return sizeof(struct senderset_header) + (n * width) +
+           (wide ? n * sizeof(uint64_t) : 0) + (n * sizeof(uint32_t));
+}
+
+/* The number of bytes needed to hold an offset. */
+static unsigned
+senderset_width(uint64_t range) {
+    unsigned width = 1;
+
+    while ((width < 8) && (range >> (8 * width))) {
+        width++;
+    }
+    return width;
+}
+
+/* Copies out and checks the header of an encoded block. */
+static bool
+senderset_header(const void *block, size_t len, struct senderset_header *h) {
+    if (len < sizeof(*h)) {
+        return false;
+    }
+    memcpy(h, block, sizeof(*h));
+    return (h->width >= 1) && (h->width <= 8) &&
+           (len == senderset_len(h->n, h->width, h->flags & SENDERSET_WIDE));
+}
+
+/* Loads a packed offset. Reading the eight bytes that end with it avoids a
+ * loop over its width; the header in front means they're always in bounds.
+ */
+static uint64_t
+senderset_load(const uint8_t *p, unsigned width) {
+    uint64_t v;
+
+    memcpy(&v, p + width - sizeof(v), sizeof(v));
+    return le64toh(v) >> (8 * (sizeof(v) - width));
+}
+
+/* The position of a member, or of where it would be inserted. */
+static size_t
+senderset_find(
+        const struct senderset *set, uint64_t hi, uint64_t lo, bool *found) {
+    size_t left = 0, right = set->n, mid;
+
+    while (left < right) {
+        mid = left + (right - left) / 2;
+        if ((set->members[ mid ].hi < hi) ||
+                ((set->members[ mid ].hi == hi) &&
+                        (set->members[ mid ].lo < lo))) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+
+    *found = (left < set->n) && (set->members[ left ].hi == hi) &&
+             (set->members[ left ].lo == lo);
+    return left;
+}
@@ -0,0 +1,41 @@
+#ifndef SENDERSET_H
+#define SENDERSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "simvacation.h"
+
+/* A sender fingerprint as a set member. Rabin fingerprints only use hi; the
+ * 128-bit v2 fingerprints are split across both halves, and sets of them are
+ * "wide".
+ */
+struct senderset_member {
+    uint64_t hi;
+    uint64_t lo;
+    time_t   ts;
+};
+
+/* A decoded block, with its members sorted by fingerprint. */
+struct senderset {
+    struct senderset_member *members;
+    size_t                   n;
+    size_t                   alloc;
+    bool                     wide;
+};
+
+bool       senderset_parse_fp(const char *, uint64_t *, uint64_t *, bool *);
+yastr      senderset_format_fp(const struct senderset_member *, bool);
+bool       senderset_lookup(const void *, size_t, uint64_t, uint64_t, time_t *);
+vac_result senderset_decode(const void *, size_t, struct senderset *);
+size_t     senderset_encoded_len(const struct senderset *, size_t, size_t);
+size_t     senderset_block_max(size_t, size_t);
+void       senderset_encode(const struct senderset *, size_t, size_t, void *);
+vac_result senderset_update(
+        struct senderset *, uint64_t, uint64_t, time_t, bool, bool *);
+size_t     senderset_expire(struct senderset *, time_t);
+void       senderset_free(struct senderset *);
+
+#endif /* SENDERSET_H */
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+/* SHA-1 (FIPS 180-4). This is only used to name Lua scripts for EVALSHA, the
+ * way Redis does, and must not be relied on for anything security related.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "sha1.h"
+
+#define SHA1_ROTL(x, b) (uint32_t)(((x) << (b)) | ((x) >> (32 - (b))))
+
+static void sha1_block(uint32_t *, const uint8_t *);
+
+void
+sha1(const void *in, size_t inlen, uint8_t *out) {
+    const uint8_t *p = in;
+    uint32_t       h[ 5 ] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+            0xc3d2e1f0};
+    uint8_t        last[ 128 ];
+    uint64_t       bits = (uint64_t)inlen * 8;
+    size_t         left, lastlen, i;
+
+    for (left = inlen; left >= 64; left -= 64, p += 64) {
+        sha1_block(h, p);
+    }
+
+    /* The message is padded with a one bit, zeros, and its length in bits,
+     * which takes one or two more blocks.
+     */
+    memset(last, 0, sizeof(last));
+    memcpy(last, p, left);
+    last[ left ] = 0x80;
+    lastlen = (left < 56) ? 64 : 128;
+    for (i = 0; i < 8; i++) {
+        last[ lastlen - 1 - i ] = (uint8_t)(bits >> (8 * i));
+    }
+    sha1_block(h, last);
+    if (lastlen == 128) {
+        sha1_block(h, last + 64);
+    }
+
+    for (i = 0; i < 20; i++) {
+        out[ i ] = (uint8_t)(h[ i / 4 ] >> (24 - (8 * (i % 4))));
+    }
+}
+
+static void
+sha1_block(uint32_t *h, const uint8_t *p) {
+    uint32_t w[ 80 ];
+    uint32_t a, b, c, d, e, f, k, t;
+    int      i;
+
+    for (i = 0; i < 16; i++) {
+        w[ i ] = ((uint32_t)p[ i * 4 ] << 24) |
+                 ((uint32_t)p[ (i * 4) + 1 ] << 16) |
+                 ((uint32_t)p[ (i * 4) + 2 ] << 8) | p[ (i * 4) + 3 ];
+    }
+    for (; i < 80; i++) {
+        w[ i ] = SHA1_ROTL(w[ i - 3 ] ^ w[ i - 8 ] ^ w[ i - 14 ] ^ w[ i - 16 ],
+                1);
+    }
+
+    a = h[ 0 ];
+    b = h[ 1 ];
+    c = h[ 2 ];
+    d = h[ 3 ];
+    e = h[ 4 ];
+
+    for (i = 0; i < 80; i++) {
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = SHA1_ROTL(a, 5) + f + e + k + w[ i ];
+        e = d;
+        d = c;
+        c = SHA1_ROTL(b, 30);
+        b = a;
+        a = t;
+    }
+
+    h[ 0 ] += a;
+    h[ 1 ] += b;
+    h[ 2 ] += c;
+    h[ 3 ] += d;
+    h[ 4 ] += e;
+}
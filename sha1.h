@@ -0,0 +1,11 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_LEN 20
+
+void sha1(const void *, size_t, uint8_t *);
+
+#endif /* SHA1_H */
@@ -20,11 +20,26 @@
 #include "vlu.h"
 #include "vutil.h"
 
-void usage(void);
+/* Recipients are looked up and cleaned a batch at a time as the VDB hands
+ * them over, so memory use doesn't depend on how many there are.
+ */
+#define SIMUNVACATION_BATCH 1000
+
+struct simunvacation {
+    struct vlu_backend *vlu;
+    VLU *               vluh;
+    struct vdb_backend *vdb;
+    VDB *               vdbh;
+};
+
+static vac_result simunvacation_names(const yastr *, size_t, void *);
+void              usage(void);
 
 int
 main(int argc, char **argv) {
     int          debug = 0;
+    int          compact = 0;
+    int          retval = 0;
     extern int   optind, opterr;
     extern char *optarg;
     char         ch;
@@ -36,14 +51,15 @@ main(int argc, char **argv) {
 
     char *config_file = NULL;
 
-    yastr               uniqname;
-    ucl_object_iter_t   i;
-    const ucl_object_t *uniqnames;
-    const ucl_object_t *obj;
+    struct simunvacation ctx;
 
-    while ((ch = getopt(argc, argv, "c:d")) != EOF) {
+    while ((ch = getopt(argc, argv, "Cc:d")) != EOF) {
         switch ((char)ch) {
 
+        case 'C':
+            compact = 1;
+            break;
+
         case 'c':
             config_file = optarg;
             break;
@@ -78,8 +94,6 @@ main(int argc, char **argv) {
         exit(1);
     }
 
-    uniqnames = vdb->get_names(vdbh);
-
     if ((vlu = vlu_backend(ucl_object_tostring(
                  ucl_object_lookup_path(vac_config, "core.vlu")))) == NULL) {
         vdb->close(vdbh);
@@ -91,34 +105,62 @@ main(int argc, char **argv) {
         exit(1);
     }
 
-    i = ucl_object_iterate_new(uniqnames);
-    while ((obj = ucl_object_iterate_safe(i, false)) != NULL) {
-        uniqname = yaslauto(ucl_object_tostring(obj));
-        switch (vlu->search(vluh, uniqname)) {
+    ctx.vlu = vlu;
+    ctx.vluh = vluh;
+    ctx.vdb = vdb;
+    ctx.vdbh = vdbh;
+    if (vdb->get_names(vdbh, SIMUNVACATION_BATCH, simunvacation_names,
+                &ctx) != VAC_RESULT_OK) {
+        syslog(LOG_ERR, "error listing recipients");
+        retval = 1;
+    }
+
+    /* Vacuum the database. */
+    vdb->gc(vdbh);
+
+    /* Shrink it. */
+    if (compact && (vdb->compact(vdbh) != VAC_RESULT_OK)) {
+        retval = 1;
+    }
+
+    vdb->close(vdbh);
+    vlu->close(vluh);
+    exit(retval);
+}
+
+static vac_result
+simunvacation_names(const yastr *names, size_t n, void *arg) {
+    struct simunvacation *ctx = arg;
+    size_t                i;
+    vac_result            rc;
+
+    for (i = 0; i < n; i++) {
+        /* Groups are recorded under their canonical name too, so look for
+         * one before deciding the name has gone, as simvacation does.
+         */
+        if ((rc = ctx->vlu->search(ctx->vluh, names[ i ])) ==
+                VAC_RESULT_PERMFAIL) {
+            rc = ctx->vlu->group_search(ctx->vluh, names[ i ]);
+        }
+        switch (rc) {
         case VAC_RESULT_PERMFAIL:
-            syslog(LOG_INFO, "cleaning up %s", uniqname);
-            vdb->clean(vdbh, uniqname);
+            syslog(LOG_INFO, "cleaning up %s", names[ i ]);
+            ctx->vdb->clean(ctx->vdbh, names[ i ]);
             break;
         case VAC_RESULT_TEMPFAIL:
-            syslog(LOG_ERR, "lookup error processing %s", uniqname);
+            syslog(LOG_ERR, "lookup error processing %s", names[ i ]);
             break;
         default:
-            syslog(LOG_DEBUG, "leaving %s alone", uniqname);
+            syslog(LOG_DEBUG, "leaving %s alone", names[ i ]);
             break;
         }
-        yaslfree(uniqname);
     }
 
-    /* Vacuum the database. */
-    vdb->gc(vdbh);
-
-    vdb->close(vdbh);
-    vlu->close(vluh);
-    exit(0);
+    return VAC_RESULT_OK;
 }
 
 void
 usage(void) {
-    fprintf(stderr, "usage: simunvacation [-c config_file] [-d]\n");
+    fprintf(stderr, "usage: simunvacation [-C] [-c config_file] [-d]\n");
     exit(1);
 }
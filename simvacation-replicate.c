@@ -0,0 +1,746 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha1.h"
+#include "simvacation.h"
+#include "vdb.h"
+#include "vjournal.h"
+#include "vutil.h"
+
+/* Keeps the reply state of several nodes in step without a shared store.
+ *
+ * Each node journals the replies it stores (replicate.journal), and this
+ * daemon streams that journal to every peer, remembering how far each one
+ * has acknowledged. A peer loads what it receives into its own VDB, where
+ * the newer timestamp wins, so redelivered records are harmless and the
+ * nodes converge whatever order they hear from each other in.
+ *
+ * The protocol is line based: the sender writes journal records followed by
+ * an empty line, and the receiver answers "ok" once they are stored. When
+ * replicate.secret is set the receiver first sends a random challenge, and
+ * the sender has to answer with its HMAC-SHA1 under the secret. Nothing is
+ * encrypted, so TCP peers should be on a trusted network or tunnel.
+ * Journal segments are expired after core.interval, so a peer that has been
+ * unreachable for longer than that only catches up on replies that still
+ * matter.
+ */
+
+#define REPLICATE_BACKOFF_MAX 60
+#define REPLICATE_TIMEOUT 60
+#define REPLICATE_NONCE_LEN 16
+#define REPLICATE_HMAC_BLOCK 64
+
+struct replicate_peer {
+    const char *addr;
+    pid_t       pid;
+    time_t      restart;
+};
+
+static int        replicate_socket(const char *, bool);
+static void       replicate_send(const char *);
+static vac_result replicate_send_batch(int, FILE *, struct vjournal_pos *);
+static void       replicate_receive(int);
+static bool       replicate_challenge(int, FILE *);
+static bool       replicate_answer(int, FILE *);
+static yastr      replicate_mac(const char *);
+static void       replicate_timeout(int, time_t);
+static bool       write_all(int, const char *, size_t);
+static void       replicate_terminate(int);
+static void       usage(void);
+
+static volatile sig_atomic_t terminate = 0;
+
+static const char *journal;
+static const char *secret;
+static time_t      span;
+static size_t      batch;
+
+int
+main(int argc, char **argv) {
+    int                    ch, fd, lfd = -1, status;
+    bool                   debug = false;
+    char *                 config_file = NULL;
+    const char *           listen_addr;
+    const ucl_object_t *   peers, *obj;
+    ucl_object_iter_t      iter;
+    struct replicate_peer *peer = NULL;
+    size_t                 i, npeers = 0;
+    struct pollfd          pfd;
+    struct sigaction       sa;
+    pid_t                  pid;
+    time_t                 now, interval, expired = 0;
+
+    while ((ch = getopt(argc, argv, "c:d")) != EOF) {
+        switch ((char)ch) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'd':
+            debug = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+    }
+
+    if (debug) {
+        openlog("simvacation-replicate", LOG_NOWAIT | LOG_PERROR | LOG_PID,
+                LOG_VACATION);
+    } else {
+        openlog("simvacation-replicate", LOG_PID, LOG_VACATION);
+        setlogmask(LOG_UPTO(LOG_INFO));
+    }
+
+    if (read_vacation_config(config_file) != VAC_RESULT_OK) {
+        exit(1);
+    }
+
+    journal = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "replicate.journal"));
+    span = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "replicate.segment_span"));
+    batch = ucl_object_toint(
+            ucl_object_lookup_path(vac_config, "replicate.batch"));
+    interval = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "core.interval"));
+    listen_addr = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "replicate.listen"));
+    secret = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "replicate.secret"));
+    if (secret && (*secret == '\0')) {
+        secret = NULL;
+    }
+    peers = ucl_object_lookup_path(vac_config, "replicate.peers");
+
+    if ((span < 1) || (batch < 1)) {
+        syslog(LOG_ERR, "replicate.segment_span and replicate.batch must be "
+                        "positive");
+        exit(1);
+    }
+
+    if ((npeers = ucl_array_size(peers)) > 0) {
+        if ((journal == NULL) || (*journal == '\0')) {
+            syslog(LOG_ERR, "replicate.peers is set but replicate.journal "
+                            "is not");
+            exit(1);
+        }
+        if ((peer = calloc(npeers, sizeof(struct replicate_peer))) == NULL) {
+            syslog(LOG_ERR, "calloc: %m");
+            exit(1);
+        }
+        iter = ucl_object_iterate_new(peers);
+        for (i = 0; (obj = ucl_object_iterate_safe(iter, false)) != NULL;
+                i++) {
+            peer[ i ].addr = ucl_object_tostring(obj);
+        }
+        ucl_object_iterate_free(iter);
+    }
+
+    /* Anyone who can connect can overwrite reply state, which a UNIX socket
+     * restricts by its permissions but TCP doesn't.
+     */
+    if (listen_addr && (*listen_addr != '\0') && (*listen_addr != '/') &&
+            (secret == NULL)) {
+        syslog(LOG_ERR, "replicate.listen is a TCP address but "
+                        "replicate.secret is not set");
+        exit(1);
+    }
+
+    if (listen_addr && (*listen_addr != '\0') &&
+            ((lfd = replicate_socket(listen_addr, true)) < 0)) {
+        exit(1);
+    }
+
+    if ((lfd < 0) && (npeers == 0)) {
+        syslog(LOG_ERR, "neither replicate.listen nor replicate.peers is set");
+        exit(1);
+    }
+
+    /* A peer going away mid-write is handled where the write fails. */
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = replicate_terminate;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    syslog(LOG_INFO, "started with %zu peers%s", npeers,
+            (lfd < 0) ? "" : ", accepting connections");
+
+    while (!terminate) {
+        if ((now = time(NULL)) < 0) {
+            syslog(LOG_ERR, "time: %m");
+            exit(1);
+        }
+
+        /* Each peer gets its own sender; one that dies is restarted after a
+         * pause, so a persistent fault doesn't spin.
+         */
+        for (i = 0; i < npeers; i++) {
+            if ((peer[ i ].pid != 0) || (peer[ i ].restart > now)) {
+                continue;
+            }
+            if ((peer[ i ].pid = fork()) < 0) {
+                syslog(LOG_ERR, "fork: %m");
+                peer[ i ].pid = 0;
+                peer[ i ].restart = now + REPLICATE_BACKOFF_MAX;
+            } else if (peer[ i ].pid == 0) {
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                if (lfd >= 0) {
+                    close(lfd);
+                }
+                replicate_send(peer[ i ].addr);
+                exit(1);
+            }
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < npeers; i++) {
+                if (peer[ i ].pid == pid) {
+                    syslog(LOG_ERR, "sender for %s exited", peer[ i ].addr);
+                    peer[ i ].pid = 0;
+                    peer[ i ].restart = now + REPLICATE_BACKOFF_MAX;
+                }
+            }
+        }
+
+        if ((npeers > 0) && (now - expired >= span)) {
+            vjournal_expire(journal, span, now - interval);
+            expired = now;
+        }
+
+        if (lfd < 0) {
+            sleep(1);
+            continue;
+        }
+
+        pfd.fd = lfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) < 0) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "poll: %m");
+                exit(1);
+            }
+            continue;
+        }
+
+        if ((pfd.revents & POLLIN) == 0) {
+            continue;
+        }
+
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno != EINTR) {
+                syslog(LOG_ERR, "accept: %m");
+            }
+            continue;
+        }
+
+        if ((pid = fork()) < 0) {
+            syslog(LOG_ERR, "fork: %m");
+        } else if (pid == 0) {
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGINT, SIG_DFL);
+            close(lfd);
+            replicate_receive(fd);
+            exit(0);
+        }
+        close(fd);
+    }
+
+    /* Receivers finish when their senders go away. */
+    for (i = 0; i < npeers; i++) {
+        if (peer[ i ].pid > 0) {
+            kill(peer[ i ].pid, SIGTERM);
+        }
+    }
+
+    syslog(LOG_INFO, "exiting");
+    exit(0);
+}
+
+/* Addresses are either host:port or the path of a UNIX socket. An empty
+ * host means the loopback address, and listening on every interface takes
+ * an explicit "*".
+ */
+static int
+replicate_socket(const char *addr, bool listening) {
+    int                fd = -1, rc;
+    const int          on = 1;
+    char *             host, *port;
+    struct sockaddr_un sun;
+    struct addrinfo    hints, *res, *ai;
+
+    if (*addr == '/') {
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            syslog(LOG_ERR, "replicate_socket %s: path too long", addr);
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            syslog(LOG_ERR, "replicate_socket socket: %m");
+            return -1;
+        }
+
+        if (listening) {
+            if ((unlink(addr) != 0) && (errno != ENOENT)) {
+                syslog(LOG_ERR, "replicate_socket unlink %s: %m", addr);
+            }
+            rc = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+        } else {
+            rc = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+        }
+
+        if ((rc != 0) || (listening && (listen(fd, SOMAXCONN) != 0))) {
+            syslog(listening ? LOG_ERR : LOG_INFO, "replicate_socket %s: %m",
+                    addr);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    host = strdup(addr);
+    if ((port = strrchr(host, ':')) == NULL) {
+        syslog(LOG_ERR, "replicate_socket %s: expected host:port", addr);
+        free(host);
+        return -1;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (listening && (strcmp(host, "*") == 0)) {
+        hints.ai_flags = AI_PASSIVE;
+    }
+
+    if ((rc = getaddrinfo(((*host == '\0') || (strcmp(host, "*") == 0))
+                                         ? NULL
+                                         : host,
+                 port, &hints, &res)) != 0) {
+        syslog(LOG_ERR, "replicate_socket getaddrinfo %s: %s", addr,
+                gai_strerror(rc));
+        free(host);
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) <
+                0) {
+            continue;
+        }
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if ((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) &&
+                    (listen(fd, SOMAXCONN) == 0)) {
+                break;
+            }
+        } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd < 0) {
+        syslog(listening ? LOG_ERR : LOG_INFO, "replicate_socket %s: %m",
+                addr);
+    }
+
+    freeaddrinfo(res);
+    free(host);
+    return fd;
+}
+
+static void
+replicate_send(const char *addr) {
+    int                 fd;
+    unsigned int        backoff = 1;
+    char *              p;
+    FILE *              in;
+    yastr               state;
+    struct vjournal_pos pos;
+
+    state = yaslcatprintf(yaslempty(), "%s/replicate-", ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "replicate.state")));
+    for (p = (char *)addr; *p; p++) {
+        state = yaslcatlen(state, strchr("/:", *p) ? "_" : p, 1);
+    }
+    state = yaslcat(state, ".pos");
+
+    if (vjournal_pos_load(state, &pos) != VAC_RESULT_OK) {
+        exit(1);
+    }
+
+    for (;;) {
+        if ((fd = replicate_socket(addr, false)) < 0) {
+            sleep(backoff);
+            backoff = MIN(backoff * 2, REPLICATE_BACKOFF_MAX);
+            continue;
+        }
+
+        backoff = 1;
+        syslog(LOG_INFO, "connected to %s at %lld:%lld", addr,
+                (long long)pos.segment, (long long)pos.offset);
+
+        /* Don't wait forever on a peer that has wedged. */
+        replicate_timeout(fd, REPLICATE_TIMEOUT);
+
+        if ((in = fdopen(dup(fd), "r")) == NULL) {
+            syslog(LOG_ERR, "fdopen: %m");
+            exit(1);
+        }
+
+        if ((secret == NULL) || replicate_answer(fd, in)) {
+            while (replicate_send_batch(fd, in, &pos) == VAC_RESULT_OK) {
+                if (vjournal_pos_save(state, &pos) != VAC_RESULT_OK) {
+                    exit(1);
+                }
+            }
+        }
+
+        syslog(LOG_INFO, "disconnected from %s", addr);
+        fclose(in);
+        close(fd);
+    }
+}
+
+/* Sends the next batch of live records and waits for them to be
+ * acknowledged, advancing pos if they are.
+ */
+static vac_result
+replicate_send_batch(int fd, FILE *in, struct vjournal_pos *pos) {
+    struct vdb_entry *  entries;
+    struct vjournal_pos next = *pos;
+    size_t              i, n;
+    time_t              now;
+    char                reply[ 16 ];
+    yastr               buf;
+    vac_result          retval = VAC_RESULT_TEMPFAIL;
+
+    if ((entries = calloc(batch, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        exit(1);
+    }
+
+    if (vjournal_read(journal, span, &next, entries, batch, &n) !=
+            VAC_RESULT_OK) {
+        free(entries);
+        sleep(1);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if ((n == 0) && (memcmp(&next, pos, sizeof(next)) == 0)) {
+        free(entries);
+        usleep(ucl_object_todouble(ucl_object_lookup_path(
+                       vac_config, "replicate.poll")) *
+                1000000);
+        *pos = next;
+        return VAC_RESULT_OK;
+    }
+
+    now = time(NULL);
+    buf = yaslempty();
+    for (i = 0; i < n; i++) {
+        if (entries[ i ].expires > now) {
+            buf = vjournal_format(buf, entries + i);
+        }
+    }
+    buf = yaslcat(buf, "\n");
+    vdb_entries_free(entries, n);
+
+    if (!write_all(fd, buf, yasllen(buf))) {
+        syslog(LOG_INFO, "replicate_send write: %m");
+    } else if (fgets(reply, sizeof(reply), in) == NULL) {
+        syslog(LOG_INFO, "replicate_send: no acknowledgement");
+    } else if (strcmp(reply, "ok\n") != 0) {
+        syslog(LOG_ERR, "replicate_send: peer failed to store replies");
+    } else {
+        syslog(LOG_DEBUG, "replicate_send: sent %zu records", n);
+        *pos = next;
+        retval = VAC_RESULT_OK;
+    }
+
+    yaslfree(buf);
+    return retval;
+}
+
+static void
+replicate_receive(int fd) {
+    FILE *              in;
+    char *              line = NULL;
+    size_t              cap = 0, n = 0, skipped = 0;
+    ssize_t             len;
+    struct vdb_entry *  entries;
+    struct vdb_backend *vdb;
+    VDB *               vdbh;
+
+    if ((entries = calloc(batch, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        return;
+    }
+
+    if (((vdb = vdb_backend(ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "core.vdb")))) == NULL) ||
+            ((vdbh = vdb->init("simvacation-replicate")) == NULL)) {
+        free(entries);
+        return;
+    }
+
+    if ((in = fdopen(fd, "r")) == NULL) {
+        syslog(LOG_ERR, "fdopen: %m");
+        vdb->close(vdbh);
+        free(entries);
+        return;
+    }
+
+    if ((secret != NULL) && !replicate_challenge(fd, in)) {
+        fclose(in);
+        vdb->close(vdbh);
+        free(entries);
+        return;
+    }
+
+    while ((len = getline(&line, &cap, in)) > 0) {
+        if (line[ len - 1 ] == '\n') {
+            line[ --len ] = '\0';
+        }
+
+        /* A record that can't be parsed would be sent again and again if it
+         * held up the batch, so it is dropped.
+         */
+        if (len > 0) {
+            if (vjournal_parse(line, entries + n) != VAC_RESULT_OK) {
+                skipped++;
+                continue;
+            }
+            if (++n < batch) {
+                continue;
+            }
+        }
+
+        /* Replies are stored as they arrive, but only acknowledged at the
+         * end of the sender's batch.
+         */
+        if ((n > 0) && (vdb->load(vdbh, entries, n) != VAC_RESULT_OK)) {
+            break;
+        }
+        for (; n > 0; n--) {
+            yaslfree(entries[ n - 1 ].rcpt);
+            yaslfree(entries[ n - 1 ].fp);
+        }
+
+        if (len > 0) {
+            continue;
+        }
+
+        if (skipped > 0) {
+            syslog(LOG_ERR, "replicate_receive: skipped %zu malformed records",
+                    skipped);
+            skipped = 0;
+        }
+
+        if (!write_all(fd, "ok\n", 3)) {
+            syslog(LOG_INFO, "replicate_receive write: %m");
+            break;
+        }
+    }
+
+    vdb_entries_free(entries, n);
+    free(line);
+    fclose(in);
+    vdb->close(vdbh);
+}
+
+/* Sends a random challenge and checks the answer, so that only peers that
+ * know replicate.secret can store replies.
+ */
+static bool
+replicate_challenge(int fd, FILE *in) {
+    int     rfd;
+    uint8_t nonce[ REPLICATE_NONCE_LEN ];
+    char    answer[ (SHA1_LEN * 2) + 16 ];
+    yastr   challenge, expected;
+    size_t  i;
+    uint8_t diff = 0;
+    bool    retval = false;
+
+    if (((rfd = open("/dev/urandom", O_RDONLY)) < 0) ||
+            (read(rfd, nonce, sizeof(nonce)) != sizeof(nonce))) {
+        syslog(LOG_ERR, "replicate_challenge /dev/urandom: %m");
+        if (rfd >= 0) {
+            close(rfd);
+        }
+        return false;
+    }
+    close(rfd);
+
+    challenge = yaslempty();
+    for (i = 0; i < sizeof(nonce); i++) {
+        challenge = yaslcatprintf(challenge, "%02x", nonce[ i ]);
+    }
+    expected = replicate_mac(challenge);
+    expected = yaslcat(expected, "\n");
+    challenge = yaslcat(challenge, "\n");
+
+    /* Don't let a peer that never answers hold the connection open. */
+    replicate_timeout(fd, REPLICATE_TIMEOUT);
+
+    if (!write_all(fd, challenge, yasllen(challenge))) {
+        syslog(LOG_INFO, "replicate_challenge write: %m");
+    } else if (fgets(answer, sizeof(answer), in) == NULL) {
+        syslog(LOG_NOTICE, "replicate_challenge: no answer");
+    } else {
+        /* Compare in constant time. */
+        for (i = 0; i < yasllen(expected); i++) {
+            diff |= expected[ i ] ^ answer[ i ];
+            if (answer[ i ] == '\0') {
+                diff = 1;
+                break;
+            }
+        }
+        if (diff != 0) {
+            syslog(LOG_ERR, "replicate_challenge: authentication failed");
+        } else {
+            retval = true;
+        }
+    }
+
+    replicate_timeout(fd, 0);
+    yaslfree(challenge);
+    yaslfree(expected);
+    return retval;
+}
+
+static bool
+replicate_answer(int fd, FILE *in) {
+    char  challenge[ (REPLICATE_NONCE_LEN * 2) + 16 ];
+    char *p;
+    yastr answer;
+    bool  retval = true;
+
+    if (fgets(challenge, sizeof(challenge), in) == NULL) {
+        syslog(LOG_INFO, "replicate_answer: no challenge");
+        return false;
+    }
+    if ((p = strchr(challenge, '\n')) != NULL) {
+        *p = '\0';
+    }
+
+    answer = replicate_mac(challenge);
+    answer = yaslcat(answer, "\n");
+    if (!write_all(fd, answer, yasllen(answer))) {
+        syslog(LOG_INFO, "replicate_answer write: %m");
+        retval = false;
+    }
+
+    yaslfree(answer);
+    return retval;
+}
+
+/* HMAC-SHA1 of the message under replicate.secret, in hex. */
+static yastr
+replicate_mac(const char *msg) {
+    uint8_t key[ REPLICATE_HMAC_BLOCK ];
+    uint8_t inner[ SHA1_LEN ], mac[ SHA1_LEN ];
+    uint8_t outer[ REPLICATE_HMAC_BLOCK + SHA1_LEN ];
+    uint8_t *buf;
+    size_t   len, i;
+    yastr    hex;
+
+    memset(key, 0, sizeof(key));
+    if ((len = strlen(secret)) > sizeof(key)) {
+        sha1(secret, len, key);
+    } else {
+        memcpy(key, secret, len);
+    }
+
+    len = strlen(msg);
+    if ((buf = malloc(REPLICATE_HMAC_BLOCK + len)) == NULL) {
+        syslog(LOG_ERR, "malloc: %m");
+        exit(1);
+    }
+    for (i = 0; i < REPLICATE_HMAC_BLOCK; i++) {
+        buf[ i ] = key[ i ] ^ 0x36;
+        outer[ i ] = key[ i ] ^ 0x5c;
+    }
+    memcpy(buf + REPLICATE_HMAC_BLOCK, msg, len);
+    sha1(buf, REPLICATE_HMAC_BLOCK + len, inner);
+    free(buf);
+
+    memcpy(outer + REPLICATE_HMAC_BLOCK, inner, SHA1_LEN);
+    sha1(outer, sizeof(outer), mac);
+
+    hex = yaslempty();
+    for (i = 0; i < SHA1_LEN; i++) {
+        hex = yaslcatprintf(hex, "%02x", mac[ i ]);
+    }
+    return hex;
+}
+
+static void
+replicate_timeout(int fd, time_t secs) {
+    struct timeval tv;
+
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static bool
+write_all(int fd, const char *buf, size_t len) {
+    ssize_t rc;
+
+    while (len > 0) {
+        if ((rc = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += rc;
+        len -= rc;
+    }
+
+    return true;
+}
+
+static void
+replicate_terminate(int sig) {
+    terminate = 1;
+}
+
+static void
+usage(void) {
+    fprintf(stderr, "usage: simvacation-replicate [-d] [-c config]\n");
+    exit(1);
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rabin.h"
+#include "simvacation.h"
+#include "vdb.h"
+#include "vutil.h"
+
+/* Reports what a VDB holds: how many replies, how old they are, how many
+ * have expired without being collected, and which recipients have replied to
+ * the most senders, followed by the backend's own size and health figures.
+ *
+ * The contents are read through the backend's walk, one batch at a time, and
+ * summarised in fixed space so that the tool can be pointed at a database of
+ * any size. Distinct recipients are estimated with a HyperLogLog, the busiest
+ * recipients are tracked with the Space-Saving algorithm, and entries per
+ * recipient are counted over runs of consecutive entries for the same
+ * recipient, which is exact for backends that walk in recipient order.
+ */
+
+#define VDBSTAT_HLL_BITS 14
+#define VDBSTAT_HLL_REGISTERS (1 << VDBSTAT_HLL_BITS)
+#define VDBSTAT_RUN_BUCKETS 48
+
+static const struct {
+    time_t      age;
+    const char *label;
+} vdbstat_ages[] = {
+        {3600, "< 1 hour"},
+        {86400, "< 1 day"},
+        {259200, "< 3 days"},
+        {604800, "< 7 days"},
+        {2592000, "< 30 days"},
+        {0, ">= 30 days"},
+};
+
+#define VDBSTAT_AGES (sizeof(vdbstat_ages) / sizeof(vdbstat_ages[ 0 ]))
+
+struct vdbstat_counter {
+    yastr              rcpt;
+    uint64_t           hash;
+    unsigned long long count;
+    unsigned long long error;
+};
+
+struct vdbstat {
+    time_t                  now;
+    time_t                  interval;
+    unsigned long long      entries;
+    unsigned long long      expired;
+    unsigned long long      future;
+    unsigned long long      ages[ VDBSTAT_AGES ];
+    unsigned long long      runs;
+    unsigned long long      run_sizes[ VDBSTAT_RUN_BUCKETS ];
+    uint8_t                 hll[ VDBSTAT_HLL_REGISTERS ];
+    yastr                   rcpt;
+    uint64_t                rcpt_hash;
+    unsigned long long      run;
+    struct vdbstat_counter *top;
+    size_t                  ntop;
+    size_t                  maxtop;
+};
+
+static vac_result vdbstat_batch(
+        const struct vdb_entry *, size_t, const yastr, void *);
+static void   vdbstat_run_end(struct vdbstat *);
+static void   vdbstat_top_add(struct vdbstat *, unsigned long long);
+static double vdbstat_hll_estimate(const struct vdbstat *);
+static int    vdbstat_top_cmp(const void *, const void *);
+static void   vdbstat_report(struct vdbstat *, size_t);
+static void   usage(void);
+
+int
+main(int argc, char **argv) {
+    int                 ch;
+    bool                debug = false;
+    size_t              batch = 1000, top = 10, i;
+    char *              config_file = NULL;
+    const char *        provider;
+    struct vdbstat *    vs;
+    struct vdb_backend *vdb;
+    VDB *               vdbh;
+    ucl_object_t *      backend_stats;
+    unsigned char *     emitted;
+    double              start;
+    vac_result          retval;
+
+    while ((ch = getopt(argc, argv, "b:c:dk:")) != EOF) {
+        switch ((char)ch) {
+        case 'b':
+            if ((batch = strtoul(optarg, NULL, 10)) < 1) {
+                usage();
+            }
+            break;
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'd':
+            debug = true;
+            break;
+        case 'k':
+            if ((top = strtoul(optarg, NULL, 10)) < 1) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+    }
+
+    if (debug) {
+        openlog("simvacation-vdbstat", LOG_NOWAIT | LOG_PERROR | LOG_PID,
+                LOG_VACATION);
+    } else {
+        openlog("simvacation-vdbstat", LOG_PERROR | LOG_PID, LOG_VACATION);
+        setlogmask(LOG_UPTO(LOG_NOTICE));
+    }
+
+    if (read_vacation_config(config_file) != VAC_RESULT_OK) {
+        exit(1);
+    }
+
+    if ((vs = calloc(1, sizeof(struct vdbstat))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        exit(1);
+    }
+
+    /* Extra counters make the reported ones more accurate when the busiest
+     * recipients aren't much busier than the rest.
+     */
+    vs->maxtop = top * 10;
+    if ((vs->top = calloc(vs->maxtop, sizeof(struct vdbstat_counter))) ==
+            NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        exit(1);
+    }
+
+    if ((vs->now = time(NULL)) < 0) {
+        syslog(LOG_ERR, "time: %m");
+        exit(1);
+    }
+    vs->interval = (time_t)ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "core.interval"));
+
+    provider = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "core.vdb"));
+    if (((vdb = vdb_backend(provider)) == NULL) ||
+            ((vdbh = vdb->init("simvacation-vdbstat")) == NULL)) {
+        exit(1);
+    }
+
+    start = monotonic_seconds();
+    retval = vdb->walk(vdbh, NULL, batch, vdbstat_batch, vs);
+    vdbstat_run_end(vs);
+    syslog(LOG_INFO, "walked %llu entries in %.1fs", vs->entries,
+            monotonic_seconds() - start);
+
+    /* Backends that can't be walked still have a footprint to report. */
+    if (retval == VAC_RESULT_OK) {
+        vdbstat_report(vs, top);
+    } else if (retval == VAC_RESULT_TEMPFAIL) {
+        syslog(LOG_ERR, "walk failed after %llu entries", vs->entries);
+    }
+
+    printf("Backend (%s):\n", provider);
+    backend_stats = vdb->stats(vdbh);
+    if ((emitted = ucl_object_emit(backend_stats, UCL_EMIT_CONFIG)) != NULL) {
+        printf("%s\n", emitted);
+        free(emitted);
+    }
+    ucl_object_unref(backend_stats);
+
+    vdb->close(vdbh);
+
+    for (i = 0; i < vs->ntop; i++) {
+        yaslfree(vs->top[ i ].rcpt);
+    }
+    free(vs->top);
+    yaslfree(vs->rcpt);
+    free(vs);
+
+    exit((retval == VAC_RESULT_TEMPFAIL) ? 1 : 0);
+}
+
+static vac_result
+vdbstat_batch(const struct vdb_entry *entries, size_t n, const yastr cursor,
+        void *arg) {
+    struct vdbstat *vs = arg;
+    size_t          i, j;
+    time_t          expires, age;
+    uint64_t        h;
+    int             rank;
+
+    for (i = 0; i < n; i++) {
+        vs->entries++;
+
+        expires = entries[ i ].expires ? entries[ i ].expires
+                                       : entries[ i ].ts + vs->interval;
+        if (expires <= vs->now) {
+            vs->expired++;
+        }
+
+        if ((age = vs->now - entries[ i ].ts) < 0) {
+            vs->future++;
+        } else {
+            for (j = 0; vdbstat_ages[ j ].age && (age >= vdbstat_ages[ j ].age);
+                    j++)
+                ;
+            vs->ages[ j ]++;
+        }
+
+        if (vs->rcpt && (strcmp(vs->rcpt, entries[ i ].rcpt) == 0)) {
+            vs->run++;
+            continue;
+        }
+
+        vdbstat_run_end(vs);
+        vs->rcpt = yaslcpy(vs->rcpt ? vs->rcpt : yaslempty(),
+                entries[ i ].rcpt);
+        vs->rcpt_hash = vdb_mix(rabin_fingerprint(
+                entries[ i ].rcpt, yasllen(entries[ i ].rcpt)));
+        vs->run = 1;
+
+        /* The top bits pick a register, which keeps the longest run of
+         * leading zeros seen in the rest. The low bit set below the
+         * remaining bits caps the run for an all-zero remainder.
+         */
+        h = (vs->rcpt_hash << VDBSTAT_HLL_BITS) |
+            (1ULL << (VDBSTAT_HLL_BITS - 1));
+        rank = __builtin_clzll(h) + 1;
+        if (rank > vs->hll[ vs->rcpt_hash >> (64 - VDBSTAT_HLL_BITS) ]) {
+            vs->hll[ vs->rcpt_hash >> (64 - VDBSTAT_HLL_BITS) ] = rank;
+        }
+    }
+
+    return VAC_RESULT_OK;
+}
+
+static void
+vdbstat_run_end(struct vdbstat *vs) {
+    int bucket;
+
+    if (vs->run == 0) {
+        return;
+    }
+
+    vs->runs++;
+    bucket = 63 - __builtin_clzll(vs->run);
+    vs->run_sizes[ bucket < VDBSTAT_RUN_BUCKETS ? bucket
+                                                  : VDBSTAT_RUN_BUCKETS - 1 ]++;
+    vdbstat_top_add(vs, vs->run);
+    vs->run = 0;
+}
+
+/* Space-Saving: when every counter is taken, the smallest is handed to the
+ * new recipient, which inherits its count as a bound on the error.
+ */
+static void
+vdbstat_top_add(struct vdbstat *vs, unsigned long long count) {
+    size_t                  i;
+    struct vdbstat_counter *min = NULL;
+
+    for (i = 0; i < vs->ntop; i++) {
+        if ((vs->top[ i ].hash == vs->rcpt_hash) &&
+                (strcmp(vs->top[ i ].rcpt, vs->rcpt) == 0)) {
+            vs->top[ i ].count += count;
+            return;
+        }
+        if ((min == NULL) || (vs->top[ i ].count < min->count)) {
+            min = vs->top + i;
+        }
+    }
+
+    if (vs->ntop < vs->maxtop) {
+        min = vs->top + vs->ntop++;
+        min->rcpt = yasldup(vs->rcpt);
+        min->count = count;
+        min->error = 0;
+    } else {
+        min->rcpt = yaslcpy(min->rcpt, vs->rcpt);
+        min->error = min->count;
+        min->count += count;
+    }
+    min->hash = vs->rcpt_hash;
+}
+
+static double
+vdbstat_hll_estimate(const struct vdbstat *vs) {
+    double m = VDBSTAT_HLL_REGISTERS, sum = 0, estimate;
+    size_t i, zeros = 0;
+
+    for (i = 0; i < VDBSTAT_HLL_REGISTERS; i++) {
+        sum += ldexp(1, -vs->hll[ i ]);
+        if (vs->hll[ i ] == 0) {
+            zeros++;
+        }
+    }
+
+    estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+    /* Linear counting is more accurate while most registers are empty. */
+    if ((estimate <= 2.5 * m) && (zeros > 0)) {
+        estimate = m * log(m / zeros);
+    }
+
+    return estimate;
+}
+
+static int
+vdbstat_top_cmp(const void *a, const void *b) {
+    const struct vdbstat_counter *x = a;
+    const struct vdbstat_counter *y = b;
+
+    return (y->count > x->count) - (y->count < x->count);
+}
+
+static void
+vdbstat_report(struct vdbstat *vs, size_t top) {
+    size_t i;
+    double recipients, pct;
+
+    pct = vs->entries ? 100.0 / vs->entries : 0;
+    recipients = vs->entries ? vdbstat_hll_estimate(vs) : 0;
+
+    printf("Entries: %llu\n", vs->entries);
+    printf("Expired but not collected: %llu (%.1f%%)\n", vs->expired,
+            vs->expired * pct);
+    if (vs->future) {
+        printf("Dated in the future: %llu\n", vs->future);
+    }
+    printf("Recipients: about %.0f\n", recipients);
+
+    printf("\nEntries by age:\n");
+    for (i = 0; i < VDBSTAT_AGES; i++) {
+        printf("  %-12s %12llu %6.1f%%\n", vdbstat_ages[ i ].label,
+                vs->ages[ i ], vs->ages[ i ] * pct);
+    }
+
+    printf("\nEntries per recipient:\n");
+    if (vs->runs > recipients * 1.1 + 1) {
+        printf("  (this backend doesn't walk in recipient order, so these "
+               "are\n   runs of consecutive entries rather than recipients)\n");
+    }
+    for (i = 0; i < VDBSTAT_RUN_BUCKETS; i++) {
+        if (vs->run_sizes[ i ] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            printf("  %-24s %12llu\n", "1", vs->run_sizes[ i ]);
+        } else {
+            printf("  %11llu-%-12llu %12llu\n", 1ULL << i,
+                    (2ULL << i) - 1, vs->run_sizes[ i ]);
+        }
+    }
+
+    qsort(vs->top, vs->ntop, sizeof(struct vdbstat_counter),
+            vdbstat_top_cmp);
+    printf("\nTop recipients by sender count:\n");
+    for (i = 0; (i < top) && (i < vs->ntop); i++) {
+        if (vs->top[ i ].error) {
+            printf("  %12llu  %s (overcounted by at most %llu)\n",
+                    vs->top[ i ].count, vs->top[ i ].rcpt,
+                    vs->top[ i ].error);
+        } else {
+            printf("  %12llu  %s\n", vs->top[ i ].count,
+                    vs->top[ i ].rcpt);
+        }
+    }
+    printf("\n");
+}
+
+static void
+usage(void) {
+    fprintf(stderr, "usage: simvacation-vdbstat [-d] [-b batch] [-c config] "
+                    "[-k top]\n");
+    exit(1);
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+#include "vjournal.h"
+#include "vutil.h"
+
+/* Streams reply state out of one VDB and into another, so that changing
+ * backends (or layouts) doesn't forget who has already had a reply.
+ *
+ * Each backend is described by its own configuration file. The backends
+ * read vac_config as they go, so it is switched to the matching file around
+ * every call.
+ */
+
+struct vdbtool {
+    ucl_object_t *      src_config;
+    ucl_object_t *      dst_config;
+    struct vdb_backend *dst;
+    VDB *               dsth;
+    FILE *              out;
+    const char *        checkpoint;
+    time_t              now;
+    time_t              src_interval;
+    unsigned long long  copied;
+    unsigned long long  expired;
+};
+
+static ucl_object_t *vdbtool_config(const char *);
+static vac_result    vdbtool_batch(
+           const struct vdb_entry *, size_t, const yastr, void *);
+static vac_result vdbtool_import(struct vdbtool *, size_t);
+static yastr      vdbtool_resume(const char *);
+static vac_result vdbtool_checkpoint(const char *, const yastr);
+static void       usage(void);
+
+int
+main(int argc, char **argv) {
+    int                 ch;
+    bool                debug = false;
+    size_t              batch = 1000;
+    const char *        mode;
+    struct vdbtool      tool;
+    struct vdb_backend *src = NULL;
+    VDB *               srch = NULL;
+    yastr               resume = NULL;
+    double              start;
+    vac_result          retval = VAC_RESULT_TEMPFAIL;
+
+    memset(&tool, 0, sizeof(tool));
+
+    while ((ch = getopt(argc, argv, "b:dr:")) != EOF) {
+        switch ((char)ch) {
+        case 'b':
+            if ((batch = strtoul(optarg, NULL, 10)) < 1) {
+                usage();
+            }
+            break;
+        case 'd':
+            debug = true;
+            break;
+        case 'r':
+            tool.checkpoint = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2) {
+        usage();
+    }
+    mode = argv[ 0 ];
+
+    if (debug) {
+        openlog("simvacation-vdbtool", LOG_NOWAIT | LOG_PERROR | LOG_PID,
+                LOG_VACATION);
+    } else {
+        openlog("simvacation-vdbtool", LOG_PERROR | LOG_PID, LOG_VACATION);
+        setlogmask(LOG_UPTO(LOG_INFO));
+    }
+
+    if ((tool.now = time(NULL)) < 0) {
+        syslog(LOG_ERR, "time: %m");
+        exit(1);
+    }
+
+    if (strcmp(mode, "export") == 0) {
+        if ((argc != 2) ||
+                ((tool.src_config = vdbtool_config(argv[ 1 ])) == NULL)) {
+            usage();
+        }
+        tool.out = stdout;
+    } else if (strcmp(mode, "import") == 0) {
+        if ((argc != 2) ||
+                ((tool.dst_config = vdbtool_config(argv[ 1 ])) == NULL)) {
+            usage();
+        }
+    } else if (strcmp(mode, "migrate") == 0) {
+        if ((argc != 3) ||
+                ((tool.src_config = vdbtool_config(argv[ 1 ])) == NULL) ||
+                ((tool.dst_config = vdbtool_config(argv[ 2 ])) == NULL)) {
+            usage();
+        }
+    } else {
+        usage();
+    }
+
+    if (tool.dst_config) {
+        vac_config = tool.dst_config;
+        if (((tool.dst = vdb_backend(ucl_object_tostring(
+                      ucl_object_lookup_path(vac_config, "core.vdb")))) ==
+                    NULL) ||
+                ((tool.dsth = tool.dst->init("simvacation-vdbtool")) ==
+                        NULL)) {
+            goto done;
+        }
+    }
+
+    start = monotonic_seconds();
+
+    if (tool.src_config == NULL) {
+        retval = vdbtool_import(&tool, batch);
+    } else {
+        vac_config = tool.src_config;
+        tool.src_interval = (time_t)ucl_object_todouble(
+                ucl_object_lookup_path(vac_config, "core.interval"));
+        if (((src = vdb_backend(ucl_object_tostring(
+                      ucl_object_lookup_path(vac_config, "core.vdb")))) ==
+                    NULL) ||
+                ((srch = src->init("simvacation-vdbtool")) == NULL)) {
+            goto done;
+        }
+
+        if (tool.checkpoint && ((resume = vdbtool_resume(tool.checkpoint)) !=
+                                       NULL)) {
+            syslog(LOG_INFO, "resuming from %s", resume);
+        }
+
+        retval = src->walk(srch, resume, batch, vdbtool_batch, &tool);
+
+        /* A finished run shouldn't be resumed. */
+        if ((retval == VAC_RESULT_OK) && tool.checkpoint &&
+                (unlink(tool.checkpoint) != 0) && (errno != ENOENT)) {
+            syslog(LOG_ERR, "unlink %s: %m", tool.checkpoint);
+        }
+    }
+
+    syslog(LOG_INFO, "%s %llu entries, skipped %llu expired, in %.1fs",
+            (retval == VAC_RESULT_OK) ? "copied" : "stopped after copying",
+            tool.copied, tool.expired, monotonic_seconds() - start);
+
+done:
+    if (srch) {
+        vac_config = tool.src_config;
+        src->close(srch);
+    }
+    if (tool.dsth) {
+        vac_config = tool.dst_config;
+        tool.dst->close(tool.dsth);
+    }
+    yaslfree(resume);
+    exit((retval == VAC_RESULT_OK) ? 0 : 1);
+}
+
+static ucl_object_t *
+vdbtool_config(const char *path) {
+    if (read_vacation_config(path) != VAC_RESULT_OK) {
+        return NULL;
+    }
+    return vac_config;
+}
+
+static vac_result
+vdbtool_batch(const struct vdb_entry *entries, size_t n, const yastr cursor,
+        void *arg) {
+    struct vdbtool *  tool = arg;
+    struct vdb_entry *live;
+    size_t            i, nlive = 0;
+    time_t            expires;
+    yastr             buf;
+    vac_result        retval = VAC_RESULT_OK;
+
+    if ((live = calloc(n + 1, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    /* There's no point carrying over replies that have already expired. */
+    for (i = 0; i < n; i++) {
+        expires = entries[ i ].expires ? entries[ i ].expires
+                                       : entries[ i ].ts + tool->src_interval;
+        if (expires <= tool->now) {
+            tool->expired++;
+        } else {
+            live[ nlive ] = entries[ i ];
+            live[ nlive++ ].expires = expires;
+        }
+    }
+
+    if (nlive > 0) {
+        if (tool->out) {
+            buf = yaslempty();
+            for (i = 0; i < nlive; i++) {
+                buf = vjournal_format(buf, live + i);
+            }
+            if ((fwrite(buf, 1, yasllen(buf), tool->out) != yasllen(buf)) ||
+                    (fflush(tool->out) != 0)) {
+                syslog(LOG_ERR, "write: %m");
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+            yaslfree(buf);
+        } else {
+            vac_config = tool->dst_config;
+            retval = tool->dst->load(tool->dsth, live, nlive);
+            vac_config = tool->src_config;
+        }
+    }
+    free(live);
+
+    if (retval != VAC_RESULT_OK) {
+        return retval;
+    }
+
+    tool->copied += nlive;
+
+    if (cursor) {
+        syslog(LOG_DEBUG, "copied %llu entries, cursor %s", tool->copied,
+                cursor);
+        if (tool->checkpoint) {
+            retval = vdbtool_checkpoint(tool->checkpoint, cursor);
+        }
+    }
+
+    return retval;
+}
+
+/* Reads the tab separated export format from stdin in batches. */
+static vac_result
+vdbtool_import(struct vdbtool *tool, size_t batch) {
+    struct vdb_entry *entries;
+    size_t            n = 0;
+    char              line[ 2048 ];
+    char *            p;
+    unsigned long     lineno = 0;
+    vac_result        retval = VAC_RESULT_OK;
+
+    if ((entries = calloc(batch, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    while ((retval == VAC_RESULT_OK) && fgets(line, sizeof(line), stdin)) {
+        lineno++;
+        if ((p = strchr(line, '\n')) != NULL) {
+            *p = '\0';
+        }
+
+        if (vjournal_parse(line, entries + n) != VAC_RESULT_OK) {
+            syslog(LOG_ERR, "stdin line %lu: malformed entry", lineno);
+            continue;
+        }
+
+        if (++n == batch) {
+            retval = vdbtool_batch(entries, n, NULL, tool);
+            for (; n > 0; n--) {
+                yaslfree(entries[ n - 1 ].rcpt);
+                yaslfree(entries[ n - 1 ].fp);
+            }
+        }
+    }
+
+    if ((retval == VAC_RESULT_OK) && (n > 0)) {
+        retval = vdbtool_batch(entries, n, NULL, tool);
+    }
+
+    vdb_entries_free(entries, n);
+    return retval;
+}
+
+static yastr
+vdbtool_resume(const char *path) {
+    FILE *f;
+    char  buf[ 1024 ];
+    char *p;
+    yastr resume = NULL;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "fopen %s: %m", path);
+        }
+        return NULL;
+    }
+
+    if (fgets(buf, sizeof(buf), f) != NULL) {
+        if ((p = strchr(buf, '\n')) != NULL) {
+            *p = '\0';
+        }
+        resume = yaslauto(buf);
+    }
+
+    fclose(f);
+    return resume;
+}
+
+/* The checkpoint is replaced atomically after each batch is safely stored,
+ * so an interrupted run resumes with at most one batch repeated.
+ */
+static vac_result
+vdbtool_checkpoint(const char *path, const yastr cursor) {
+    FILE *     f;
+    yastr      tmp;
+    vac_result retval = VAC_RESULT_TEMPFAIL;
+
+    tmp = yaslcatprintf(yaslauto(path), ".tmp");
+
+    if ((f = fopen(tmp, "w")) == NULL) {
+        syslog(LOG_ERR, "fopen %s: %m", tmp);
+        yaslfree(tmp);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    fprintf(f, "%s\n", cursor);
+    if ((fflush(f) != 0) || ferror(f) || (fsync(fileno(f)) != 0)) {
+        syslog(LOG_ERR, "write %s: %m", tmp);
+        fclose(f);
+    } else if (fclose(f) != 0) {
+        syslog(LOG_ERR, "fclose %s: %m", tmp);
+    } else if (rename(tmp, path) != 0) {
+        syslog(LOG_ERR, "rename %s: %m", tmp);
+    } else {
+        retval = VAC_RESULT_OK;
+    }
+
+    yaslfree(tmp);
+    return retval;
+}
+
+static void
+usage(void) {
+    fprintf(stderr,
+            "usage: simvacation-vdbtool [-d] [-b batch] [-r checkpoint] "
+            "export config\n"
+            "       simvacation-vdbtool [-d] [-b batch] import config\n"
+            "       simvacation-vdbtool [-d] [-b batch] [-r checkpoint] "
+            "migrate from_config to_config\n");
+    exit(1);
+}
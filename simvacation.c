@@ -27,29 +27,23 @@ yastr           append_header(yastr, char *, int);
 int             check_header(char *, const char *);
 int send_message(yastr, yastr, yastr, yastr, yastr, struct headers *);
 
-/* RFC 2822 2.1.1
- *  There are two limits that this standard places on the number of
- *  characters in a line. Each line of characters MUST be no more than
- *  998 characters, and SHOULD be no more than 78 characters, excluding
- *  the CRLF.
- */
-#define MAXLINE 1000
-
 extern int   optind, opterr;
 extern char *optarg;
 
 int
 main(int argc, char **argv) {
-    int   retval = EX_OK;
-    bool  debug = false;
-    int   ch, rc;
-    yastr from = NULL;
-    yastr canon_from = NULL;
-    yastr rcpt;
-    yastr vacmsg = NULL;
-    yastr progname;
-    char *p;
-    char *config_file = NULL;
+    int    retval = EX_OK;
+    bool   debug = false;
+    int    ch, rc;
+    yastr  from = NULL;
+    yastr  canon_from = NULL;
+    yastr  rcpt;
+    yastr  name = NULL;
+    yastr  vacmsg = NULL;
+    yastr  progname;
+    time_t interval;
+    char * p;
+    char * config_file = NULL;
 
     struct vdb_backend *vdb = NULL;
     VDB *               vdbh = NULL;
@@ -132,7 +126,13 @@ main(int argc, char **argv) {
         goto done;
     }
 
-    if ((vdbh = vdb->init(rcpt)) == NULL) {
+    /* Key suppression state on the recipient's canonical name, so that a
+     * sender gets one reply however the recipient was addressed.
+     */
+    name = vlu->name(vluh, rcpt);
+    syslog(LOG_DEBUG, "%s resolved to %s", rcpt, name);
+
+    if ((vdbh = vdb->init(name)) == NULL) {
         goto done;
     }
 
@@ -150,14 +150,15 @@ main(int argc, char **argv) {
         goto done;
     }
 
-    if (vdb->recent(vdbh, canon_from, vlu->interval(vluh, rcpt)) ==
-            VDB_STATUS_RECENT) {
+    interval = vlu->interval(vluh, rcpt);
+
+    if (vdb->recent(vdbh, canon_from, interval) == VDB_STATUS_RECENT) {
         syslog(LOG_DEBUG, "suppressed message for %s to %s", rcpt, from);
         goto done;
     }
 
     /* All the checks have passed, send the message. */
-    vdb->store_reply(vdbh, canon_from);
+    vdb->store_reply(vdbh, canon_from, interval);
 
     if ((vacmsg = vlu->message(vluh, rcpt)) == NULL) {
         vacmsg = yaslauto(ucl_object_tostring(
@@ -178,26 +179,41 @@ done:
     if (vlu) {
         vlu->close(vluh);
     }
+    yaslfree(name);
 
     exit(retval);
 }
 
 struct headers *
 readheaders(const ucl_object_t *names) {
-    struct headers *    h;
-    char *              p;
-    int                 state, stripfield = 0;
-    char                buf[ MAXLINE ];
-    yastr *             current_hdr = NULL;
-    yastr               rcpt_hdrs = yaslempty();
-    ucl_object_iter_t   i;
-    const ucl_object_t *obj;
-
-    h = calloc(1, sizeof(struct headers));
+    struct headers *      h;
+    struct header_reader *r;
+    char *                p;
+    char *                buf;
+    int                   state, stripfield = 0;
+    yastr *               current_hdr = NULL;
+    yastr                 rcpt_hdrs = yaslempty();
+    ucl_object_iter_t     i;
+    const ucl_object_t *  obj;
+
+    if ((h = calloc(1, sizeof(struct headers))) == NULL) {
+        syslog(LOG_ERR, "readheaders: calloc: %m");
+        yaslfree(rcpt_hdrs);
+        return NULL;
+    }
     h->rcpt_match = false;
 
-    state = HEADER_UNKNOWN;
-    while (fgets(buf, sizeof(buf), stdin) && *buf != '\n') {
+    if ((r = header_reader_new(fileno(stdin))) == NULL) {
+        free(h);
+        yaslfree(rcpt_hdrs);
+        return NULL;
+    }
+
+    /* Each field comes back whole and unfolded, however long it is, and
+     * nothing past the blank line that ends the header is examined.
+     */
+    while ((buf = header_reader_next(r)) != NULL) {
+        state = HEADER_UNKNOWN;
         if (check_header(buf, "Message-ID:") == 0) {
             state = HEADER_APPEND;
             stripfield = 1;
@@ -226,7 +242,7 @@ readheaders(const ucl_object_t *names) {
             }
             if (strncasecmp(p, "no", 2) != 0) {
                 syslog(LOG_DEBUG, "readheaders: suppressing message: %s", buf);
-                return NULL;
+                goto suppress;
             }
         }
         /* RFC 3834 2
@@ -241,7 +257,7 @@ readheaders(const ucl_object_t *names) {
              */
             state = HEADER_NOREPLY;
             syslog(LOG_DEBUG, "readheaders: suppressing message: %s", buf);
-            return NULL;
+            goto suppress;
         } else if (check_header(buf, "Precedence") == 0) {
             /* RFC 3834 2
              *  For instance, if the subject message contained a
@@ -269,7 +285,7 @@ readheaders(const ucl_object_t *names) {
                     syslog(LOG_DEBUG,
                             "readheaders: suppressing message: precedence %s",
                             p);
-                    return NULL;
+                    goto suppress;
                 }
             }
         } else if (check_header(buf, "X-Auto-Response-Suppress:") == 0) {
@@ -307,7 +323,7 @@ readheaders(const ucl_object_t *names) {
             if (is_substring("OOF", buf, false) ||
                     is_substring("All", buf, false)) {
                 syslog(LOG_DEBUG, "readheaders: suppressing message: %s", buf);
-                return NULL;
+                goto suppress;
             }
         }
         /* RFC 3834 2
@@ -326,14 +342,6 @@ readheaders(const ucl_object_t *names) {
             state = HEADER_APPEND;
             stripfield = 1;
             current_hdr = &h->subject;
-        } else if (!isspace(*buf)) {
-            /* Not a continuation of the previous header line, reset flag
-             *
-             * RFC 2822 2.2.3
-             *  Unfolding is accomplished by simply removing any CRLF
-             *  that is immediately followed by WSP.
-             */
-            state = HEADER_UNKNOWN;
         }
 
         switch (state) {
@@ -350,6 +358,15 @@ readheaders(const ucl_object_t *names) {
         }
     }
 
+    /* A field that couldn't be read whole may have hidden one that would
+     * have suppressed the reply.
+     */
+    if (r->truncated) {
+        syslog(LOG_NOTICE, "readheaders: suppressing message: header could "
+                           "not be read in full");
+        goto suppress;
+    }
+
     i = ucl_object_iterate_new(names);
     while (!h->rcpt_match &&
             (obj = ucl_object_iterate_safe(i, false)) != NULL) {
@@ -357,7 +374,19 @@ readheaders(const ucl_object_t *names) {
     }
     ucl_object_iterate_free(i);
 
+    header_reader_free(r);
+    yaslfree(rcpt_hdrs);
     return h;
+
+suppress:
+    header_reader_free(r);
+    yaslfree(rcpt_hdrs);
+    yaslfree(h->subject);
+    yaslfree(h->messageid);
+    yaslfree(h->references);
+    yaslfree(h->inreplyto);
+    free(h);
+    return NULL;
 }
 
 int
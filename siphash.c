@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+/* SipHash-2-4 (Aumasson and Bernstein), a keyed hash that is fast on short
+ * inputs like addresses. With a secret key its output can't be predicted, so
+ * collisions can't be manufactured. The output is 8 or 16 bytes, and matches
+ * the reference implementation's test vectors for both.
+ */
+
+#include <config.h>
+
+#include "siphash.h"
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND                                                         \
+    do {                                                                      \
+        v0 += v1;                                                             \
+        v1 = SIPHASH_ROTL(v1, 13);                                            \
+        v1 ^= v0;                                                             \
+        v0 = SIPHASH_ROTL(v0, 32);                                            \
+        v2 += v3;                                                             \
+        v3 = SIPHASH_ROTL(v3, 16);                                            \
+        v3 ^= v2;                                                             \
+        v0 += v3;                                                             \
+        v3 = SIPHASH_ROTL(v3, 21);                                            \
+        v3 ^= v0;                                                             \
+        v2 += v1;                                                             \
+        v1 = SIPHASH_ROTL(v1, 17);                                            \
+        v1 ^= v2;                                                             \
+        v2 = SIPHASH_ROTL(v2, 32);                                            \
+    } while (0)
+
+static uint64_t siphash_load64(const uint8_t *);
+static uint64_t siphash_load(const uint8_t *, size_t);
+static void     siphash_store(uint8_t *, uint64_t);
+
+void
+siphash(const uint8_t *key, const void *in, size_t inlen, uint8_t *out,
+        size_t outlen) {
+    const uint8_t *p = in;
+    uint64_t       v0 = 0x736f6d6570736575ULL;
+    uint64_t       v1 = 0x646f72616e646f6dULL;
+    uint64_t       v2 = 0x6c7967656e657261ULL;
+    uint64_t       v3 = 0x7465646279746573ULL;
+    uint64_t       k0, k1, m, b;
+    size_t         left;
+
+    k0 = siphash_load64(key);
+    k1 = siphash_load64(key + 8);
+
+    v3 ^= k1;
+    v2 ^= k0;
+    v1 ^= k1;
+    v0 ^= k0;
+    if (outlen == 16) {
+        v1 ^= 0xee;
+    }
+
+    for (left = inlen; left >= 8; left -= 8, p += 8) {
+        m = siphash_load64(p);
+        v3 ^= m;
+        SIPHASH_ROUND;
+        SIPHASH_ROUND;
+        v0 ^= m;
+    }
+
+    /* The final block holds what's left and the low byte of the length. */
+    b = ((uint64_t)inlen << 56) | siphash_load(p, left);
+    v3 ^= b;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    v0 ^= b;
+
+    v2 ^= (outlen == 16) ? 0xee : 0xff;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    siphash_store(out, v0 ^ v1 ^ v2 ^ v3);
+
+    if (outlen != 16) {
+        return;
+    }
+
+    v1 ^= 0xdd;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    SIPHASH_ROUND;
+    siphash_store(out + 8, v0 ^ v1 ^ v2 ^ v3);
+}
+
+/* Written out so that compilers can turn it into a single load on
+ * little-endian machines.
+ */
+static uint64_t
+siphash_load64(const uint8_t *p) {
+    return (uint64_t)p[ 0 ] | ((uint64_t)p[ 1 ] << 8) |
+           ((uint64_t)p[ 2 ] << 16) | ((uint64_t)p[ 3 ] << 24) |
+           ((uint64_t)p[ 4 ] << 32) | ((uint64_t)p[ 5 ] << 40) |
+           ((uint64_t)p[ 6 ] << 48) | ((uint64_t)p[ 7 ] << 56);
+}
+
+/* Reads the last, partial block as a little-endian integer. */
+static uint64_t
+siphash_load(const uint8_t *p, size_t len) {
+    uint64_t v = 0;
+
+    while (len > 0) {
+        len--;
+        v = (v << 8) | p[ len ];
+    }
+
+    return v;
+}
+
+static void
+siphash_store(uint8_t *p, uint64_t v) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        p[ i ] = (uint8_t)(v >> (8 * i));
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SIPHASH_KEY_LEN 16
+
+void siphash(const uint8_t *, const void *, size_t, uint8_t *, size_t);
+
+#endif /* SIPHASH_H */
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs vdb-bench with the same workload against each backend, with Redis on
+# a private local server and LMDB on tmpfs, so the results are comparable.
+#
+# usage: bench.sh path/to/vdb-bench [vdb-bench options]
+
+bench=$1
+shift
+opts=${*:--p 8 -n 5000 -r 1000 -s 100000 -z 1.0}
+
+tmpdir=$(mktemp -d "${TMPDIR_BENCH:-/dev/shm}/vdb-bench.XXXXXX" 2>/dev/null ||
+    mktemp -d)
+port=${BENCH_REDIS_PORT:-16379}
+redis_pid=
+
+cleanup() {
+    [ -n "$redis_pid" ] && kill "$redis_pid"
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT INT TERM
+
+run() {
+    name=$1
+    shift
+    printf 'core { vdb = %s; interval = 1h; }\n%s\n' "$name" "$*" \
+        > "$tmpdir/$name.conf"
+    echo
+    # shellcheck disable=SC2086
+    "$bench" -c "$tmpdir/$name.conf" -g "$tmpdir" $opts
+}
+
+run null
+
+mkdir "$tmpdir/lmdb"
+run lmdb "lmdb { path = $tmpdir/lmdb; mapsize = 64mb; }"
+rm -rf "$tmpdir/lmdb"
+mkdir "$tmpdir/lmdb"
+run lmdb "lmdb { path = $tmpdir/lmdb; mapsize = 64mb; shards = 8; }"
+rm -rf "$tmpdir/lmdb"
+
+run mmaphash "mmaphash { path = $tmpdir/vdb.mmh; }"
+run bloom "bloom { path = $tmpdir/vdb.bloom; }"
+run log "log { path = $tmpdir/log; }"
+
+if command -v redis-server >/dev/null; then
+    redis-server --port "$port" --save '' --appendonly no >/dev/null &
+    redis_pid=$!
+    sleep 1
+    for layout in keys hash; do
+        redis-cli -p "$port" flushall >/dev/null
+        run redis "redis { host = 127.0.0.1; port = $port; layout = $layout; }"
+        redis-cli -p "$port" info memory | grep '^used_memory_human'
+    done
+else
+    echo
+    echo "redis-server not found, skipping redis"
+fi
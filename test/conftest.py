@@ -3,6 +3,7 @@
 import errno
 import json
 import os
+import shutil
 import socket
 import subprocess
 import time
@@ -76,13 +77,13 @@ def openport(port):
             return port
 
 
-def redis():
-    port = openport(6379)
+def redis(port=6379, args=None):
+    port = openport(port)
 
     with open(os.devnull, 'w') as devnull:
         redis_proc = None
         try:
-            redis_proc = subprocess.Popen(['redis-server', '--port', str(port)], stdout=devnull, stderr=devnull)
+            redis_proc = subprocess.Popen(['redis-server', '--port', str(port)] + (args or []), stdout=devnull, stderr=devnull)
         except OSError as e:
             if e.errno != errno.ENOENT:
                 raise
@@ -106,6 +107,42 @@ def redis():
         }
 
 
+@pytest.fixture
+def redis_servers():
+    servers = []
+
+    def _redis_servers(count, args=None):
+        port = 6379
+        for _ in range(count):
+            server = redis(port, args)
+            if not server:
+                pytest.skip('redis-server not found')
+            servers.append(server)
+            port = server['port'] + 1
+        return ['127.0.0.1:{}'.format(s['port']) for s in servers[-count:]]
+
+    yield _redis_servers
+
+    for server in servers:
+        server['proc'].terminate()
+
+
+@pytest.fixture
+def redis_cli():
+    if not shutil.which('redis-cli'):
+        pytest.skip('redis-cli not found')
+
+    def _redis_cli(node, *args):
+        return subprocess.run(
+            ['redis-cli', '-p', node.split(':')[1]] + list(args),
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+
+    return _redis_cli
+
+
 @pytest.fixture(scope='session')
 def tool_path():
     def _tool_path(tool):
@@ -117,9 +154,22 @@ def tool_path():
 
 @pytest.fixture(
     params=[
+        'bloom',
+        'inject',
         'lmdb',
+        'lmdb_sharded',
+        'lmdb_sets',
+        'log',
+        'memory',
+        'mmaphash',
         'null',
         'redis',
+        'redis_hash',
+        'redis_sharded',
+        'redis_replica',
+        'tiered',
+        'tiered_degraded',
+        'writebehind',
     ],
 )
 def run_simvacation(request, tmp_path_factory, tool_path):
@@ -142,16 +192,114 @@ def run_simvacation(request, tmp_path_factory, tool_path):
         }
     }
 
-    redconf = None
-    if request.param == 'redis':
-        redconf = redis()
-        if not redconf:
+    redconfs = []
+    if request.param.startswith('redis'):
+        redconfs.append(redis())
+        if not redconfs[0]:
             pytest.skip('redis-server not found')
-        config['redis']['port'] = redconf['port']
+        config['core']['vdb'] = 'redis'
+        config['redis']['port'] = redconfs[0]['port']
+        if request.param == 'redis_hash':
+            config['redis']['layout'] = 'hash'
+        elif request.param == 'redis_sharded':
+            redconfs.append(redis(redconfs[-1]['port'] + 1))
+            redconfs.append(redis(redconfs[-1]['port'] + 1))
+            config['redis']['nodes'] = ['127.0.0.1:{}'.format(r['port']) for r in redconfs]
+        elif request.param == 'redis_replica':
+            primary = redconfs[0]['port']
+            redconfs.append(redis(primary + 1, ['--replicaof', '127.0.0.1', str(primary), '--replica-serve-stale-data', 'no']))
+            config['redis']['replicas'] = ['127.0.0.1:{}'.format(redconfs[-1]['port'])]
 
     elif request.param == 'lmdb':
         os.mkdir(config['lmdb']['path'])
 
+    elif request.param == 'lmdb_sharded':
+        os.mkdir(config['lmdb']['path'])
+        config['core']['vdb'] = 'lmdb'
+        config['lmdb']['shards'] = 4
+
+    elif request.param == 'lmdb_sets':
+        os.mkdir(config['lmdb']['path'])
+        config['core']['vdb'] = 'lmdb'
+        config['lmdb']['layout'] = 'sets'
+
+    elif request.param == 'inject':
+        os.mkdir(config['lmdb']['path'])
+        config['core']['vdb'] = 'inject:lmdb'
+        config['inject'] = {
+            'default': {
+                'latency': 0.01,
+                'distribution': 'exponential',
+                'max': 0.1,
+            },
+        }
+
+    elif request.param == 'bloom':
+        config['bloom'] = {
+            'path': os.path.join(tmpdir, 'vdb.bloom'),
+            'capacity': 1000,
+            # Lookups round out to whole spans.
+            'span': 1,
+        }
+
+    elif request.param == 'log':
+        config['log'] = {
+            'path': os.path.join(tmpdir, 'log'),
+        }
+
+    elif request.param == 'memory':
+        config['memory'] = {
+            'snapshot': os.path.join(tmpdir, 'memory.snapshot'),
+            'snapshot_interval': 0,
+        }
+
+    elif request.param == 'tiered':
+        os.mkdir(config['lmdb']['path'])
+        config['tiered'] = {
+            'local': 'mmaphash',
+            'remote': 'lmdb',
+        }
+        config['mmaphash'] = {
+            'path': os.path.join(tmpdir, 'vdb.mmh'),
+            'buckets': 1024,
+        }
+
+    elif request.param == 'tiered_degraded':
+        # The remote tier's directory doesn't exist, so it can't be opened.
+        config['core']['vdb'] = 'tiered'
+        config['tiered'] = {
+            'local': 'mmaphash',
+            'remote': 'lmdb',
+            'journal': os.path.join(tmpdir, 'journal'),
+        }
+        config['mmaphash'] = {
+            'path': os.path.join(tmpdir, 'vdb.mmh'),
+            'buckets': 1024,
+        }
+
+    elif request.param == 'writebehind':
+        # Queued replies are only visible through the local tier.
+        os.mkdir(config['lmdb']['path'])
+        config['core']['vdb'] = 'tiered'
+        config['tiered'] = {
+            'local': 'mmaphash',
+            'remote': 'writebehind',
+        }
+        config['writebehind'] = {
+            'backend': 'lmdb',
+            'path': os.path.join(tmpdir, 'writebehind'),
+        }
+        config['mmaphash'] = {
+            'path': os.path.join(tmpdir, 'vdb.mmh'),
+            'buckets': 1024,
+        }
+
+    elif request.param == 'mmaphash':
+        config['mmaphash'] = {
+            'path': os.path.join(tmpdir, 'vdb.mmh'),
+            'buckets': 1024,
+        }
+
     elif 'suppress' in request.function.__name__:
         pytest.xfail('The null VDB does not support storing state')
 
@@ -188,7 +336,7 @@ def run_simvacation(request, tmp_path_factory, tool_path):
 
     yield _run_simvacation
 
-    if redconf:
+    for redconf in redconfs:
         redconf['proc'].terminate()
 
 
@@ -199,3 +347,78 @@ def testmsg(request):
     msg['From'] = 'testsender@example.com'
     msg['To'] = 'testrcpt@example.com'
     return msg
+
+
+@pytest.fixture
+def simvacation_config(tmp_path, tool_path):
+    # Each named config gets its own directory, which is also its LMDB path
+    # unless the caller supplies another. Sections are merged over the
+    # defaults, and writing the same name again replaces the file.
+    def _simvacation_config(name='simvacation', **sections):
+        confdir = tmp_path / name
+        confdir.mkdir(exist_ok=True)
+        config = {
+            'core': {
+                'vdb': 'lmdb',
+                'vlu': 'null',
+                'interval': 60,
+                'sendmail': tool_path('test/sendmail') + ' -f "" $R',
+                'domain': 'example.com',
+            },
+            'lmdb': {
+                'path': str(confdir),
+            },
+        }
+        for section, values in sections.items():
+            config.setdefault(section, {}).update(values)
+
+        cfile = str(tmp_path / '{}.conf'.format(name))
+        with open(cfile, 'w') as f:
+            f.write(json.dumps(config, indent=4))
+        return cfile
+
+    return _simvacation_config
+
+
+@pytest.fixture
+def simvacation_deliver(tmp_path, tool_path, testmsg):
+    # Returns whether simvacation sent a reply.
+    def _simvacation_deliver(cfile, sender='testsender@example.com', rcpt='testrcpt'):
+        outdir = tmp_path / 'mailout'
+        outdir.mkdir(exist_ok=True)
+        for f in outdir.iterdir():
+            f.unlink()
+        subprocess.run(
+            [
+                tool_path('simvacation'),
+                '-c', cfile,
+                '-f', sender,
+                rcpt,
+            ],
+            env={
+                'PYTEST_TMPDIR': str(outdir),
+            },
+            input=str(testmsg),
+            check=True,
+            text=True,
+        )
+        return (outdir / 'sendmail.args').exists()
+
+    return _simvacation_deliver
+
+
+@pytest.fixture
+def vdbtool(tool_path):
+    def _vdbtool(*args, entries=None):
+        stdin = None
+        if entries is not None:
+            stdin = ''.join('\t'.join(str(field) for field in entry) + '\n' for entry in entries)
+        return subprocess.run(
+            [tool_path('simvacation-vdbtool')] + list(args),
+            input=stdin,
+            check=True,
+            capture_output=True,
+            text=True,
+        )
+
+    return _vdbtool
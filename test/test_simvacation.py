@@ -96,6 +96,348 @@ def test_suppress_interval(run_simvacation, testmsg, tmp_path_factory):
     assert res['content']
 
 
+def test_suppress_case(run_simvacation, testmsg, tmp_path_factory):
+    res = _run_simvacation(run_simvacation, testmsg, tmp_path_factory)
+    res = _run_simvacation(run_simvacation, testmsg, tmp_path_factory, rcpt='TestRcpt')
+
+    assert res['args'] is None
+    assert res['content'] is None
+
+
+def test_long_header(run_simvacation, testmsg, tmp_path_factory):
+    # The tail of an overlong field mustn't be mistaken for a field of its own.
+    testmsg['X-Long'] = 'a' * 991 + 'List-Unsubscribe'
+    res = _run_simvacation(run_simvacation, testmsg, tmp_path_factory)
+
+    assert res['content']['subject'] == 'Out of email contact (Re: simta test message for test_long_header)'
+
+
+def test_oversized_header(run_simvacation, testmsg, tmp_path_factory):
+    # A field too long to read mustn't hide one that suppresses the reply.
+    testmsg['X-Huge'] = 'a' * (2 * 1024 * 1024)
+    testmsg['List-Unsubscribe'] = '<mailto:unsubscribe@example.com>'
+    res = _run_simvacation(run_simvacation, testmsg, tmp_path_factory)
+
+    assert res['args'] is None
+    assert res['content'] is None
+
+
+def test_vdbtool_migrate(simvacation_config, simvacation_deliver, vdbtool, tmp_path):
+    src = simvacation_config('from')
+    dst = simvacation_config('to', lmdb={'shards': 4})
+
+    assert simvacation_deliver(src)
+
+    checkpoint = str(tmp_path / 'checkpoint')
+    vdbtool('-r', checkpoint, 'migrate', src, dst)
+    assert not os.path.exists(checkpoint)
+
+    assert not simvacation_deliver(dst)
+
+
+def test_fingerprint_migration(simvacation_config, simvacation_deliver, vdbtool):
+    core = {'fingerprint': 'rabin'}
+
+    assert simvacation_deliver(simvacation_config(core=core))
+
+    # The reply recorded under the Rabin fingerprint is still found.
+    core['fingerprint'] = 'siphash'
+    core['fingerprint_key'] = '000102030405060708090a0b0c0d0e0f'
+    assert not simvacation_deliver(simvacation_config(core=core))
+
+    # Without the fallback it isn't, and the new reply uses the new format.
+    core['fingerprint_fallback'] = False
+    cfile = simvacation_config(core=core)
+    assert simvacation_deliver(cfile)
+    assert not simvacation_deliver(cfile)
+
+    export = vdbtool('export', cfile)
+    fps = sorted(line.split('\t')[1] for line in export.stdout.splitlines())
+    assert len(fps) == 2
+    assert not fps[0].startswith('v2-')
+    assert fps[1].startswith('v2-')
+    assert len(fps[1]) == 35
+
+
+@pytest.mark.parametrize(
+    'core',
+    [
+        {'fingerprint': 'siphash'},
+        {'fingerprint': 'siphash', 'fingerprint_key': '0001020304'},
+        {'fingerprint': 'siphash', 'fingerprint_key': 'x' * 32},
+        {'fingerprint': 'md5'},
+    ],
+)
+def test_fingerprint_bad_config(simvacation_config, testmsg, tool_path, tmp_path, core):
+    res = subprocess.run(
+        [
+            tool_path('simvacation'),
+            '-c', simvacation_config(core=core),
+            '-f', 'testsender@example.com',
+            'testrcpt',
+        ],
+        env={
+            'PYTEST_TMPDIR': str(tmp_path),
+        },
+        input=str(testmsg),
+        text=True,
+    )
+    assert res.returncode == os.EX_TEMPFAIL
+    assert not (tmp_path / 'sendmail.args').exists()
+
+
+def test_vdbstat(simvacation_config, simvacation_deliver, tool_path):
+    cfile = simvacation_config()
+
+    for sender in ('a', 'b', 'c'):
+        simvacation_deliver(cfile, sender='{}@example.com'.format(sender))
+
+    res = subprocess.run(
+        [tool_path('simvacation-vdbstat'), '-c', cfile],
+        check=True,
+        capture_output=True,
+        text=True,
+    )
+    assert 'Entries: 3\n' in res.stdout
+    assert 'Expired but not collected: 0 ' in res.stdout
+    assert '  < 1 hour                3' in res.stdout
+    assert '             3  testrcpt\n' in res.stdout
+    assert 'leaf_pages' in res.stdout
+    assert 'free_pages' in res.stdout
+
+
+def test_lmdb_gc(simvacation_config, vdbtool, tool_path):
+    cfile = simvacation_config(
+        core={'group_interval': 60},
+        lmdb={'gc_batch': 2, 'gc_slice': 10},
+    )
+
+    now = int(time.time())
+    vdbtool('import', cfile, entries=(
+        [('testrcpt', '{:x}'.format(i), now - 3600, 0) for i in range(1, 6)] +
+        [('testrcpt', '{:x}'.format(i), now, 0) for i in range(6, 8)]
+    ))
+
+    # Each transaction examines two entries and the next picks up after them.
+    res = subprocess.run(
+        [tool_path('simunvacation'), '-d', '-c', cfile],
+        check=True,
+        capture_output=True,
+        text=True,
+    )
+    assert 'removed 5 of 7 entries in 4 transactions' in res.stderr
+
+    export = vdbtool('export', cfile)
+    assert sorted(line.split('\t')[1] for line in export.stdout.splitlines()) == ['6', '7']
+
+
+def test_lmdb_grow_compact(simvacation_config, vdbtool, tool_path, tmp_path):
+    cfile = simvacation_config(lmdb={'mapsize': 262144, 'mapsize_max': 67108864})
+
+    now = int(time.time())
+    entries = [('rcpt{}'.format(i % 100), '{:x}'.format(i), now - 3600, 0) for i in range(20000)]
+    entries.append(('testrcpt', '1', now, 0))
+
+    # The entries don't fit in the initial map.
+    res = vdbtool('import', cfile, entries=entries)
+    assert 'increased map size' in res.stderr
+    assert len(vdbtool('export', cfile).stdout.splitlines()) == 20001
+
+    data = tmp_path / 'simvacation' / 'data.mdb'
+    size = data.stat().st_size
+
+    subprocess.run([tool_path('simunvacation'), '-C', '-c', cfile], check=True)
+
+    assert data.stat().st_size < size / 4
+    assert vdbtool('export', cfile).stdout.startswith('testrcpt\t1\t')
+
+
+@pytest.mark.parametrize('layout', ['keys', 'hash'])
+def test_redis_names(simvacation_config, redis_servers, vdbtool, tool_path, layout):
+    cfile = simvacation_config(
+        core={'vdb': 'redis'},
+        redis={'nodes': redis_servers(1), 'layout': layout, 'batch': 1},
+    )
+
+    now = int(time.time())
+    rcpts = ['rcpt{}'.format(i) for i in range(5)]
+    vdbtool('import', cfile, entries=[(r, '{:x}'.format(i), now, now + 60) for r in rcpts for i in range(3)])
+
+    # Every recipient is listed once, however small the SCAN pages are.
+    res = subprocess.run(
+        [tool_path('simunvacation'), '-d', '-c', cfile],
+        check=True,
+        capture_output=True,
+        text=True,
+    )
+    for rcpt in rcpts:
+        assert res.stderr.count('leaving {} alone'.format(rcpt)) == 1
+
+
+@pytest.mark.parametrize('layout', ['keys', 'hash'])
+def test_redis_clean(simvacation_config, redis_servers, vdbtool, tool_path, layout):
+    server = os.environ.get('LDAP_SERVER')
+    if not server:
+        pytest.skip('Environment variable LDAP_SERVER is not set')
+
+    cfile = simvacation_config(
+        core={'vdb': 'redis', 'vlu': 'ldap'},
+        redis={'nodes': redis_servers(1), 'layout': layout, 'batch': 1},
+        ldap={
+            'uri': server,
+            'search_base': 'ou=People,dc=example,dc=com',
+            'group_search_base': 'ou=Groups,dc=example,dc=com',
+        },
+    )
+
+    now = int(time.time())
+    vdbtool('import', cfile, entries=[
+        (r, '{:x}'.format(i), now, now + 60)
+        for r in ('onvacation', 'onvacation.group', 'flowerysong', 'nosuchuser')
+        for i in range(3)
+    ])
+
+    # Groups are found by their canonical name as well as users.
+    subprocess.run([tool_path('simunvacation'), '-c', cfile], check=True)
+
+    export = vdbtool('export', cfile)
+    assert {line.split('\t')[0] for line in export.stdout.splitlines()} == {'onvacation', 'onvacation.group'}
+
+
+def test_redis_replica_wait(simvacation_config, simvacation_deliver, redis_servers, redis_cli):
+    primary = redis_servers(1)[0]
+    replica = redis_servers(1, ['--replicaof'] + primary.split(':'))[0]
+
+    for _ in range(50):
+        if 'master_link_status:up' in redis_cli(replica, 'INFO', 'replication'):
+            break
+        time.sleep(0.1)
+
+    cfile = simvacation_config(
+        core={'vdb': 'redis'},
+        redis={'nodes': [{'primary': primary, 'replicas': [replica]}]},
+    )
+    assert simvacation_deliver(cfile)
+
+    # The store is followed by a WAIT for the replica.
+    assert 'cmdstat_wait:calls=1,' in redis_cli(primary, 'INFO', 'commandstats')
+    assert not simvacation_deliver(cfile)
+
+
+def test_redis_legacy_keys(simvacation_config, simvacation_deliver, redis_servers, redis_cli, vdbtool):
+    node = redis_servers(1)[0]
+    cfile = simvacation_config(core={'vdb': 'redis'}, redis={'nodes': [node]})
+
+    assert simvacation_deliver(cfile)
+
+    # Turn the reply into one stored under the old, untagged key name.
+    fp = vdbtool('export', cfile).stdout.split('\t')[1]
+    redis_cli(node, 'RENAME', 'simvacation:user:{testrcpt}:' + fp, 'simvacation:user:testrcpt:' + fp)
+    redis_cli(node, 'DEL', 'simvacation:{testrcpt}:expiry')
+
+    assert not simvacation_deliver(cfile)
+    assert vdbtool('export', cfile).stdout.startswith('testrcpt\t{}\t'.format(fp))
+
+    cfile = simvacation_config(core={'vdb': 'redis'}, redis={'nodes': [node], 'legacy_keys': False})
+    assert simvacation_deliver(cfile)
+
+
+def test_redis_rebalance(simvacation_config, redis_servers, vdbtool):
+    nodes = redis_servers(4)
+
+    def _counts():
+        return [
+            len(vdbtool('export', simvacation_config(
+                'node{}'.format(i),
+                core={'vdb': 'redis'},
+                redis={'nodes': [node]},
+            )).stdout.splitlines())
+            for i, node in enumerate(nodes)
+        ]
+
+    now = int(time.time())
+    entries = [('rcpt{}'.format(i), '1', now, now + 60) for i in range(400)]
+
+    vdbtool('import', simvacation_config('ring', core={'vdb': 'redis'}, redis={'nodes': nodes[:3]}), entries=entries)
+    before = _counts()
+    assert sum(before) == 400
+    assert all(before[:3])
+    assert before[3] == 0
+
+    # With a node added, recipients only move to it, and only about a
+    # quarter of them do.
+    vdbtool('import', simvacation_config('ring', core={'vdb': 'redis'}, redis={'nodes': nodes}), entries=entries)
+    after = _counts()
+    assert after[:3] == before[:3]
+    assert 50 < after[3] < 150
+
+
+def test_replicate(simvacation_config, simvacation_deliver, vdbtool, tool_path, tmp_path):
+    sock = str(tmp_path / 'replicate.sock')
+    configs = {}
+    for name in ('a', 'b'):
+        replicate = {
+            'journal': str(tmp_path / name / 'journal'),
+            'state': str(tmp_path / name),
+            'poll': 0.1,
+            'secret': 'testsecret',
+        }
+        if name == 'a':
+            replicate['peers'] = [sock]
+        else:
+            replicate['listen'] = sock
+        configs[name] = simvacation_config(name, replicate=replicate)
+
+    procs = []
+    try:
+        for name in ('b', 'a'):
+            procs.append(subprocess.Popen([tool_path('simvacation-replicate'), '-c', configs[name]]))
+            while name == 'b' and not os.path.exists(sock):
+                time.sleep(0.1)
+
+        assert simvacation_deliver(configs['a'])
+
+        # Replies are only suppressed on b once a's reply has reached it.
+        for _ in range(100):
+            if vdbtool('export', configs['b']).stdout.startswith('testrcpt\t'):
+                break
+            time.sleep(0.1)
+
+        assert not simvacation_deliver(configs['b'])
+
+    finally:
+        for proc in procs:
+            proc.terminate()
+            proc.wait()
+
+
+def test_tiered_replay(simvacation_config, simvacation_deliver, vdbtool, tool_path, tmp_path):
+    remote = str(tmp_path / 'remote')
+    cfile = simvacation_config(
+        core={'vdb': 'tiered'},
+        tiered={
+            'local': 'mmaphash',
+            'remote': 'lmdb',
+            'journal': str(tmp_path / 'journal'),
+            'backoff': 0,
+        },
+        mmaphash={
+            'path': str(tmp_path / 'vdb.mmh'),
+            'buckets': 1024,
+        },
+        lmdb={'path': remote},
+    )
+
+    # The remote tier is down, so the reply is only journalled.
+    assert simvacation_deliver(cfile)
+
+    os.mkdir(remote)
+    subprocess.run([tool_path('simunvacation'), '-c', cfile], check=True)
+
+    export = vdbtool('export', simvacation_config(lmdb={'path': remote}))
+    assert export.stdout.startswith('testrcpt\t')
+
+
 def test_ldap_simple(run_simvacation, testmsg, tmp_path_factory):
     testmsg['To'] = 'onvacation@example.com'
     res = _run_simvacation(run_simvacation, testmsg, tmp_path_factory, rcpt='onvacation')
@@ -0,0 +1,162 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "rabin.h"
+#include "sha1.h"
+#include "siphash.h"
+
+static void
+assert_rabin_equal(const char *s, size_t len) {
+    uint64_t expected = rabin_fingerprint_table(s, len);
+
+    assert_int_equal(rabin_fingerprint_shift(s, len), expected);
+    assert_int_equal(rabin_fingerprint_clmul(s, len), expected);
+    assert_int_equal(rabin_fingerprint(s, len), expected);
+}
+
+/* Existing VDB keys depend on these staying the same. */
+static void
+test_rabin_known(void **state) {
+    assert_int_equal(rabin_fingerprint("", 0), 0);
+    assert_int_equal(rabin_fingerprint("a", 1), 0x61);
+    assert_int_equal(rabin_fingerprint("testsender@example.com", 22),
+            0x4ad1669afc7aa010ULL);
+    assert_int_equal(rabin_fingerprint(
+                             "0123456789abcdef0123456789abcdef0123456789", 42),
+            0xac67221e8e1b2f54ULL);
+}
+
+/* Every string of up to two bytes. */
+static void
+test_rabin_short(void **state) {
+    char     buf[ 2 ];
+    unsigned i;
+
+    assert_rabin_equal(buf, 0);
+    for (i = 0; i < 0x10000; i++) {
+        buf[ 0 ] = (char)(i >> 8);
+        buf[ 1 ] = (char)i;
+        assert_rabin_equal(buf + 1, 1);
+        assert_rabin_equal(buf, 2);
+    }
+}
+
+/* Every byte value at every position, so that each bit of each block passes
+ * through the reduction, and pseudo-random strings of every length through
+ * several folding strides at every alignment.
+ */
+static void
+test_rabin_equivalence(void **state) {
+    char     buf[ 1024 + 8 ];
+    size_t   len, pos, off;
+    unsigned b;
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    for (len = 1; len <= 80; len++) {
+        memset(buf, 0, sizeof(buf));
+        for (pos = 0; pos < len; pos++) {
+            for (b = 0; b < 256; b++) {
+                buf[ pos ] = (char)b;
+                assert_rabin_equal(buf, len);
+            }
+            buf[ pos ] = 0;
+        }
+    }
+
+    for (len = 0; len <= 1024; len++) {
+        for (off = 0; off < 8; off++) {
+            for (pos = 0; pos < len; pos++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                buf[ off + pos ] = (char)x;
+            }
+            assert_rabin_equal(buf + off, len);
+        }
+    }
+}
+
+/* Vectors from the SipHash reference implementation: key 00..0f, message
+ * 00..(n-1).
+ */
+static void
+siphash_vector(size_t len, uint8_t *out, size_t outlen) {
+    uint8_t key[ SIPHASH_KEY_LEN ], msg[ 64 ];
+    size_t  i;
+
+    for (i = 0; i < sizeof(key); i++) {
+        key[ i ] = i;
+    }
+    for (i = 0; i < sizeof(msg); i++) {
+        msg[ i ] = i;
+    }
+
+    siphash(key, msg, len, out, outlen);
+}
+
+static void
+test_siphash64(void **state) {
+    uint8_t out[ 8 ];
+    uint8_t empty[] = {0x31, 0x0e, 0x0e, 0xdd, 0x47, 0xdb, 0x6f, 0x72};
+    uint8_t fifteen[] = {0xe5, 0x45, 0xbe, 0x49, 0x61, 0xca, 0x29, 0xa1};
+
+    siphash_vector(0, out, sizeof(out));
+    assert_memory_equal(out, empty, sizeof(out));
+    siphash_vector(15, out, sizeof(out));
+    assert_memory_equal(out, fifteen, sizeof(out));
+}
+
+static void
+test_siphash128(void **state) {
+    uint8_t out[ 16 ];
+    uint8_t empty[] = {0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6, 0x6d,
+            0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93};
+    uint8_t fifteen[] = {0x54, 0x93, 0xe9, 0x99, 0x33, 0xb0, 0xa8, 0x11, 0x7e,
+            0x08, 0xec, 0x0f, 0x97, 0xcf, 0xc3, 0xd9};
+    uint8_t sixtythree[] = {0x51, 0x50, 0xd1, 0x77, 0x2f, 0x50, 0x83, 0x4a,
+            0x50, 0x3e, 0x06, 0x9a, 0x97, 0x3f, 0xbd, 0x7c};
+
+    siphash_vector(0, out, sizeof(out));
+    assert_memory_equal(out, empty, sizeof(out));
+    siphash_vector(15, out, sizeof(out));
+    assert_memory_equal(out, fifteen, sizeof(out));
+    siphash_vector(63, out, sizeof(out));
+    assert_memory_equal(out, sixtythree, sizeof(out));
+}
+
+/* FIPS 180 examples, the second of which needs a second padding block. */
+static void
+test_sha1(void **state) {
+    uint8_t     out[ SHA1_LEN ];
+    const char *two =
+            "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    uint8_t     abc[] = {0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba,
+            0x3e, 0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d};
+    uint8_t     abcdb[] = {0x84, 0x98, 0x3e, 0x44, 0x1c, 0x3b, 0xd2, 0x6e,
+            0xba, 0xae, 0x4a, 0xa1, 0xf9, 0x51, 0x29, 0xe5, 0xe5, 0x46, 0x70,
+            0xf1};
+
+    sha1("abc", 3, out);
+    assert_memory_equal(out, abc, sizeof(out));
+    sha1(two, strlen(two), out);
+    assert_memory_equal(out, abcdb, sizeof(out));
+}
+
+int
+main(void) {
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test(test_rabin_known),
+            cmocka_unit_test(test_rabin_short),
+            cmocka_unit_test(test_rabin_equivalence),
+            cmocka_unit_test(test_siphash64),
+            cmocka_unit_test(test_siphash128),
+            cmocka_unit_test(test_sha1),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,273 @@
+#include <config.h>
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#ifdef HAVE_LMDB
+#include <lmdb.h>
+#endif /* HAVE_LMDB */
+
+#include "senderset.h"
+
+static uint64_t
+xorshift(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* A sorted set of n distinct random members. With a span, the fingerprints
+ * are drawn from a range that wide, so the offsets can be narrow.
+ */
+static void
+random_set(struct senderset *set, size_t n, bool wide, uint64_t span,
+        uint64_t *x) {
+    bool changed;
+
+    memset(set, 0, sizeof(*set));
+    set->wide = wide;
+    while (set->n < n) {
+        assert_int_equal(senderset_update(set,
+                                 span ? xorshift(x) % span : xorshift(x),
+                                 wide ? xorshift(x) : 0,
+                                 1700000000 + (xorshift(x) % 604800), false,
+                                 &changed),
+                VAC_RESULT_OK);
+    }
+}
+
+static void
+test_senderset_fp(void **state) {
+    uint64_t                hi, lo;
+    bool                    wide;
+    struct senderset_member m;
+    yastr                   fp;
+
+    assert_true(senderset_parse_fp("4ad1669afc7aa010", &hi, &lo, &wide));
+    assert_int_equal(hi, 0x4ad1669afc7aa010ULL);
+    assert_false(wide);
+    m.hi = hi;
+    fp = senderset_format_fp(&m, false);
+    assert_string_equal(fp, "4ad1669afc7aa010");
+    yaslfree(fp);
+
+    assert_true(senderset_parse_fp("61", &hi, &lo, &wide));
+    assert_int_equal(hi, 0x61);
+
+    assert_true(senderset_parse_fp(
+            "v2-00112233445566778899aabbccddeeff", &hi, &lo, &wide));
+    assert_int_equal(hi, 0x0011223344556677ULL);
+    assert_int_equal(lo, 0x8899aabbccddeeffULL);
+    assert_true(wide);
+    m.hi = hi;
+    m.lo = lo;
+    fp = senderset_format_fp(&m, true);
+    assert_string_equal(fp, "v2-00112233445566778899aabbccddeeff");
+    yaslfree(fp);
+
+    assert_false(senderset_parse_fp("", &hi, &lo, &wide));
+    assert_false(senderset_parse_fp("not hex", &hi, &lo, &wide));
+    assert_false(senderset_parse_fp("0123456789abcdef0", &hi, &lo, &wide));
+    assert_false(senderset_parse_fp("v2-0011", &hi, &lo, &wide));
+}
+
+/* Every member can be found in the encoded block, and nothing else can. */
+static void
+test_senderset_roundtrip(void **state) {
+    struct senderset set, decoded;
+    size_t           n, i, len;
+    uint64_t         x = 0x9e3779b97f4a7c15ULL;
+    uint64_t         spans[] = {0, 1000, 300000};
+    unsigned         s, w;
+    void *           buf;
+    time_t           ts;
+
+    for (w = 0; w < 2; w++) {
+        for (s = 0; s < sizeof(spans) / sizeof(spans[ 0 ]); s++) {
+            for (n = 1; n <= 300; n += (n < 20) ? 1 : 37) {
+                random_set(&set, n, w, spans[ s ], &x);
+                len = senderset_encoded_len(&set, 0, set.n);
+                assert_non_null(buf = malloc(len));
+                senderset_encode(&set, 0, set.n, buf);
+
+                for (i = 0; i < set.n; i++) {
+                    assert_true(senderset_lookup(buf, len,
+                            set.members[ i ].hi, set.members[ i ].lo, &ts));
+                    assert_int_equal(ts, set.members[ i ].ts);
+                    if (w) {
+                        assert_false(senderset_lookup(buf, len,
+                                set.members[ i ].hi, set.members[ i ].lo + 1,
+                                &ts));
+                    } else if ((i + 1 == set.n) ||
+                               (set.members[ i + 1 ].hi !=
+                                       set.members[ i ].hi + 1)) {
+                        assert_false(senderset_lookup(buf, len,
+                                set.members[ i ].hi + 1, 0, &ts));
+                    }
+                }
+                if (set.members[ 0 ].hi > 0) {
+                    assert_false(senderset_lookup(
+                            buf, len, set.members[ 0 ].hi - 1, 0, &ts));
+                }
+
+                assert_int_equal(
+                        senderset_decode(buf, len, &decoded), VAC_RESULT_OK);
+                assert_int_equal(decoded.n, set.n);
+                assert_int_equal(decoded.wide, set.wide);
+                assert_memory_equal(decoded.members, set.members,
+                        set.n * sizeof(*set.members));
+
+                senderset_free(&decoded);
+                senderset_free(&set);
+                free(buf);
+            }
+        }
+    }
+}
+
+/* Offsets take as few bytes as the block's range needs. */
+static void
+test_senderset_width(void **state) {
+    struct senderset set;
+    bool             changed;
+    size_t           narrow, full;
+
+    memset(&set, 0, sizeof(set));
+    senderset_update(&set, 0x1234567800000000ULL, 0, 1, false, &changed);
+    senderset_update(&set, 0x12345678000000ffULL, 0, 2, false, &changed);
+    narrow = senderset_encoded_len(&set, 0, 2);
+    senderset_update(&set, 0xffffffffffffffffULL, 0, 3, false, &changed);
+    full = senderset_encoded_len(&set, 0, 3);
+
+    assert_int_equal(full - narrow, 3 * 8 - 2 * 1 + sizeof(uint32_t));
+    assert_int_equal(senderset_encoded_len(&set, 0, 2), narrow);
+
+    senderset_free(&set);
+}
+
+static void
+test_senderset_update(void **state) {
+    struct senderset set;
+    bool             changed;
+
+    memset(&set, 0, sizeof(set));
+    senderset_update(&set, 30, 0, 100, false, &changed);
+    assert_true(changed);
+    senderset_update(&set, 10, 0, 100, false, &changed);
+    senderset_update(&set, 20, 0, 100, false, &changed);
+    assert_int_equal(set.n, 3);
+    assert_int_equal(set.members[ 0 ].hi, 10);
+    assert_int_equal(set.members[ 1 ].hi, 20);
+    assert_int_equal(set.members[ 2 ].hi, 30);
+
+    /* An older time doesn't replace a newer one when loading. */
+    senderset_update(&set, 20, 0, 50, true, &changed);
+    assert_false(changed);
+    assert_int_equal(set.members[ 1 ].ts, 100);
+    senderset_update(&set, 20, 0, 150, true, &changed);
+    assert_true(changed);
+    assert_int_equal(set.members[ 1 ].ts, 150);
+    senderset_update(&set, 20, 0, 120, false, &changed);
+    assert_true(changed);
+    assert_int_equal(set.members[ 1 ].ts, 120);
+    assert_int_equal(set.n, 3);
+
+    assert_int_equal(senderset_expire(&set, 110), 2);
+    assert_int_equal(set.n, 1);
+    assert_int_equal(set.members[ 0 ].hi, 20);
+
+    senderset_free(&set);
+}
+
+static void
+test_senderset_bad(void **state) {
+    struct senderset set;
+    uint8_t          buf[ 64 ];
+    time_t           ts;
+
+    memset(buf, 0, sizeof(buf));
+    assert_false(senderset_lookup(buf, 10, 0, 0, &ts));
+    assert_false(senderset_lookup(buf, sizeof(buf), 0, 0, &ts));
+    assert_int_equal(
+            senderset_decode(buf, sizeof(buf), &set), VAC_RESULT_PERMFAIL);
+}
+
+/* A block of exactly the limit stays on the leaf page, and one byte more
+ * goes to an overflow page.
+ */
+static void
+test_senderset_block_max(void **state) {
+#ifdef HAVE_LMDB
+    char     dir[] = "/tmp/cmocka_senderset.XXXXXX";
+    char     path[ 64 ];
+    char     keybuf[] = "set:testrcpt:0000000000000000";
+    MDB_env *env;
+    MDB_txn *txn;
+    MDB_dbi  dbi;
+    MDB_stat st;
+    MDB_val  key, data;
+    size_t   max;
+#endif /* HAVE_LMDB */
+
+    assert_int_equal(senderset_block_max(4096, 10), 2020);
+
+#ifdef HAVE_LMDB
+    assert_non_null(mkdtemp(dir));
+    assert_int_equal(mdb_env_create(&env), 0);
+    assert_int_equal(mdb_env_open(env, dir, 0, 0664), 0);
+    assert_int_equal(mdb_txn_begin(env, NULL, 0, &txn), 0);
+    assert_int_equal(mdb_dbi_open(txn, NULL, 0, &dbi), 0);
+    assert_int_equal(mdb_env_stat(env, &st), 0);
+
+    key.mv_size = strlen(keybuf);
+    key.mv_data = keybuf;
+    max = senderset_block_max(st.ms_psize, key.mv_size);
+
+    data.mv_size = max;
+    data.mv_data = NULL;
+    assert_int_equal(mdb_put(txn, dbi, &key, &data, MDB_RESERVE), 0);
+    memset(data.mv_data, 0, max);
+    assert_int_equal(mdb_stat(txn, dbi, &st), 0);
+    assert_int_equal(st.ms_overflow_pages, 0);
+
+    keybuf[ key.mv_size - 1 ] = '1';
+    data.mv_size = max + 1;
+    data.mv_data = NULL;
+    assert_int_equal(mdb_put(txn, dbi, &key, &data, MDB_RESERVE), 0);
+    memset(data.mv_data, 0, max + 1);
+    assert_int_equal(mdb_stat(txn, dbi, &st), 0);
+    assert_int_equal(st.ms_overflow_pages, 1);
+
+    mdb_txn_abort(txn);
+    mdb_env_close(env);
+
+    snprintf(path, sizeof(path), "%s/data.mdb", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/lock.mdb", dir);
+    unlink(path);
+    rmdir(dir);
+#endif /* HAVE_LMDB */
+}
+
+int
+main(void) {
+    const struct CMUnitTest tests[] = {
+            cmocka_unit_test(test_senderset_fp),
+            cmocka_unit_test(test_senderset_roundtrip),
+            cmocka_unit_test(test_senderset_width),
+            cmocka_unit_test(test_senderset_update),
+            cmocka_unit_test(test_senderset_bad),
+            cmocka_unit_test(test_senderset_block_max),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,6 +1,10 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <cmocka.h>
 
@@ -115,6 +119,170 @@ test_check_from_mailsystem(void **state) {
     assert_null(check_from(yaslauto("foo-relay@example.com")));
 }
 
+/* Returns a descriptor to read msg from: a spooled file, or a pipe that a
+ * child process writes into.
+ */
+static int
+message_fd(const char *msg, size_t len, bool spooled) {
+    char path[] = "/tmp/unit_vutil.XXXXXX";
+    int  fd[ 2 ];
+
+    if (spooled) {
+        assert_true((fd[ 0 ] = mkstemp(path)) >= 0);
+        unlink(path);
+        assert_int_equal(write(fd[ 0 ], msg, len), len);
+        assert_int_equal(lseek(fd[ 0 ], 0, SEEK_SET), 0);
+        return fd[ 0 ];
+    }
+
+    assert_int_equal(pipe(fd), 0);
+    switch (fork()) {
+    case -1:
+        fail();
+    case 0:
+        close(fd[ 0 ]);
+        while (len > 0) {
+            ssize_t n = write(fd[ 1 ], msg, len > 1000 ? 1000 : len);
+            if (n <= 0) {
+                _exit(1);
+            }
+            msg += n;
+            len -= n;
+        }
+        _exit(0);
+    }
+    close(fd[ 1 ]);
+    return fd[ 0 ];
+}
+
+static void
+test_header_reader(void **state) {
+    const char *msg = "Subject: hello\r\n\tworld\r\n"
+                      "To: foo@example.com\n"
+                      "X-Empty:\n"
+                      "\r\n"
+                      "body\nFrom: nope\n";
+    struct header_reader *r;
+    int                   fd, spooled;
+
+    for (spooled = 0; spooled < 2; spooled++) {
+        fd = message_fd(msg, strlen(msg), spooled);
+        assert_non_null(r = header_reader_new(fd));
+        assert_string_equal(header_reader_next(r), "Subject: hello\tworld");
+        assert_string_equal(header_reader_next(r), "To: foo@example.com");
+        assert_string_equal(header_reader_next(r), "X-Empty:");
+        assert_null(header_reader_next(r));
+        assert_null(header_reader_next(r));
+        if (spooled) {
+            assert_int_equal(
+                    lseek(fd, 0, SEEK_CUR), strstr(msg, "body") - msg);
+        }
+        header_reader_free(r);
+        close(fd);
+    }
+}
+
+/* Fields that span several reads, and one much longer than a line. */
+static void
+test_header_reader_long(void **state) {
+    struct header_reader *r;
+    yastr                 msg, folded, unfolded;
+    char                  expected[ 64 ];
+    int                   fd, spooled, i;
+
+    msg = yaslempty();
+    for (i = 0; i < 3000; i++) {
+        msg = yaslcatprintf(msg, "X-Field-%d: value %d\n", i, i);
+    }
+    folded = yaslauto("References:");
+    unfolded = yaslauto("References:");
+    for (i = 0; i < 4000; i++) {
+        folded = yaslcatprintf(folded, " <%08d@example.com>\r\n", i);
+        unfolded = yaslcatprintf(unfolded, " <%08d@example.com>", i);
+    }
+    msg = yaslcatyasl(msg, folded);
+    msg = yaslcat(msg, "\n");
+    for (i = 0; i < 10000; i++) {
+        msg = yaslcat(msg, "Not a header: just the body\n");
+    }
+
+    for (spooled = 0; spooled < 2; spooled++) {
+        fd = message_fd(msg, yasllen(msg), spooled);
+        assert_non_null(r = header_reader_new(fd));
+        for (i = 0; i < 3000; i++) {
+            snprintf(expected, sizeof(expected), "X-Field-%d: value %d", i, i);
+            assert_string_equal(header_reader_next(r), expected);
+        }
+        assert_string_equal(header_reader_next(r), unfolded);
+        assert_null(header_reader_next(r));
+        header_reader_free(r);
+        close(fd);
+    }
+
+    yaslfree(msg);
+    yaslfree(folded);
+    yaslfree(unfolded);
+}
+
+/* Input that ends without a blank line, or without a newline at all. */
+static void
+test_header_reader_eof(void **state) {
+    const char *msg = "To: foo@example.com\nSubject: no\r\n body";
+    struct header_reader *r;
+    int                   fd, spooled;
+
+    for (spooled = 0; spooled < 2; spooled++) {
+        fd = message_fd(msg, strlen(msg), spooled);
+        assert_non_null(r = header_reader_new(fd));
+        assert_string_equal(header_reader_next(r), "To: foo@example.com");
+        assert_string_equal(header_reader_next(r), "Subject: no body");
+        assert_null(header_reader_next(r));
+        header_reader_free(r);
+        close(fd);
+
+        fd = message_fd("", 0, spooled);
+        assert_non_null(r = header_reader_new(fd));
+        assert_null(header_reader_next(r));
+        header_reader_free(r);
+        close(fd);
+    }
+}
+
+/* A field too long to read whole ends the header early, which has to be
+ * distinguishable from its real end. A mapped message has no such limit.
+ */
+static void
+test_header_reader_oversized(void **state) {
+    struct header_reader *r;
+    yastr                 msg;
+    int                   fd, spooled;
+
+    msg = yaslauto("X-Huge: ");
+    while (yasllen(msg) < 2 * 1024 * 1024) {
+        msg = yaslcat(msg, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    }
+    msg = yaslcat(msg, "\nList-Unsubscribe: <mailto:x@example.com>\n\nbody\n");
+
+    for (spooled = 0; spooled < 2; spooled++) {
+        fd = message_fd(msg, yasllen(msg), spooled);
+        assert_non_null(r = header_reader_new(fd));
+        if (spooled) {
+            assert_non_null(header_reader_next(r));
+            assert_string_equal(header_reader_next(r),
+                    "List-Unsubscribe: <mailto:x@example.com>");
+            assert_null(header_reader_next(r));
+            assert_false(r->truncated);
+        } else {
+            assert_null(header_reader_next(r));
+            assert_true(r->truncated);
+        }
+        header_reader_free(r);
+        close(fd);
+    }
+
+    yaslfree(msg);
+}
+
 int
 main(void) {
     const struct CMUnitTest tests[] = {
@@ -126,6 +294,10 @@ main(void) {
             cmocka_unit_test(test_check_from_noop),
             cmocka_unit_test(test_check_from_simta_group),
             cmocka_unit_test(test_check_from_mailsystem),
+            cmocka_unit_test(test_header_reader),
+            cmocka_unit_test(test_header_reader_long),
+            cmocka_unit_test(test_header_reader_eof),
+            cmocka_unit_test(test_header_reader_oversized),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+#include "vutil.h"
+
+/* Runs simulated deliveries against the configured VDB from several
+ * processes at once. Each delivery does what simvacation does: open the VDB
+ * for a recipient, look up the sender, record a reply if there wasn't a
+ * recent one, and close it. Recipients and senders are drawn from Zipf
+ * distributions, so a few of each are much busier than the rest.
+ *
+ * Every timing is written to shared memory and summarised by the parent
+ * once all the workers have finished.
+ */
+
+enum bench_op {
+    BENCH_INIT,
+    BENCH_RECENT,
+    BENCH_STORE,
+    BENCH_DELIVERY,
+    BENCH_NOPS,
+};
+
+static const char *bench_op_names[ BENCH_NOPS ] = {
+        "init",
+        "recent",
+        "store_reply",
+        "delivery",
+};
+
+struct bench_zipf {
+    double *cdf;
+    size_t  n;
+};
+
+struct bench_worker {
+    double lock_wait;
+};
+
+static vac_result bench_zipf_init(struct bench_zipf *, size_t, double);
+static size_t     bench_zipf_sample(const struct bench_zipf *);
+static void       bench_run(struct vdb_backend *, double *,
+              struct bench_worker *, size_t, const struct bench_zipf *,
+              const struct bench_zipf *, bool);
+static int        bench_cmp(const void *, const void *);
+static void       bench_report(double *, size_t, size_t);
+static off_t      bench_du(const char *);
+static void       usage(void);
+
+int
+main(int argc, char **argv) {
+    int                  ch, status;
+    bool                 debug = false, reuse = false;
+    char *               config_file = NULL;
+    const char *         growth = NULL;
+    size_t               procs = 4, deliveries = 10000;
+    size_t               rcpts = 1000, senders = 100000;
+    size_t               i, len;
+    double               skew = 1.0, start, elapsed, lock_wait = 0;
+    double *             timings;
+    off_t                size_before = 0, size_after;
+    pid_t                pid;
+    struct vdb_backend * vdb;
+    struct bench_worker *workers;
+    struct bench_zipf    rcpt_zipf, sender_zipf;
+
+    while ((ch = getopt(argc, argv, "c:dg:kn:p:r:s:z:")) != EOF) {
+        switch ((char)ch) {
+        case 'c':
+            config_file = optarg;
+            break;
+        case 'd':
+            debug = true;
+            break;
+        case 'g':
+            growth = optarg;
+            break;
+        case 'k':
+            reuse = true;
+            break;
+        case 'n':
+            deliveries = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            procs = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rcpts = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            senders = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            skew = strtod(optarg, NULL);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if ((optind != argc) || (procs < 1) || (deliveries < 1) || (rcpts < 1) ||
+            (senders < 1) || (skew < 0)) {
+        usage();
+    }
+
+    if (debug) {
+        openlog("vdb-bench", LOG_NOWAIT | LOG_PERROR | LOG_PID, LOG_VACATION);
+    } else {
+        openlog("vdb-bench", LOG_PERROR | LOG_PID, LOG_VACATION);
+        setlogmask(LOG_UPTO(LOG_NOTICE));
+    }
+
+    if (read_vacation_config(config_file) != VAC_RESULT_OK) {
+        exit(1);
+    }
+
+    if ((vdb = vdb_backend(ucl_object_tostring(
+                 ucl_object_lookup_path(vac_config, "core.vdb")))) == NULL) {
+        exit(1);
+    }
+
+    if ((bench_zipf_init(&rcpt_zipf, rcpts, skew) != VAC_RESULT_OK) ||
+            (bench_zipf_init(&sender_zipf, senders, skew) != VAC_RESULT_OK)) {
+        exit(1);
+    }
+
+    /* Shared with the workers, which fill in their own slices. */
+    len = (procs * deliveries * BENCH_NOPS * sizeof(double)) +
+          (procs * sizeof(struct bench_worker));
+    if ((timings = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        syslog(LOG_ERR, "mmap: %m");
+        exit(1);
+    }
+    workers = (struct bench_worker *)(timings +
+                                      (procs * deliveries * BENCH_NOPS));
+
+    if (growth) {
+        size_before = bench_du(growth);
+    }
+
+    start = monotonic_seconds();
+
+    for (i = 0; i < procs; i++) {
+        if ((pid = fork()) < 0) {
+            syslog(LOG_ERR, "fork: %m");
+            exit(1);
+        }
+        if (pid == 0) {
+            srand48(getpid() ^ time(NULL));
+            bench_run(vdb, timings + (i * deliveries * BENCH_NOPS),
+                    workers + i, deliveries, &rcpt_zipf, &sender_zipf, reuse);
+            exit(0);
+        }
+    }
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            syslog(LOG_ERR, "a worker failed");
+            exit(1);
+        }
+    }
+
+    elapsed = monotonic_seconds() - start;
+
+    printf("%s: %zu processes, %zu deliveries in %.2fs, %.0f deliveries/s\n",
+            ucl_object_tostring(
+                    ucl_object_lookup_path(vac_config, "core.vdb")),
+            procs, procs * deliveries, elapsed,
+            (procs * deliveries) / elapsed);
+
+    bench_report(timings, procs * deliveries, BENCH_NOPS);
+
+    for (i = 0; i < procs; i++) {
+        lock_wait += workers[ i ].lock_wait;
+    }
+    if (lock_wait > 0) {
+        printf("LMDB writer lock wait: %.3fs in total, %.1f%% of worker "
+               "time\n",
+                lock_wait, 100 * lock_wait / (elapsed * procs));
+    }
+
+    if (growth) {
+        size_after = bench_du(growth);
+        printf("%s grew from %lld to %lld bytes (%+lld)\n", growth,
+                (long long)size_before, (long long)size_after,
+                (long long)(size_after - size_before));
+    }
+
+    exit(0);
+}
+
+static void
+bench_run(struct vdb_backend *vdb, double *timings,
+        struct bench_worker *worker, size_t deliveries,
+        const struct bench_zipf *rcpt_zipf,
+        const struct bench_zipf *sender_zipf, bool reuse) {
+    size_t     i, op;
+    double     t0, t1;
+    time_t     interval;
+    yastr      rcpt, from;
+    VDB *      vdbh = NULL;
+    vdb_status status;
+
+    interval = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "core.interval"));
+    rcpt = yaslempty();
+    from = yaslempty();
+
+    for (i = 0; i < deliveries; i++) {
+        for (op = 0; op < BENCH_NOPS; op++) {
+            timings[ (i * BENCH_NOPS) + op ] = NAN;
+        }
+
+        yaslclear(rcpt);
+        rcpt = yaslcatprintf(rcpt, "user%zu", bench_zipf_sample(rcpt_zipf));
+        yaslclear(from);
+        from = yaslcatprintf(
+                from, "sender%zu@example.org", bench_zipf_sample(sender_zipf));
+
+        t0 = monotonic_seconds();
+
+        /* A long-lived handle stays with the first recipient, which suits
+         * the backends that don't key on it.
+         */
+        if (vdbh == NULL) {
+            if ((vdbh = vdb->init(rcpt)) == NULL) {
+                exit(1);
+            }
+            timings[ (i * BENCH_NOPS) + BENCH_INIT ] =
+                    monotonic_seconds() - t0;
+        }
+
+        t1 = monotonic_seconds();
+        status = vdb->recent(vdbh, from, interval);
+        timings[ (i * BENCH_NOPS) + BENCH_RECENT ] = monotonic_seconds() - t1;
+
+        if (status != VDB_STATUS_RECENT) {
+            t1 = monotonic_seconds();
+            vdb->store_reply(vdbh, from, interval);
+            timings[ (i * BENCH_NOPS) + BENCH_STORE ] =
+                    monotonic_seconds() - t1;
+        }
+
+        if (!reuse) {
+            vdb->close(vdbh);
+            vdbh = NULL;
+        }
+
+        timings[ (i * BENCH_NOPS) + BENCH_DELIVERY ] = monotonic_seconds() - t0;
+    }
+
+    if (vdbh) {
+        vdb->close(vdbh);
+    }
+
+#ifdef HAVE_LMDB
+    worker->lock_wait = lmdb_vdb_lock_wait;
+#endif /* HAVE_LMDB */
+
+    yaslfree(rcpt);
+    yaslfree(from);
+}
+
+static void
+bench_report(double *timings, size_t n, size_t nops) {
+    size_t  op, i, count;
+    double *sorted;
+
+    if ((sorted = calloc(n, sizeof(double))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        exit(1);
+    }
+
+    printf("%-12s %9s %9s %9s %9s %9s %9s\n", "(ms)", "count", "p50", "p90",
+            "p99", "p99.9", "max");
+
+    for (op = 0; op < nops; op++) {
+        for (i = 0, count = 0; i < n; i++) {
+            if (!isnan(timings[ (i * nops) + op ])) {
+                sorted[ count++ ] = timings[ (i * nops) + op ] * 1000;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        qsort(sorted, count, sizeof(double), bench_cmp);
+        printf("%-12s %9zu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                bench_op_names[ op ], count, sorted[ count * 50 / 100 ],
+                sorted[ count * 90 / 100 ], sorted[ count * 99 / 100 ],
+                sorted[ count * 999 / 1000 ], sorted[ count - 1 ]);
+    }
+
+    free(sorted);
+}
+
+static int
+bench_cmp(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* The CDF of a Zipf distribution over n items with exponent s. */
+static vac_result
+bench_zipf_init(struct bench_zipf *zipf, size_t n, double s) {
+    size_t i;
+    double sum = 0;
+
+    if ((zipf->cdf = calloc(n, sizeof(double))) == NULL) {
+        syslog(LOG_ERR, "calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+    zipf->n = n;
+
+    for (i = 0; i < n; i++) {
+        sum += 1 / pow(i + 1, s);
+        zipf->cdf[ i ] = sum;
+    }
+    for (i = 0; i < n; i++) {
+        zipf->cdf[ i ] /= sum;
+    }
+
+    return VAC_RESULT_OK;
+}
+
+static size_t
+bench_zipf_sample(const struct bench_zipf *zipf) {
+    size_t lo = 0, hi = zipf->n - 1, mid;
+    double u = drand48();
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (zipf->cdf[ mid ] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Disk space used by a file or everything under a directory. */
+static off_t
+bench_du(const char *path) {
+    struct stat    st;
+    struct dirent *entry;
+    DIR *          dir;
+    yastr          child;
+    off_t          size;
+
+    if (lstat(path, &st) != 0) {
+        return 0;
+    }
+
+    size = st.st_blocks * 512;
+
+    if (S_ISDIR(st.st_mode) && ((dir = opendir(path)) != NULL)) {
+        child = yaslempty();
+        while ((entry = readdir(dir)) != NULL) {
+            if ((strcmp(entry->d_name, ".") == 0) ||
+                    (strcmp(entry->d_name, "..") == 0)) {
+                continue;
+            }
+            yaslclear(child);
+            child = yaslcatprintf(child, "%s/%s", path, entry->d_name);
+            size += bench_du(child);
+        }
+        yaslfree(child);
+        closedir(dir);
+    }
+
+    return size;
+}
+
+static void
+usage(void) {
+    fprintf(stderr,
+            "usage: vdb-bench [-dk] [-c config] [-g path] [-n deliveries] "
+            "[-p processes]\n"
+            "                 [-r recipients] [-s senders] [-z skew]\n");
+    exit(1);
+}
@@ -5,17 +5,42 @@
 
 #include <config.h>
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "rabin.h"
 #include "simvacation.h"
+#include "siphash.h"
 #include "vdb.h"
 
+static vac_result vdb_fingerprint_init(void);
+static yastr      vdb_fingerprint_rabin(const yastr);
+static yastr      vdb_fingerprint_siphash(const yastr);
+
+/* The fingerprint settings, parsed by vdb_fingerprint_init. */
+static enum {
+    VDB_FINGERPRINT_RABIN,
+    VDB_FINGERPRINT_SIPHASH,
+} vdb_fingerprint_format = VDB_FINGERPRINT_RABIN;
+static uint8_t vdb_fingerprint_key[ SIPHASH_KEY_LEN ];
+
 struct vdb_backend *
 vdb_backend(const char *provider) {
     struct vdb_backend *functable;
 
+    if (vdb_fingerprint_init() != VAC_RESULT_OK) {
+        return NULL;
+    }
+
     functable = malloc(sizeof(struct vdb_backend));
 
     /* Default all functions to the null implementation */
@@ -26,6 +51,10 @@ vdb_backend(const char *provider) {
     functable->get_names = vdb_get_names;
     functable->clean = vdb_clean;
     functable->gc = vdb_gc;
+    functable->compact = vdb_compact;
+    functable->walk = vdb_walk;
+    functable->load = vdb_load;
+    functable->stats = vdb_stats;
 
     if (strcasecmp(provider, "redis") == 0) {
 #ifdef HAVE_URCL
@@ -33,6 +62,11 @@ vdb_backend(const char *provider) {
         functable->close = redis_vdb_close;
         functable->recent = redis_vdb_recent;
         functable->store_reply = redis_vdb_store_reply;
+        functable->get_names = redis_vdb_get_names;
+        functable->clean = redis_vdb_clean;
+        functable->walk = redis_vdb_walk;
+        functable->load = redis_vdb_load;
+        functable->stats = redis_vdb_stats;
         return functable;
 #else  /* HAVE_URCL */
         syslog(LOG_ERR, "vdb_backend: redis was disabled during compilation");
@@ -47,6 +81,10 @@ vdb_backend(const char *provider) {
         functable->recent = lmdb_vdb_recent;
         functable->store_reply = lmdb_vdb_store_reply;
         functable->gc = lmdb_vdb_gc;
+        functable->compact = lmdb_vdb_compact;
+        functable->walk = lmdb_vdb_walk;
+        functable->load = lmdb_vdb_load;
+        functable->stats = lmdb_vdb_stats;
         return functable;
 #else  /* HAVE_LMDB */
         syslog(LOG_ERR, "vdb_backend: LMDB was disabled during compilation");
@@ -54,6 +92,86 @@ vdb_backend(const char *provider) {
 #endif /* HAVE_LMDB */
     }
 
+    if (strcasecmp(provider, "mmaphash") == 0) {
+        functable->init = mmaphash_vdb_init;
+        functable->close = mmaphash_vdb_close;
+        functable->recent = mmaphash_vdb_recent;
+        functable->store_reply = mmaphash_vdb_store_reply;
+        functable->stats = mmaphash_vdb_stats;
+        return functable;
+    }
+
+    if (strcasecmp(provider, "bloom") == 0) {
+        functable->init = bloom_vdb_init;
+        functable->close = bloom_vdb_close;
+        functable->recent = bloom_vdb_recent;
+        functable->store_reply = bloom_vdb_store_reply;
+        return functable;
+    }
+
+    if (strcasecmp(provider, "log") == 0) {
+        functable->init = log_vdb_init;
+        functable->close = log_vdb_close;
+        functable->recent = log_vdb_recent;
+        functable->store_reply = log_vdb_store_reply;
+        functable->gc = log_vdb_gc;
+        return functable;
+    }
+
+    if (strcasecmp(provider, "memory") == 0) {
+        functable->init = memory_vdb_init;
+        functable->close = memory_vdb_close;
+        functable->recent = memory_vdb_recent;
+        functable->store_reply = memory_vdb_store_reply;
+        functable->gc = memory_vdb_gc;
+        return functable;
+    }
+
+    if (strcasecmp(provider, "tiered") == 0) {
+        functable->init = tiered_vdb_init;
+        functable->close = tiered_vdb_close;
+        functable->recent = tiered_vdb_recent;
+        functable->store_reply = tiered_vdb_store_reply;
+        functable->get_names = tiered_vdb_get_names;
+        functable->clean = tiered_vdb_clean;
+        functable->gc = tiered_vdb_gc;
+        functable->compact = tiered_vdb_compact;
+        functable->stats = tiered_vdb_stats;
+        return functable;
+    }
+
+    if (strcasecmp(provider, "writebehind") == 0) {
+        functable->init = writebehind_vdb_init;
+        functable->close = writebehind_vdb_close;
+        functable->recent = writebehind_vdb_recent;
+        functable->store_reply = writebehind_vdb_store_reply;
+        functable->get_names = writebehind_vdb_get_names;
+        functable->clean = writebehind_vdb_clean;
+        functable->gc = writebehind_vdb_gc;
+        functable->compact = writebehind_vdb_compact;
+        functable->stats = writebehind_vdb_stats;
+        return functable;
+    }
+
+    if (strncasecmp(provider, "inject:", 7) == 0) {
+        if (inject_vdb_wrap(provider + 7) != VAC_RESULT_OK) {
+            free(functable);
+            return NULL;
+        }
+        functable->init = inject_vdb_init;
+        functable->close = inject_vdb_close;
+        functable->recent = inject_vdb_recent;
+        functable->store_reply = inject_vdb_store_reply;
+        functable->get_names = inject_vdb_get_names;
+        functable->clean = inject_vdb_clean;
+        functable->gc = inject_vdb_gc;
+        functable->compact = inject_vdb_compact;
+        functable->walk = inject_vdb_walk;
+        functable->load = inject_vdb_load;
+        functable->stats = inject_vdb_stats;
+        return functable;
+    }
+
     if (strcasecmp(provider, "null") == 0) {
         return functable;
     }
@@ -80,13 +198,13 @@ vdb_recent(VDB *vdb, const yastr from, time_t interval) {
 }
 
 vac_result
-vdb_store_reply(VDB *vdb, const yastr from) {
+vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
     return VAC_RESULT_OK;
 }
 
-ucl_object_t *
-vdb_get_names(VDB *vdb) {
-    return ucl_object_typed_new(UCL_ARRAY);
+vac_result
+vdb_get_names(VDB *vdb, size_t batch, vdb_names_cb cb, void *ctx) {
+    return VAC_RESULT_OK;
 }
 
 void
@@ -98,3 +216,194 @@ void
 vdb_gc(VDB *vdb) {
     return;
 }
+
+vac_result
+vdb_compact(VDB *vdb) {
+    return VAC_RESULT_OK;
+}
+
+vac_result
+vdb_walk(VDB *vdb, const yastr resume, size_t batch, vdb_walk_cb cb,
+        void *ctx) {
+    syslog(LOG_ERR, "vdb_walk: not supported by this backend");
+    return VAC_RESULT_PERMFAIL;
+}
+
+vac_result
+vdb_load(VDB *vdb, const struct vdb_entry *entries, size_t n) {
+    syslog(LOG_ERR, "vdb_load: not supported by this backend");
+    return VAC_RESULT_PERMFAIL;
+}
+
+/* Backend-specific size and health figures, reported by simvacation-vdbstat.
+ */
+ucl_object_t *
+vdb_stats(VDB *vdb) {
+    return ucl_object_typed_new(UCL_OBJECT);
+}
+
+void
+vdb_entries_free(struct vdb_entry *entries, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        yaslfree(entries[ i ].rcpt);
+        yaslfree(entries[ i ].fp);
+    }
+    free(entries);
+}
+
+/* Map a file shared between processes, creating it zero-filled with the given
+ * size if it doesn't exist yet. An existing file is mapped at its own size.
+ */
+void *
+vdb_mmap_file(const char *path, size_t size, size_t *len) {
+    int         fd;
+    struct stat st;
+    void *      map = NULL;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0664)) < 0) {
+        syslog(LOG_ALERT, "vdb_mmap_file open %s: %m", path);
+        return NULL;
+    }
+
+    /* Only one process gets to size a new file. */
+    if (flock(fd, LOCK_EX) != 0) {
+        syslog(LOG_ALERT, "vdb_mmap_file flock %s: %m", path);
+        goto cleanup;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        syslog(LOG_ALERT, "vdb_mmap_file fstat %s: %m", path);
+        goto cleanup;
+    }
+
+    if (st.st_size == 0) {
+        if (ftruncate(fd, size) != 0) {
+            syslog(LOG_ALERT, "vdb_mmap_file ftruncate %s: %m", path);
+            goto cleanup;
+        }
+        st.st_size = size;
+    }
+
+    if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 0)) == MAP_FAILED) {
+        syslog(LOG_ALERT, "vdb_mmap_file mmap %s: %m", path);
+        map = NULL;
+        goto cleanup;
+    }
+    *len = st.st_size;
+
+cleanup:
+    /* Closing the descriptor also releases the lock. */
+    close(fd);
+    return map;
+}
+
+/* MurmurHash3's 64-bit finaliser, for spreading fingerprints across buckets
+ * and bit positions.
+ */
+uint64_t
+vdb_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Checks core.fingerprint and parses the SipHash key, so a bad setting stops
+ * every program at startup instead of quietly fingerprinting senders under
+ * a key nobody chose.
+ */
+static vac_result
+vdb_fingerprint_init(void) {
+    const char *format;
+    const char *hex;
+    char        byte[ 3 ] = {0};
+    size_t      i;
+
+    format = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "core.fingerprint"));
+
+    if ((format == NULL) || (strcasecmp(format, "rabin") == 0)) {
+        vdb_fingerprint_format = VDB_FINGERPRINT_RABIN;
+        return VAC_RESULT_OK;
+    }
+
+    if (strcasecmp(format, "siphash") != 0) {
+        syslog(LOG_ERR, "vdb_fingerprint: unknown fingerprint %s", format);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    hex = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "core.fingerprint_key"));
+    for (i = 0; hex && (i < 2 * SIPHASH_KEY_LEN); i++) {
+        if (!isxdigit((unsigned char)hex[ i ])) {
+            break;
+        }
+    }
+    if ((hex == NULL) || (i != 2 * SIPHASH_KEY_LEN) || (hex[ i ] != '\0')) {
+        syslog(LOG_ERR, "vdb_fingerprint: siphash needs a fingerprint_key of "
+                        "%d hex digits",
+                2 * SIPHASH_KEY_LEN);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    for (i = 0; i < SIPHASH_KEY_LEN; i++) {
+        memcpy(byte, hex + (2 * i), 2);
+        vdb_fingerprint_key[ i ] = (uint8_t)strtoul(byte, NULL, 16);
+    }
+    vdb_fingerprint_format = VDB_FINGERPRINT_SIPHASH;
+
+    return VAC_RESULT_OK;
+}
+
+/* The sender fingerprint used in the keys of the LMDB and Redis VDBs. The
+ * Rabin fingerprint is bare hex, as it always has been; newer formats are
+ * prefixed with a version tag, which can't be mistaken for hex.
+ */
+yastr
+vdb_fingerprint(const yastr from) {
+    if (vdb_fingerprint_format == VDB_FINGERPRINT_SIPHASH) {
+        return vdb_fingerprint_siphash(from);
+    }
+    return vdb_fingerprint_rabin(from);
+}
+
+/* The fingerprint a reply would have been recorded under before
+ * core.fingerprint was changed, or NULL if there's nothing else to look for.
+ */
+yastr
+vdb_fingerprint_fallback(const yastr from) {
+    if ((vdb_fingerprint_format == VDB_FINGERPRINT_RABIN) ||
+            !ucl_object_toboolean(ucl_object_lookup_path(
+                    vac_config, "core.fingerprint_fallback"))) {
+        return NULL;
+    }
+
+    return vdb_fingerprint_rabin(from);
+}
+
+static yastr
+vdb_fingerprint_rabin(const yastr from) {
+    return yaslcatprintf(yaslempty(), "%lx",
+            (long)rabin_fingerprint(from, yasllen(from)));
+}
+
+static yastr
+vdb_fingerprint_siphash(const yastr from) {
+    uint8_t out[ 16 ];
+    size_t  i;
+    yastr   fp;
+
+    siphash(vdb_fingerprint_key, from, yasllen(from), out, sizeof(out));
+
+    fp = yaslauto("v2-");
+    for (i = 0; i < sizeof(out); i++) {
+        fp = yaslcatprintf(fp, "%02x", out[ i ]);
+    }
+
+    return fp;
+}
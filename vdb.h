@@ -1,6 +1,8 @@
 #ifndef BACKEND_VDB_H
 #define BACKEND_VDB_H
 
+#include <stdint.h>
+
 #include "simvacation.h"
 
 #ifdef HAVE_LMDB
@@ -12,16 +14,119 @@
 #endif /* HAVE_URCL */
 
 
+#ifdef HAVE_URCL
+struct redis_node {
+    yastr              host;
+    int                port;
+    urclHandle *       conn;
+    struct redis_node *replicas;
+    size_t             nreplicas;
+};
+
+struct redis_point {
+    uint64_t hash;
+    size_t   node;
+};
+
+struct vdb_redis {
+    struct redis_node * nodes;
+    size_t              nnodes;
+    struct redis_point *ring;
+    size_t              npoints;
+    size_t              owner;
+    urclHandle *        conn;
+    urclHandle *        reader;
+};
+#endif /* HAVE_URCL */
+
+struct vdb_mmaphash {
+    void *                  map;
+    size_t                  len;
+    struct mmaphash_bucket *buckets;
+    uint64_t                nbuckets;
+    uint64_t                rcpt_hash;
+};
+
+struct vdb_bloom {
+    void *   map;
+    size_t   len;
+    void *   filters;
+    uint64_t nfilters;
+    uint64_t nbits;
+    uint64_t k;
+    uint64_t span;
+};
+
+struct vdb_log {
+    yastr    path;
+    uint64_t rcpt_hash;
+};
+
+struct vdb_memory {
+    uint64_t rcpt_hash;
+};
+
+struct vdb_tiered {
+    struct vdb_backend *local_backend;
+    struct vdb *        local;
+    struct vdb_backend *remote_backend;
+    struct vdb *        remote;
+    yastr               journal;
+    bool                pending;
+};
+
+struct vdb_inject {
+    struct vdb_backend *backend;
+    struct vdb *        inner;
+};
+
+struct vdb_writebehind {
+    struct vdb_backend *      backend;
+    struct vdb *              inner;
+    yastr                     path;
+    struct writebehind_queue *queue;
+    bool                      submitted;
+};
+
 typedef enum {
     VDB_STATUS_OK,
     VDB_STATUS_RECENT,
 } vdb_status;
 
+/* A stored reply in backend-neutral form, as moved by simvacation-vdbtool.
+ * fp is the sender fingerprint as the keyed backends store it (see
+ * vdb_fingerprint), and expires is 0 when the backend doesn't record it.
+ */
+struct vdb_entry {
+    yastr  rcpt;
+    yastr  fp;
+    time_t ts;
+    time_t expires;
+};
+
+/* Receives each batch of a walk, along with a cursor that resumes the walk
+ * after it.
+ */
+typedef vac_result (*vdb_walk_cb)(
+        const struct vdb_entry *, size_t, const yastr, void *);
+
+/* Receives each batch of recipient names. The next batch isn't fetched until
+ * it returns, and anything but VAC_RESULT_OK stops the iteration.
+ */
+typedef vac_result (*vdb_names_cb)(const yastr *, size_t, void *);
+
 typedef struct vdb {
     union {
-        int null;
+        int                     null;
+        struct vdb_mmaphash *   mmaphash;
+        struct vdb_bloom *      bloom;
+        struct vdb_tiered *     tiered;
+        struct vdb_writebehind *writebehind;
+        struct vdb_inject *     inject;
+        struct vdb_log *        log;
+        struct vdb_memory *     memory;
 #ifdef HAVE_URCL
-        urclHandle *redis;
+        struct vdb_redis *redis;
 #endif /* HAVE_URCL */
 #ifdef HAVE_LMDB
         MDB_env *lmdb;
@@ -34,34 +139,116 @@ struct vdb_backend {
     VDB *(*init)(const yastr);
     void (*close)(VDB *);
     vdb_status (*recent)(VDB *, const yastr, time_t);
-    vac_result (*store_reply)(VDB *, const yastr);
-    ucl_object_t *(*get_names)(VDB *);
+    vac_result (*store_reply)(VDB *, const yastr, time_t);
+    vac_result (*get_names)(VDB *, size_t, vdb_names_cb, void *);
     void (*clean)(VDB *, const yastr);
     void (*gc)(VDB *);
+    vac_result (*compact)(VDB *);
+    vac_result (*walk)(VDB *, const yastr, size_t, vdb_walk_cb, void *);
+    vac_result (*load)(VDB *, const struct vdb_entry *, size_t);
+    ucl_object_t *(*stats)(VDB *);
 };
 
+#ifdef HAVE_LMDB
+extern double lmdb_vdb_lock_wait;
+#endif /* HAVE_LMDB */
+
 struct vdb_backend *vdb_backend(const char *);
 VDB *               vdb_init(const yastr);
 void                vdb_close(VDB *);
 vdb_status          vdb_recent(VDB *, const yastr, time_t);
-vac_result          vdb_store_reply(VDB *, const yastr);
-ucl_object_t *      vdb_get_names(VDB *);
+vac_result          vdb_store_reply(VDB *, const yastr, time_t);
+vac_result          vdb_get_names(VDB *, size_t, vdb_names_cb, void *);
 void                vdb_clean(VDB *, const yastr);
 void                vdb_gc(VDB *);
+vac_result          vdb_compact(VDB *);
+vac_result          vdb_walk(VDB *, const yastr, size_t, vdb_walk_cb, void *);
+vac_result          vdb_load(VDB *, const struct vdb_entry *, size_t);
+ucl_object_t *      vdb_stats(VDB *);
+void                vdb_entries_free(struct vdb_entry *, size_t);
+void *              vdb_mmap_file(const char *, size_t, size_t *);
+uint64_t            vdb_mix(uint64_t);
+yastr               vdb_fingerprint(const yastr);
+yastr               vdb_fingerprint_fallback(const yastr);
+
+VDB *         mmaphash_vdb_init(const yastr);
+void          mmaphash_vdb_close(VDB *);
+vdb_status    mmaphash_vdb_recent(VDB *, const yastr, time_t);
+vac_result    mmaphash_vdb_store_reply(VDB *, const yastr, time_t);
+ucl_object_t *mmaphash_vdb_stats(VDB *);
+
+VDB *      bloom_vdb_init(const yastr);
+void       bloom_vdb_close(VDB *);
+vdb_status bloom_vdb_recent(VDB *, const yastr, time_t);
+vac_result bloom_vdb_store_reply(VDB *, const yastr, time_t);
+
+VDB *      log_vdb_init(const yastr);
+void       log_vdb_close(VDB *);
+vdb_status log_vdb_recent(VDB *, const yastr, time_t);
+vac_result log_vdb_store_reply(VDB *, const yastr, time_t);
+void       log_vdb_gc(VDB *);
+
+VDB *      memory_vdb_init(const yastr);
+void       memory_vdb_close(VDB *);
+vdb_status memory_vdb_recent(VDB *, const yastr, time_t);
+vac_result memory_vdb_store_reply(VDB *, const yastr, time_t);
+void       memory_vdb_gc(VDB *);
+
+VDB *         tiered_vdb_init(const yastr);
+void          tiered_vdb_close(VDB *);
+vdb_status    tiered_vdb_recent(VDB *, const yastr, time_t);
+vac_result    tiered_vdb_store_reply(VDB *, const yastr, time_t);
+vac_result    tiered_vdb_get_names(VDB *, size_t, vdb_names_cb, void *);
+void          tiered_vdb_clean(VDB *, const yastr);
+void          tiered_vdb_gc(VDB *);
+vac_result    tiered_vdb_compact(VDB *);
+ucl_object_t *tiered_vdb_stats(VDB *);
+
+VDB *         writebehind_vdb_init(const yastr);
+void          writebehind_vdb_close(VDB *);
+vdb_status    writebehind_vdb_recent(VDB *, const yastr, time_t);
+vac_result    writebehind_vdb_store_reply(VDB *, const yastr, time_t);
+vac_result    writebehind_vdb_get_names(VDB *, size_t, vdb_names_cb, void *);
+void          writebehind_vdb_clean(VDB *, const yastr);
+void          writebehind_vdb_gc(VDB *);
+vac_result    writebehind_vdb_compact(VDB *);
+ucl_object_t *writebehind_vdb_stats(VDB *);
+
+vac_result    inject_vdb_wrap(const char *);
+VDB *         inject_vdb_init(const yastr);
+void          inject_vdb_close(VDB *);
+vdb_status    inject_vdb_recent(VDB *, const yastr, time_t);
+vac_result    inject_vdb_store_reply(VDB *, const yastr, time_t);
+vac_result    inject_vdb_get_names(VDB *, size_t, vdb_names_cb, void *);
+void          inject_vdb_clean(VDB *, const yastr);
+void          inject_vdb_gc(VDB *);
+vac_result    inject_vdb_compact(VDB *);
+vac_result    inject_vdb_walk(VDB *, const yastr, size_t, vdb_walk_cb, void *);
+vac_result    inject_vdb_load(VDB *, const struct vdb_entry *, size_t);
+ucl_object_t *inject_vdb_stats(VDB *);
 
 #ifdef HAVE_LMDB
-VDB *      lmdb_vdb_init(const yastr);
-void       lmdb_vdb_close(VDB *);
-vdb_status lmdb_vdb_recent(VDB *, const yastr, time_t);
-vac_result lmdb_vdb_store_reply(VDB *, const yastr);
-void       lmdb_vdb_gc(VDB *);
+VDB *         lmdb_vdb_init(const yastr);
+void          lmdb_vdb_close(VDB *);
+vdb_status    lmdb_vdb_recent(VDB *, const yastr, time_t);
+vac_result    lmdb_vdb_store_reply(VDB *, const yastr, time_t);
+void          lmdb_vdb_gc(VDB *);
+vac_result    lmdb_vdb_compact(VDB *);
+vac_result    lmdb_vdb_walk(VDB *, const yastr, size_t, vdb_walk_cb, void *);
+vac_result    lmdb_vdb_load(VDB *, const struct vdb_entry *, size_t);
+ucl_object_t *lmdb_vdb_stats(VDB *);
 #endif /* HAVE_LMDB */
 
 #ifdef HAVE_URCL
-VDB *      redis_vdb_init(const yastr);
-void       redis_vdb_close(VDB *);
-vdb_status redis_vdb_recent(VDB *, const yastr, time_t);
-vac_result redis_vdb_store_reply(VDB *, const yastr);
+VDB *         redis_vdb_init(const yastr);
+void          redis_vdb_close(VDB *);
+vdb_status    redis_vdb_recent(VDB *, const yastr, time_t);
+vac_result    redis_vdb_store_reply(VDB *, const yastr, time_t);
+vac_result    redis_vdb_get_names(VDB *, size_t, vdb_names_cb, void *);
+void          redis_vdb_clean(VDB *, const yastr);
+vac_result    redis_vdb_walk(VDB *, const yastr, size_t, vdb_walk_cb, void *);
+vac_result    redis_vdb_load(VDB *, const struct vdb_entry *, size_t);
+ucl_object_t *redis_vdb_stats(VDB *);
 #endif /* HAVE_URCL */
 
 #endif /* BACKEND_VDB_H */
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <math.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "rabin.h"
+#include "simvacation.h"
+#include "vdb.h"
+
+/* The file holds a ring of Bloom filters, one per bloom.span seconds of
+ * wall clock time. Filter e % nfilters covers epoch e = time / span; when a
+ * writer finds it still labelled with an older epoch it clears it and takes
+ * it over, so memory use is fixed and old replies are forgotten without a
+ * GC pass.
+ *
+ * A false positive means a reply that should have been sent is suppressed.
+ * Lookups round the interval out to whole epochs, so a reply can also be
+ * suppressed for up to one span longer than the interval asked for.
+ */
+
+#define BLOOM_MAGIC 0x73696d76626c6d01ULL /* "simvblm" v1 */
+#define BLOOM_ROTATE_SPINS 10000
+#define BLOOM_CLEAR_CHUNK 65536
+
+/* A filter's label is its epoch, or while it is being cleared a flag, the
+ * epoch it is being cleared for and a generation that's bumped whenever a
+ * stalled rotation is taken over. Epochs need far fewer than 40 bits.
+ */
+#define BLOOM_ROTATING (1ULL << 63)
+#define BLOOM_EPOCH_MASK ((1ULL << 40) - 1)
+#define BLOOM_GEN_SHIFT 40
+#define BLOOM_GEN_MASK (((1ULL << 23) - 1) << BLOOM_GEN_SHIFT)
+
+struct bloom_header {
+    uint64_t magic;
+    uint64_t nfilters;
+    uint64_t nbits;
+    uint64_t k;
+    uint64_t span;
+} __attribute__((aligned(64)));
+
+struct bloom_filter {
+    uint64_t epoch;
+} __attribute__((aligned(64)));
+
+static struct bloom_filter *bloom_vdb_filter(VDB *, uint64_t);
+static uint64_t *           bloom_vdb_bits(struct bloom_filter *);
+static struct bloom_filter *bloom_vdb_rotate(VDB *, uint64_t);
+static bool bloom_vdb_clear(VDB *, struct bloom_filter *, uint64_t);
+static void     bloom_vdb_hash(VDB *, const yastr, uint64_t *, uint64_t *);
+static uint64_t bloom_vdb_filter_size(uint64_t);
+
+VDB *
+bloom_vdb_init(const yastr rcpt) {
+    VDB *                vdb;
+    const char *         path;
+    double               capacity, fp_rate;
+    uint64_t             nbits, k, nfilters, span;
+    size_t               len;
+    struct bloom_header *header;
+
+    if ((path = ucl_object_tostring(
+                 ucl_object_lookup_path(vac_config, "bloom.path"))) == NULL) {
+        syslog(LOG_ALERT, "bloom vdb_init: no path configured");
+        return NULL;
+    }
+
+    capacity = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "bloom.capacity"));
+    fp_rate = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "bloom.fp_rate"));
+    nfilters = ucl_object_toint(
+            ucl_object_lookup_path(vac_config, "bloom.buckets"));
+    span = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "bloom.span"));
+
+    if ((capacity < 1) || (fp_rate <= 0) || (fp_rate >= 1) ||
+            (nfilters < 2) || (span < 1)) {
+        syslog(LOG_ALERT, "bloom vdb_init: invalid configuration");
+        return NULL;
+    }
+
+    /* Optimal size and hash count for the expected number of replies per
+     * span, rounded up to whole cache lines.
+     */
+    nbits = ceil(-capacity * log(fp_rate) / (M_LN2 * M_LN2));
+    nbits = (nbits + 511) & ~511ULL;
+    k = MAX(1, lround((double)nbits / capacity * M_LN2));
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "bloom vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->bloom = calloc(1, sizeof(struct vdb_bloom))) == NULL) {
+        syslog(LOG_ALERT, "bloom vdb_init: calloc: %m");
+        goto error;
+    }
+
+    if ((vdb->bloom->map = vdb_mmap_file(path,
+                 sizeof(struct bloom_header) +
+                         (nfilters * bloom_vdb_filter_size(nbits)),
+                 &len)) == NULL) {
+        goto error;
+    }
+    vdb->bloom->len = len;
+
+    /* An existing file keeps the geometry it was created with. */
+    header = vdb->bloom->map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0) {
+        header->nfilters = nfilters;
+        header->nbits = nbits;
+        header->k = k;
+        header->span = span;
+        __atomic_store_n(&header->magic, BLOOM_MAGIC, __ATOMIC_RELEASE);
+    }
+    if ((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != BLOOM_MAGIC) ||
+            (header->nfilters < 2) || (header->nbits == 0) ||
+            (header->nbits % 512 != 0) ||
+            (header->k == 0) || (header->span == 0) ||
+            (len < sizeof(struct bloom_header) +
+                            (header->nfilters *
+                                    bloom_vdb_filter_size(header->nbits)))) {
+        syslog(LOG_ALERT, "bloom vdb_init: %s is not a valid filter", path);
+        goto error;
+    }
+
+    vdb->bloom->filters = (char *)vdb->bloom->map + sizeof(struct bloom_header);
+    vdb->bloom->nfilters = header->nfilters;
+    vdb->bloom->nbits = header->nbits;
+    vdb->bloom->k = header->k;
+    vdb->bloom->span = header->span;
+    vdb->rcpt = yaslauto(rcpt);
+
+    return vdb;
+
+error:
+    bloom_vdb_close(vdb);
+    return NULL;
+}
+
+void
+bloom_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->bloom) {
+            if (vdb->bloom->map) {
+                munmap(vdb->bloom->map, vdb->bloom->len);
+            }
+            free(vdb->bloom);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+bloom_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    time_t               now;
+    uint64_t             epoch, oldest, h1, h2, bit, i;
+    uint64_t *           bits;
+    struct bloom_filter *filter;
+    bool                 found;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "bloom vdb_recent time: %m");
+        return VDB_STATUS_OK;
+    }
+
+    bloom_vdb_hash(vdb, from, &h1, &h2);
+
+    epoch = now / vdb->bloom->span;
+    oldest = (now - MIN(interval, now)) / vdb->bloom->span;
+    if (epoch - oldest >= vdb->bloom->nfilters) {
+        oldest = epoch - vdb->bloom->nfilters + 1;
+    }
+
+    for (; oldest <= epoch; oldest++) {
+        filter = bloom_vdb_filter(vdb, oldest);
+        if (__atomic_load_n(&filter->epoch, __ATOMIC_ACQUIRE) != oldest) {
+            continue;
+        }
+
+        bits = bloom_vdb_bits(filter);
+        found = true;
+        for (i = 0; found && (i < vdb->bloom->k); i++) {
+            bit = (h1 + (i * h2)) % vdb->bloom->nbits;
+            found = __atomic_load_n(&bits[ bit / 64 ], __ATOMIC_RELAXED) &
+                    (1ULL << (bit % 64));
+        }
+
+        /* Ignore the result if the filter was recycled underneath us. */
+        if (found &&
+                (__atomic_load_n(&filter->epoch, __ATOMIC_ACQUIRE) == oldest)) {
+            return VDB_STATUS_RECENT;
+        }
+    }
+
+    return VDB_STATUS_OK;
+}
+
+vac_result
+bloom_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    time_t               now;
+    uint64_t             h1, h2, bit, i;
+    uint64_t *           bits;
+    struct bloom_filter *filter;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "bloom vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (interval > (time_t)((vdb->bloom->nfilters - 1) * vdb->bloom->span)) {
+        syslog(LOG_INFO,
+                "bloom vdb_store_reply: interval %lld is longer than the "
+                "filter retains",
+                (long long)interval);
+    }
+
+    filter = bloom_vdb_rotate(vdb, now / vdb->bloom->span);
+    bits = bloom_vdb_bits(filter);
+    bloom_vdb_hash(vdb, from, &h1, &h2);
+
+    for (i = 0; i < vdb->bloom->k; i++) {
+        bit = (h1 + (i * h2)) % vdb->bloom->nbits;
+        __atomic_fetch_or(&bits[ bit / 64 ], 1ULL << (bit % 64),
+                __ATOMIC_RELAXED);
+    }
+
+    return VAC_RESULT_OK;
+}
+
+static uint64_t
+bloom_vdb_filter_size(uint64_t nbits) {
+    return sizeof(struct bloom_filter) + (nbits / 8);
+}
+
+static struct bloom_filter *
+bloom_vdb_filter(VDB *vdb, uint64_t epoch) {
+    return (struct bloom_filter *)((char *)vdb->bloom->filters +
+                                   ((epoch % vdb->bloom->nfilters) *
+                                           bloom_vdb_filter_size(
+                                                   vdb->bloom->nbits)));
+}
+
+static uint64_t *
+bloom_vdb_bits(struct bloom_filter *filter) {
+    return (uint64_t *)(filter + 1);
+}
+
+/* Return the filter for this epoch, clearing and relabelling it first if it
+ * still holds an older one. The relabelling is claimed with a CAS so only one
+ * writer clears it; the others wait, and take over if it takes implausibly
+ * long because the claimant died. Taking over is itself a CAS that bumps the
+ * label's generation, so a claimant that was only stalled sees that it lost
+ * the filter and leaves it alone instead of clearing it again or publishing
+ * it out from under the new owner.
+ */
+static struct bloom_filter *
+bloom_vdb_rotate(VDB *vdb, uint64_t epoch) {
+    struct bloom_filter *filter;
+    uint64_t             current, claim;
+    int                  spins = 0;
+
+    filter = bloom_vdb_filter(vdb, epoch);
+
+    for (;;) {
+        current = __atomic_load_n(&filter->epoch, __ATOMIC_ACQUIRE);
+
+        if (current == epoch) {
+            return filter;
+        }
+
+        if ((current & BLOOM_ROTATING) &&
+                ((current & BLOOM_EPOCH_MASK) == epoch)) {
+            if (++spins < BLOOM_ROTATE_SPINS) {
+                sched_yield();
+                continue;
+            }
+            claim = BLOOM_ROTATING | epoch |
+                    ((current + (1ULL << BLOOM_GEN_SHIFT)) & BLOOM_GEN_MASK);
+            spins = 0;
+            if (!__atomic_compare_exchange_n(&filter->epoch, &current, claim,
+                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            syslog(LOG_NOTICE, "bloom vdb_rotate: taking over rotation");
+        } else if ((current & BLOOM_EPOCH_MASK) > epoch) {
+            /* Our clock is behind another writer's, so record the reply in
+             * the newer filter rather than wiping it.
+             */
+            return filter;
+        } else {
+            claim = BLOOM_ROTATING | epoch | (current & BLOOM_GEN_MASK);
+            if (!__atomic_compare_exchange_n(&filter->epoch, &current, claim,
+                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+        }
+
+        /* If this fails the rotation was taken over, and the loop goes back
+         * to waiting for the new owner.
+         */
+        if (bloom_vdb_clear(vdb, filter, claim) &&
+                __atomic_compare_exchange_n(&filter->epoch, &claim, epoch,
+                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return filter;
+        }
+    }
+}
+
+/* Clears the filter a chunk at a time, stopping as soon as the claim on it
+ * has been taken over.
+ */
+static bool
+bloom_vdb_clear(VDB *vdb, struct bloom_filter *filter, uint64_t claim) {
+    char * bits = (char *)bloom_vdb_bits(filter);
+    size_t len = vdb->bloom->nbits / 8;
+    size_t off;
+
+    for (off = 0; off < len; off += BLOOM_CLEAR_CHUNK) {
+        if (__atomic_load_n(&filter->epoch, __ATOMIC_ACQUIRE) != claim) {
+            return false;
+        }
+        memset(bits + off, 0, MIN(len - off, BLOOM_CLEAR_CHUNK));
+    }
+
+    return true;
+}
+
+/* Two independent hashes of the recipient and sender, combined as
+ * h1 + i * h2 to derive all k bit positions.
+ */
+static void
+bloom_vdb_hash(VDB *vdb, const yastr from, uint64_t *h1, uint64_t *h2) {
+    yastr    buf;
+    uint64_t h;
+
+    buf = yaslcatlen(yasldup(vdb->rcpt), "", 1);
+    buf = yaslcatyasl(buf, from);
+    h = rabin_fingerprint(buf, yasllen(buf));
+    yaslfree(buf);
+
+    *h1 = vdb_mix(h);
+    /* Keep the step odd so it can't be zero. */
+    *h2 = vdb_mix(h ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+
+/* Wraps another backend (vdb = inject:<backend>) and adds latency, errors
+ * and dropped connections to init, recent, store_reply and gc, so that the
+ * effect of a slow or failing store can be measured without an outage.
+ *
+ * Each operation is configured by the inject section named after it, with
+ * anything it doesn't set taken from inject.default. An injected error fails
+ * the operation without reaching the wrapped backend. A dropped connection
+ * also closes the wrapped handle; the next operation reopens it, paying
+ * init's injected costs again.
+ */
+
+static yastr inject_provider = NULL;
+
+static vac_result          inject_vdb_fault(VDB *, const char *);
+static double              inject_vdb_latency(const char *);
+static const ucl_object_t *inject_vdb_config(const char *, const char *);
+static vac_result          inject_vdb_open(VDB *);
+
+/* Called by vdb_backend with the name of the backend to wrap. There is one
+ * wrapped backend per process.
+ */
+vac_result
+inject_vdb_wrap(const char *provider) {
+    struct vdb_backend *backend;
+
+    if (strncasecmp(provider, "inject:", 7) == 0) {
+        syslog(LOG_ERR, "vdb_backend: inject cannot wrap itself");
+        return VAC_RESULT_PERMFAIL;
+    }
+
+    if ((backend = vdb_backend(provider)) == NULL) {
+        return VAC_RESULT_PERMFAIL;
+    }
+    free(backend);
+
+    yaslfree(inject_provider);
+    inject_provider = yaslauto(provider);
+    return VAC_RESULT_OK;
+}
+
+VDB *
+inject_vdb_init(const yastr rcpt) {
+    VDB *   vdb;
+    int64_t seed;
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "inject vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->inject = calloc(1, sizeof(struct vdb_inject))) == NULL) {
+        syslog(LOG_ALERT, "inject vdb_init: calloc: %m");
+        free(vdb);
+        return NULL;
+    }
+
+    vdb->rcpt = yaslauto(rcpt);
+
+    if ((seed = ucl_object_toint(
+                 ucl_object_lookup_path(vac_config, "inject.seed"))) == 0) {
+        seed = time(NULL) ^ ((int64_t)getpid() << 16);
+    }
+    srand48(seed);
+
+    if ((vdb->inject->backend = vdb_backend(inject_provider)) == NULL) {
+        inject_vdb_close(vdb);
+        return NULL;
+    }
+
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        inject_vdb_close(vdb);
+        return NULL;
+    }
+
+    return vdb;
+}
+
+void
+inject_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->inject) {
+            if (vdb->inject->inner) {
+                vdb->inject->backend->close(vdb->inject->inner);
+            }
+            free(vdb->inject->backend);
+            free(vdb->inject);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+inject_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    /* Lookup failures fail open, the same as a real backend's. */
+    if ((inject_vdb_open(vdb) != VAC_RESULT_OK) ||
+            (inject_vdb_fault(vdb, "recent") != VAC_RESULT_OK)) {
+        return VDB_STATUS_OK;
+    }
+    return vdb->inject->backend->recent(vdb->inject->inner, from, interval);
+}
+
+vac_result
+inject_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    if ((inject_vdb_open(vdb) != VAC_RESULT_OK) ||
+            (inject_vdb_fault(vdb, "store_reply") != VAC_RESULT_OK)) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return vdb->inject->backend->store_reply(
+            vdb->inject->inner, from, interval);
+}
+
+vac_result
+inject_vdb_get_names(VDB *vdb, size_t batch, vdb_names_cb cb, void *ctx) {
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return vdb->inject->backend->get_names(
+            vdb->inject->inner, batch, cb, ctx);
+}
+
+void
+inject_vdb_clean(VDB *vdb, const yastr user) {
+    if (inject_vdb_open(vdb) == VAC_RESULT_OK) {
+        vdb->inject->backend->clean(vdb->inject->inner, user);
+    }
+}
+
+void
+inject_vdb_gc(VDB *vdb) {
+    if ((inject_vdb_open(vdb) == VAC_RESULT_OK) &&
+            (inject_vdb_fault(vdb, "gc") == VAC_RESULT_OK)) {
+        vdb->inject->backend->gc(vdb->inject->inner);
+    }
+}
+
+vac_result
+inject_vdb_compact(VDB *vdb) {
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return vdb->inject->backend->compact(vdb->inject->inner);
+}
+
+vac_result
+inject_vdb_walk(VDB *vdb, const yastr resume, size_t batch, vdb_walk_cb cb,
+        void *ctx) {
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return vdb->inject->backend->walk(
+            vdb->inject->inner, resume, batch, cb, ctx);
+}
+
+vac_result
+inject_vdb_load(VDB *vdb, const struct vdb_entry *entries, size_t n) {
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return vdb->inject->backend->load(vdb->inject->inner, entries, n);
+}
+
+ucl_object_t *
+inject_vdb_stats(VDB *vdb) {
+    if (inject_vdb_open(vdb) != VAC_RESULT_OK) {
+        return ucl_object_typed_new(UCL_OBJECT);
+    }
+    return vdb->inject->backend->stats(vdb->inject->inner);
+}
+
+/* Opens the wrapped handle if it isn't, which is after a dropped
+ * connection.
+ */
+static vac_result
+inject_vdb_open(VDB *vdb) {
+    if (vdb->inject->inner) {
+        return VAC_RESULT_OK;
+    }
+
+    if (inject_vdb_fault(vdb, "init") != VAC_RESULT_OK) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if ((vdb->inject->inner = vdb->inject->backend->init(vdb->rcpt)) ==
+            NULL) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    return VAC_RESULT_OK;
+}
+
+/* Sleeps for the operation's latency, then decides whether it fails. */
+static vac_result
+inject_vdb_fault(VDB *vdb, const char *op) {
+    double          latency;
+    struct timespec ts;
+
+    if ((latency = inject_vdb_latency(op)) > 0) {
+        ts.tv_sec = (time_t)latency;
+        ts.tv_nsec = (long)((latency - ts.tv_sec) * 1e9);
+        while ((nanosleep(&ts, &ts) != 0) && (ts.tv_sec || ts.tv_nsec))
+            ;
+    }
+
+    if (drand48() <
+            ucl_object_todouble(inject_vdb_config(op, "drop_rate"))) {
+        syslog(LOG_NOTICE, "inject: dropping connection in %s", op);
+        if (vdb->inject->inner) {
+            vdb->inject->backend->close(vdb->inject->inner);
+            vdb->inject->inner = NULL;
+        }
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (drand48() <
+            ucl_object_todouble(inject_vdb_config(op, "error_rate"))) {
+        syslog(LOG_NOTICE, "inject: failing %s", op);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    return VAC_RESULT_OK;
+}
+
+static double
+inject_vdb_latency(const char *op) {
+    const char *dist;
+    double      mean, shape, latency;
+
+    mean = ucl_object_todouble(inject_vdb_config(op, "latency"));
+    dist = ucl_object_tostring(inject_vdb_config(op, "distribution"));
+
+    if ((mean <= 0) || (dist == NULL) || (strcasecmp(dist, "fixed") == 0)) {
+        latency = mean;
+    } else if (strcasecmp(dist, "uniform") == 0) {
+        latency = 2 * mean * drand48();
+    } else if (strcasecmp(dist, "exponential") == 0) {
+        latency = -mean * log(1 - drand48());
+    } else if (strcasecmp(dist, "pareto") == 0) {
+        /* Heavy tailed, with the minimum chosen to give the right mean. */
+        if ((shape = ucl_object_todouble(inject_vdb_config(op, "shape"))) <=
+                1) {
+            shape = 2;
+        }
+        latency = mean * (shape - 1) / shape /
+                  pow(1 - drand48(), 1 / shape);
+    } else {
+        syslog(LOG_ERR, "inject: unknown latency distribution %s", dist);
+        latency = mean;
+    }
+
+    return fmin(latency, ucl_object_todouble(inject_vdb_config(op, "max")));
+}
+
+static const ucl_object_t *
+inject_vdb_config(const char *op, const char *key) {
+    const ucl_object_t *obj;
+    yastr               path;
+
+    path = yaslcatprintf(yaslempty(), "inject.%s.%s", op, key);
+    if ((obj = ucl_object_lookup_path(vac_config, path)) == NULL) {
+        yaslclear(path);
+        path = yaslcatprintf(path, "inject.default.%s", key);
+        obj = ucl_object_lookup_path(vac_config, path);
+    }
+    yaslfree(path);
+
+    return obj;
+}
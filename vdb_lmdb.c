@@ -7,27 +7,105 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "rabin.h"
+#include "senderset.h"
 #include "simvacation.h"
 #include "vdb.h"
+#include "vjournal.h"
+#include "vutil.h"
 
-yastr lmdb_vdb_key(const yastr, const yastr);
-void  lmdb_vdb_assert(MDB_env *, const char *);
+void                 lmdb_vdb_assert(MDB_env *, const char *);
+static int           lmdb_vdb_txn_begin(VDB *, unsigned int, MDB_txn **);
+static int           lmdb_vdb_grow(VDB *);
+static int64_t       lmdb_vdb_shards(void);
+static VDB *         lmdb_vdb_open(const yastr, int64_t);
+static vac_result    lmdb_vdb_each_shard(VDB *, vac_result (*)(VDB *));
+static vac_result    lmdb_vdb_gc_env(VDB *);
+static vac_result    lmdb_vdb_compact_env(VDB *);
+static int           lmdb_vdb_lock_fd(VDB *);
+static void          lmdb_vdb_release(VDB *);
+static void          lmdb_vdb_journal(VDB *, const yastr, time_t, time_t);
+static vac_result    lmdb_vdb_walk_env(
+        VDB *, int64_t, yastr, size_t, vdb_walk_cb, void *);
+static vac_result    lmdb_vdb_load_env(
+        VDB *, int64_t, const struct vdb_entry *, size_t);
+static ucl_object_t *lmdb_vdb_stats_env(VDB *);
+static yastr         lmdb_vdb_fp_key(const char *, const char *);
+static bool          lmdb_vdb_sets_layout(void);
+static int           lmdb_vdb_get_ts(
+        MDB_txn *, MDB_dbi, const char *, const char *, time_t *);
+static int           lmdb_vdb_put_ts(
+        VDB *, MDB_txn *, MDB_dbi, const char *, const char *, time_t, bool);
+static yastr         lmdb_vdb_set_key(const char *, bool, uint64_t);
+static bool          lmdb_vdb_set_match(const MDB_val *, const yastr);
+static int           lmdb_vdb_set_get(
+        MDB_txn *, MDB_dbi, const char *, const char *, time_t *);
+static int           lmdb_vdb_set_store(
+        VDB *, MDB_txn *, MDB_dbi, const char *, const char *, time_t, bool);
+static int           lmdb_vdb_set_put(MDB_txn *, MDB_dbi, const char *,
+        const struct senderset *, size_t, size_t, uint64_t, size_t);
+static int           lmdb_vdb_set_expire(
+        MDB_cursor *, MDB_val *, MDB_val *, time_t, long *, long *);
+static vac_result    lmdb_vdb_set_entries(const MDB_val *, const MDB_val *,
+        struct vdb_entry **, size_t *, size_t *);
+
+/* Time this process has spent waiting to begin write transactions. */
+double lmdb_vdb_lock_wait = 0;
 
 VDB *
 lmdb_vdb_init(const yastr rcpt) {
+    int64_t     shards;
+    const char *journal;
+
+    /* Journal segments are named by the span they were written in. */
+    if (((journal = ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "replicate.journal"))) != NULL) &&
+            (*journal != '\0') &&
+            ((time_t)ucl_object_todouble(ucl_object_lookup_path(
+                     vac_config, "replicate.segment_span")) < 1)) {
+        syslog(LOG_ERR, "lmdb vdb_init: replicate.segment_span must be at "
+                        "least 1s");
+        return NULL;
+    }
+
+    /* Each shard is a separate environment with its own writer lock, so
+     * deliveries to different recipients don't serialise on a single lock.
+     */
+    if ((shards = lmdb_vdb_shards()) > 1) {
+        return lmdb_vdb_open(
+                rcpt, rabin_fingerprint(rcpt, yasllen(rcpt)) % shards);
+    }
+
+    return lmdb_vdb_open(rcpt, -1);
+}
+
+static int64_t
+lmdb_vdb_shards(void) {
+    return ucl_object_toint(ucl_object_lookup_path(vac_config, "lmdb.shards"));
+}
+
+static VDB *
+lmdb_vdb_open(const yastr rcpt, int64_t shard) {
     int         rc;
     VDB *       vdb;
     const char *lmdb_path;
+    yastr       shard_path = NULL, lock_path = NULL;
+    int64_t     mapsize;
+    int *       lock_fd;
 
     if ((lmdb_path = ucl_object_tostring(
                  ucl_object_lookup_path(vac_config, "lmdb.path"))) == NULL) {
@@ -35,7 +113,19 @@ lmdb_vdb_init(const yastr rcpt) {
         return NULL;
     }
 
+    if (shard >= 0) {
+        shard_path = yaslcatprintf(
+                yaslempty(), "%s/shard%03lld", lmdb_path, (long long)shard);
+        if ((mkdir(shard_path, 0775) != 0) && (errno != EEXIST)) {
+            syslog(LOG_ALERT, "lmdb vdb_init mkdir %s: %m", shard_path);
+            yaslfree(shard_path);
+            return NULL;
+        }
+        lmdb_path = shard_path;
+    }
+
     if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        yaslfree(shard_path);
         return NULL;
     }
 
@@ -50,26 +140,180 @@ lmdb_vdb_init(const yastr rcpt) {
         goto error;
     }
 
-    if ((rc = mdb_env_set_mapsize(vdb->lmdb, 1073741824)) != 0) {
+    /* This only matters when the environment is created or grown, since
+     * LMDB will use the size recorded in the existing file if it's larger.
+     */
+    mapsize = ucl_object_toint(
+            ucl_object_lookup_path(vac_config, "lmdb.mapsize"));
+    if ((rc = mdb_env_set_mapsize(vdb->lmdb, mapsize)) != 0) {
         syslog(LOG_ALERT, "lmdb vdb_init mdb_env_mapsize: %s",
                 mdb_strerror(rc));
         goto error;
     }
 
+    /* Every process that opens the environment holds a shared lock on it for
+     * as long as it's open, so that compaction can tell when it has the
+     * environment to itself. This waits out a compaction in progress.
+     */
+    lock_path = yaslcatprintf(yaslempty(), "%s/simvacation.lock", lmdb_path);
+    if ((lock_fd = malloc(sizeof(*lock_fd))) == NULL) {
+        syslog(LOG_ALERT, "lmdb vdb_init malloc: %m");
+        goto error;
+    }
+    if ((*lock_fd = open(lock_path, O_RDONLY | O_CREAT, 0664)) < 0) {
+        syslog(LOG_ALERT, "lmdb vdb_init open %s: %m", lock_path);
+        free(lock_fd);
+        goto error;
+    }
+    mdb_env_set_userctx(vdb->lmdb, lock_fd);
+    if (flock(*lock_fd, LOCK_SH) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_init flock %s: %m", lock_path);
+        goto error;
+    }
+
     if ((rc = mdb_env_open(vdb->lmdb, lmdb_path, 0, 0664)) != 0) {
         syslog(LOG_ALERT, "lmdb vdb_init mdb_env_open: %s", mdb_strerror(rc));
         goto error;
     }
 
+    yaslfree(shard_path);
+    yaslfree(lock_path);
     vdb->rcpt = yasldup(rcpt);
 
     return vdb;
 
 error:
-    vdb_close(vdb);
+    yaslfree(shard_path);
+    yaslfree(lock_path);
+    lmdb_vdb_close(vdb);
     return NULL;
 }
 
+/* Runs fn against every shard, in parallel child processes when there's more
+ * than one. LMDB environments can't be carried across fork(), so each child
+ * opens its own.
+ */
+static vac_result
+lmdb_vdb_each_shard(VDB *vdb, vac_result (*fn)(VDB *)) {
+    int64_t    shards, jobs, shard = 0;
+    int        running = 0, status;
+    VDB *      shard_vdb;
+    vac_result retval = VAC_RESULT_OK;
+
+    if ((shards = lmdb_vdb_shards()) <= 1) {
+        return fn(vdb);
+    }
+
+    if ((jobs = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "lmdb.gc_jobs"))) < 1) {
+        jobs = 1;
+    }
+
+    while ((shard < shards) || (running > 0)) {
+        if ((shard < shards) && (running < jobs)) {
+            switch (fork()) {
+            case -1:
+                syslog(LOG_ERR, "lmdb vdb_each_shard fork: %m");
+                retval = VAC_RESULT_TEMPFAIL;
+                /* Stop starting new jobs, but reap the running ones. */
+                shard = shards;
+                break;
+
+            case 0:
+                if ((shard_vdb = lmdb_vdb_open(vdb->rcpt, shard)) == NULL) {
+                    exit(1);
+                }
+                retval = fn(shard_vdb);
+                lmdb_vdb_close(shard_vdb);
+                exit((retval == VAC_RESULT_OK) ? 0 : 1);
+
+            default:
+                running++;
+                shard++;
+            }
+            continue;
+        }
+
+        if (wait(&status) < 0) {
+            syslog(LOG_ERR, "lmdb vdb_each_shard wait: %m");
+            return VAC_RESULT_TEMPFAIL;
+        }
+        running--;
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            retval = VAC_RESULT_TEMPFAIL;
+        }
+    }
+
+    return retval;
+}
+
+static int
+lmdb_vdb_txn_begin(VDB *vdb, unsigned int flags, MDB_txn **txn) {
+    int    rc;
+    double start = 0;
+
+    if ((flags & MDB_RDONLY) == 0) {
+        start = monotonic_seconds();
+    }
+
+    if ((rc = mdb_txn_begin(vdb->lmdb, NULL, flags, txn)) == MDB_MAP_RESIZED) {
+        /* Another process grew the map, so we need to pick up the new size
+         * before we can do anything.
+         */
+        if ((rc = mdb_env_set_mapsize(vdb->lmdb, 0)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_txn_begin mdb_env_set_mapsize: %s",
+                    mdb_strerror(rc));
+            return rc;
+        }
+        rc = mdb_txn_begin(vdb->lmdb, NULL, flags, txn);
+    }
+
+    if ((flags & MDB_RDONLY) == 0) {
+        lmdb_vdb_lock_wait += monotonic_seconds() - start;
+    }
+
+    return rc;
+}
+
+static int
+lmdb_vdb_grow(VDB *vdb) {
+    int         rc;
+    MDB_envinfo info;
+    size_t      mapsize;
+    int64_t     mapsize_max;
+
+    if ((rc = mdb_env_info(vdb->lmdb, &info)) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_grow mdb_env_info: %s", mdb_strerror(rc));
+        return rc;
+    }
+
+    mapsize_max = ucl_object_toint(
+            ucl_object_lookup_path(vac_config, "lmdb.mapsize_max"));
+
+    if (info.me_mapsize >= mapsize_max) {
+        syslog(LOG_ALERT, "lmdb vdb_grow: map is already at maximum size %zu",
+                info.me_mapsize);
+        return MDB_MAP_FULL;
+    }
+
+    mapsize = MIN(info.me_mapsize * 2, mapsize_max);
+
+    /* This is only safe with no transactions active in this process, which
+     * is always the case when it's called. Other processes will get
+     * MDB_MAP_RESIZED on their next transaction and adopt the new size.
+     */
+    if ((rc = mdb_env_set_mapsize(vdb->lmdb, mapsize)) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_grow mdb_env_set_mapsize: %s",
+                mdb_strerror(rc));
+        return rc;
+    }
+
+    syslog(LOG_NOTICE, "lmdb vdb_grow: increased map size from %zu to %zu",
+            info.me_mapsize, mapsize);
+
+    return 0;
+}
+
 void
 lmdb_vdb_assert(MDB_env *dbenv, const char *msg) {
     syslog(LOG_ALERT, "lmdb assert: %s", msg);
@@ -79,30 +323,59 @@ lmdb_vdb_assert(MDB_env *dbenv, const char *msg) {
 void
 lmdb_vdb_close(VDB *vdb) {
     if (vdb) {
-        if (vdb->lmdb) {
-            mdb_env_close(vdb->lmdb);
-        }
+        lmdb_vdb_release(vdb);
+        yaslfree(vdb->rcpt);
         free(vdb);
     }
 }
 
+/* The descriptor of the environment's open lock, or -1. */
+static int
+lmdb_vdb_lock_fd(VDB *vdb) {
+    int *lock_fd;
+
+    if ((vdb->lmdb == NULL) ||
+            ((lock_fd = mdb_env_get_userctx(vdb->lmdb)) == NULL)) {
+        return -1;
+    }
+    return *lock_fd;
+}
+
+/* Closes the environment and then drops its open lock. */
+static void
+lmdb_vdb_release(VDB *vdb) {
+    int *lock_fd;
+
+    if (vdb->lmdb) {
+        lock_fd = mdb_env_get_userctx(vdb->lmdb);
+        mdb_env_close(vdb->lmdb);
+        vdb->lmdb = NULL;
+        if (lock_fd) {
+            close(*lock_fd);
+            free(lock_fd);
+        }
+    }
+}
+
+/* During a change of core.fingerprint, a reply recorded under the previous
+ * fingerprint is looked for in the same transaction.
+ */
 vdb_status
 lmdb_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
-    int      rc, retval = VDB_STATUS_OK;
+    int      rc, i, retval = VDB_STATUS_OK;
     time_t   last, now;
     MDB_txn *txn;
     MDB_dbi  dbi;
-    MDB_val  key, data;
-    yastr    keyval = NULL;
+    yastr    fp[ 2 ];
 
-    if ((keyval = lmdb_vdb_key(vdb->rcpt, from)) == NULL) {
-        return VDB_STATUS_OK;
-    }
+    fp[ 0 ] = vdb_fingerprint(from);
+    fp[ 1 ] = vdb_fingerprint_fallback(from);
 
-    if ((rc = mdb_txn_begin(vdb->lmdb, NULL, MDB_RDONLY, &txn)) != 0) {
+    if ((rc = lmdb_vdb_txn_begin(vdb, MDB_RDONLY, &txn)) != 0) {
         syslog(LOG_ALERT, "lmdb vdb_recent mdb_txn_begin: %s",
                 mdb_strerror(rc));
-        yaslfree(keyval);
+        yaslfree(fp[ 0 ]);
+        yaslfree(fp[ 1 ]);
         return VDB_STATUS_OK;
     }
 
@@ -111,145 +384,1110 @@ lmdb_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
         goto cleanup;
     }
 
-    key.mv_size = yasllen(keyval);
-    key.mv_data = keyval;
-
-    if ((rc = mdb_get(txn, dbi, &key, &data)) != 0) {
-        if (rc != MDB_NOTFOUND) {
-            syslog(LOG_ALERT, "lmdb vdb_recent mdb_get: %s", mdb_strerror(rc));
-        }
-        goto cleanup;
-    }
-
-    if (data.mv_size != sizeof(last)) {
-        syslog(LOG_ALERT, "lmdb vdb_recent: retrieved bad data");
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "lmdb vdb_recent time: %m");
         goto cleanup;
     }
 
-    last = *(time_t *)data.mv_data;
+    for (i = 0; (i < 2) && fp[ i ] && (retval == VDB_STATUS_OK); i++) {
+        if ((rc = lmdb_vdb_get_ts(txn, dbi, vdb->rcpt, fp[ i ], &last)) !=
+                0) {
+            if (rc != MDB_NOTFOUND) {
+                syslog(LOG_ALERT, "lmdb vdb_recent: %s", mdb_strerror(rc));
+            }
+            continue;
+        }
 
-    if ((now = time(NULL)) < 0) {
-        syslog(LOG_ALERT, "lmdb vdb_recent time: %m");
-    } else if (now < (last + interval)) {
-        retval = VDB_STATUS_RECENT;
+        if (now < (last + interval)) {
+            retval = VDB_STATUS_RECENT;
+        }
     }
 
 cleanup:
-    yaslfree(keyval);
+    yaslfree(fp[ 0 ]);
+    yaslfree(fp[ 1 ]);
     mdb_txn_abort(txn);
     return (retval);
 }
 
 vac_result
-lmdb_vdb_store_reply(VDB *vdb, const yastr from) {
-    int      rc;
-    time_t   now;
-    MDB_txn *txn;
-    MDB_dbi  dbi;
-    MDB_val  key, data;
-    char *   keyval;
+lmdb_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    int        rc;
+    time_t     now;
+    MDB_txn *  txn;
+    MDB_dbi    dbi;
+    yastr      fp;
+    vac_result retval = VAC_RESULT_TEMPFAIL;
 
     if ((now = time(NULL)) < 0) {
         syslog(LOG_ALERT, "lmdb vdb_store_reply time: %m");
         return VAC_RESULT_TEMPFAIL;
     }
 
-    if ((rc = mdb_txn_begin(vdb->lmdb, NULL, 0, &txn)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_txn_begin: %s",
-                mdb_strerror(rc));
-        return VAC_RESULT_TEMPFAIL;
+    fp = vdb_fingerprint(from);
+
+    for (;;) {
+        if ((rc = lmdb_vdb_txn_begin(vdb, 0, &txn)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_txn_begin: %s",
+                    mdb_strerror(rc));
+            break;
+        }
+
+        if ((rc = mdb_dbi_open(txn, NULL, MDB_CREATE, &dbi)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_dbi_open: %s",
+                    mdb_strerror(rc));
+            mdb_txn_abort(txn);
+            break;
+        }
+
+        if ((rc = lmdb_vdb_put_ts(vdb, txn, dbi, vdb->rcpt, fp, now, false)) !=
+                0) {
+            mdb_txn_abort(txn);
+        } else {
+            rc = mdb_txn_commit(txn);
+        }
+
+        if (rc == 0) {
+            retval = VAC_RESULT_OK;
+            break;
+        }
+
+        if ((rc != MDB_MAP_FULL) || (lmdb_vdb_grow(vdb) != 0)) {
+            syslog(LOG_ALERT, "lmdb vdb_store_reply: %s", mdb_strerror(rc));
+            break;
+        }
     }
 
-    if ((rc = mdb_dbi_open(txn, NULL, MDB_CREATE, &dbi)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_dbi_open: %s",
-                mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return VAC_RESULT_TEMPFAIL;
+    if (retval == VAC_RESULT_OK) {
+        lmdb_vdb_journal(vdb, fp, now, interval);
     }
 
-    keyval = lmdb_vdb_key(vdb->rcpt, from);
-    key.mv_size = strlen(keyval);
-    key.mv_data = keyval;
+    yaslfree(fp);
+    return retval;
+}
 
-    data.mv_size = sizeof(now);
-    data.mv_data = &now;
+/* Records the reply for simvacation-replicate to ship to the other nodes.
+ * The reply is already stored locally, so a failure here only costs
+ * suppression on the other nodes.
+ */
+static void
+lmdb_vdb_journal(VDB *vdb, const yastr fp, time_t now, time_t interval) {
+    const char *     dir;
+    struct vdb_entry entry;
 
-    if ((rc = mdb_put(txn, dbi, &key, &data, 0)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_put: %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return VAC_RESULT_TEMPFAIL;
+    if (((dir = ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "replicate.journal"))) == NULL) ||
+            (*dir == '\0')) {
+        return;
     }
 
-    if ((rc = mdb_txn_commit(txn)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_store_reply mdb_txn_commit: %s",
-                mdb_strerror(rc));
-        return VAC_RESULT_TEMPFAIL;
-    }
+    entry.rcpt = vdb->rcpt;
+    entry.fp = fp;
+    entry.ts = now;
+    entry.expires = now + interval;
 
-    return VAC_RESULT_OK;
+    if (vjournal_append(dir,
+                (time_t)ucl_object_todouble(ucl_object_lookup_path(
+                        vac_config, "replicate.segment_span")),
+                &entry, 1) != VAC_RESULT_OK) {
+        syslog(LOG_ERR, "lmdb vdb_store_reply: failed to journal reply");
+    }
 }
 
 void
 lmdb_vdb_gc(VDB *vdb) {
+    lmdb_vdb_each_shard(vdb, lmdb_vdb_gc_env);
+}
+
+static vac_result
+lmdb_vdb_gc_env(VDB *vdb) {
     int         rc;
     MDB_txn *   txn;
     MDB_dbi     dbi;
     MDB_cursor *cursor;
     MDB_val     key, data;
-    time_t      expire;
+    time_t      expire, last;
+    int64_t     batch_size, n;
+    double      slice, start, locked;
+    double      wait_time = 0, hold_time = 0;
+    long        batches = 0, examined = 0, removed = 0;
+    bool        done = false;
+    const char *path = NULL;
+    yastr       resume;
+    vac_result  retval = VAC_RESULT_OK;
 
     if ((expire = time(NULL)) < 0) {
         syslog(LOG_ALERT, "lmdb vdb_gc time: %m");
-        return;
+        return VAC_RESULT_TEMPFAIL;
     }
 
-    /* Clean up entries older than 7 days. */
-    expire = expire - 604800;
+    /* An entry can go once it's older than any recipient's reply interval. */
+    expire -= MAX((time_t)ucl_object_todouble(ucl_object_lookup_path(
+                          vac_config, "core.interval")),
+            (time_t)ucl_object_todouble(ucl_object_lookup_path(
+                    vac_config, "core.group_interval")));
 
-    if ((rc = mdb_txn_begin(vdb->lmdb, NULL, 0, &txn)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_gc mdb_txn_begin: %s", mdb_strerror(rc));
-        return;
+    if ((batch_size = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "lmdb.gc_batch"))) < 1) {
+        batch_size = 1;
     }
+    slice = ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "lmdb.gc_slice"));
 
-    if ((rc = mdb_dbi_open(txn, NULL, MDB_CREATE, &dbi)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_gc mdb_dbi_open: %s", mdb_strerror(rc));
+    /* LMDB only allows one writer at a time, so instead of holding the
+     * writer lock for the whole scan we work through the keyspace in short
+     * transactions, each of which is limited both by the number of entries
+     * examined and by wall clock time. The next unexamined key is saved
+     * before each commit so the following transaction can pick up where
+     * this one left off. Sender set blocks sort before the per-sender keys,
+     * and either layout may be present after a change of lmdb.layout.
+     */
+    resume = yaslauto("set:");
+
+    while (!done) {
+        start = monotonic_seconds();
+        if ((rc = lmdb_vdb_txn_begin(vdb, 0, &txn)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_gc mdb_txn_begin: %s",
+                    mdb_strerror(rc));
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+        locked = monotonic_seconds();
+        wait_time += locked - start;
+        batches++;
+
+        if ((rc = mdb_dbi_open(txn, NULL, MDB_CREATE, &dbi)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_gc mdb_dbi_open: %s", mdb_strerror(rc));
+            mdb_txn_abort(txn);
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        if ((rc = mdb_cursor_open(txn, dbi, &cursor)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_gc mdb_cursor_open: %s",
+                    mdb_strerror(rc));
+            mdb_txn_abort(txn);
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        key.mv_size = yasllen(resume);
+        key.mv_data = resume;
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+
+        for (n = 0; rc == 0; n++) {
+            if (((key.mv_size < 4) || (memcmp(key.mv_data, "set:", 4) != 0)) &&
+                    ((key.mv_size < 5) ||
+                            (memcmp(key.mv_data, "user:", 5) != 0))) {
+                /* We've walked off the end of the user entries. */
+                rc = MDB_NOTFOUND;
+                break;
+            }
+
+            /* Every transaction gets through at least one entry, however
+             * short the slice, so that the scan always makes progress.
+             */
+            if ((n > 0) && ((n >= batch_size) ||
+                                   (monotonic_seconds() - locked >= slice))) {
+                resume = yaslcpylen(resume, key.mv_data, key.mv_size);
+                break;
+            }
+
+            if (memcmp(key.mv_data, "set:", 4) == 0) {
+                if ((rc = lmdb_vdb_set_expire(cursor, &key, &data, expire,
+                             &examined, &removed)) != 0) {
+                    syslog(LOG_ALERT, "lmdb vdb_gc: %s", mdb_strerror(rc));
+                    break;
+                }
+            } else {
+                examined++;
+                if (data.mv_size == sizeof(last)) {
+                    memcpy(&last, data.mv_data, sizeof(last));
+                    if (last < expire) {
+                        if ((rc = mdb_cursor_del(cursor, 0)) != 0) {
+                            syslog(LOG_ALERT,
+                                    "lmdb vdb_gc mdb_cursor_del: %s",
+                                    mdb_strerror(rc));
+                            break;
+                        }
+                        removed++;
+                    }
+                }
+            }
+
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+
+        if (rc != 0) {
+            if (rc != MDB_NOTFOUND) {
+                syslog(LOG_ALERT, "lmdb vdb_gc mdb_cursor_get: %s",
+                        mdb_strerror(rc));
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+            done = true;
+        }
+
+        mdb_cursor_close(cursor);
+
+        if ((rc = mdb_txn_commit(txn)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_gc mdb_txn_commit: %s",
+                    mdb_strerror(rc));
+            retval = VAC_RESULT_TEMPFAIL;
+            done = true;
+        }
+
+        hold_time += monotonic_seconds() - locked;
+
+        /* Give any writers that queued up behind us a chance to run. */
+        sched_yield();
+    }
+
+    mdb_env_get_path(vdb->lmdb, &path);
+    syslog(LOG_INFO,
+            "lmdb vdb_gc %s: removed %ld of %ld entries in %ld transactions, "
+            "%.3fs waiting for the writer lock, %.3fs holding it",
+            path, removed, examined, batches, wait_time, hold_time);
+
+    yaslfree(resume);
+    return retval;
+}
+
+/* Each batch is read in its own short read transaction, so a long export
+ * doesn't pin old pages and bloat the database underneath live deliveries.
+ * The resume cursor is the shard number and the last key returned. A sender
+ * set block is returned whole, so a batch can run over its nominal size.
+ */
+vac_result
+lmdb_vdb_walk(VDB *vdb, const yastr resume, size_t batch, vdb_walk_cb cb,
+        void *ctx) {
+    int64_t    shards, shard = 0;
+    char *     p;
+    yastr      after = NULL;
+    VDB *      shard_vdb;
+    vac_result retval = VAC_RESULT_OK;
+
+    if (resume && ((p = strchr(resume, ':')) != NULL)) {
+        shard = strtoll(resume, NULL, 10);
+        if (*(p + 1) != '\0') {
+            after = yaslauto(p + 1);
+        }
+    }
+
+    if ((shards = lmdb_vdb_shards()) <= 1) {
+        retval = lmdb_vdb_walk_env(vdb, 0, after, batch, cb, ctx);
+        yaslfree(after);
+        return retval;
+    }
+
+    for (; (shard < shards) && (retval == VAC_RESULT_OK); shard++) {
+        if ((shard_vdb = lmdb_vdb_open(vdb->rcpt, shard)) == NULL) {
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+        retval = lmdb_vdb_walk_env(shard_vdb, shard, after, batch, cb, ctx);
+        lmdb_vdb_close(shard_vdb);
+        yaslfree(after);
+        after = NULL;
+    }
+
+    yaslfree(after);
+    return retval;
+}
+
+static vac_result
+lmdb_vdb_walk_env(VDB *vdb, int64_t shard, yastr after, size_t batch,
+        vdb_walk_cb cb, void *ctx) {
+    int               rc;
+    MDB_txn *         txn;
+    MDB_dbi           dbi;
+    MDB_cursor *      cursor;
+    MDB_val           key, data;
+    struct vdb_entry *entries;
+    size_t            n, alloc = batch;
+    const char *      k, *sep;
+    yastr             resume;
+    vac_result        retval = VAC_RESULT_OK;
+
+    if ((entries = calloc(alloc, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ALERT, "lmdb vdb_walk: calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+    after = after ? yasldup(after) : NULL;
+
+    do {
+        if ((rc = lmdb_vdb_txn_begin(vdb, MDB_RDONLY, &txn)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_walk mdb_txn_begin: %s",
+                    mdb_strerror(rc));
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        if (((rc = mdb_dbi_open(txn, NULL, 0, &dbi)) != 0) ||
+                ((rc = mdb_cursor_open(txn, dbi, &cursor)) != 0)) {
+            mdb_txn_abort(txn);
+            if (rc != MDB_NOTFOUND) {
+                syslog(LOG_ALERT, "lmdb vdb_walk: %s", mdb_strerror(rc));
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+            break;
+        }
+
+        if (after) {
+            key.mv_size = yasllen(after);
+            key.mv_data = after;
+            if (((rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE)) ==
+                        0) &&
+                    (key.mv_size == yasllen(after)) &&
+                    (memcmp(key.mv_data, after, key.mv_size) == 0)) {
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+            }
+        } else {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+        }
+
+        for (n = 0; (rc == 0) && (n < batch);
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+            yaslfree(after);
+            after = yaslnew(key.mv_data, key.mv_size);
+
+            k = key.mv_data;
+            if ((key.mv_size > 4) && (memcmp(k, "set:", 4) == 0)) {
+                if ((retval = lmdb_vdb_set_entries(
+                             &key, &data, &entries, &alloc, &n)) !=
+                        VAC_RESULT_OK) {
+                    break;
+                }
+                continue;
+            }
+
+            if ((key.mv_size < 5) || (memcmp(k, "user:", 5) != 0) ||
+                    (data.mv_size != sizeof(time_t)) ||
+                    ((sep = memrchr(k, ':', key.mv_size)) == k + 4)) {
+                continue;
+            }
+
+            entries[ n ].rcpt = yaslnew(k + 5, sep - (k + 5));
+            entries[ n ].fp = yaslnew(sep + 1, key.mv_size - (sep + 1 - k));
+            memcpy(&entries[ n ].ts, data.mv_data, sizeof(time_t));
+            entries[ n ].expires = 0;
+            n++;
+        }
+
+        mdb_cursor_close(cursor);
         mdb_txn_abort(txn);
-        return;
+
+        if ((rc != 0) && (rc != MDB_NOTFOUND)) {
+            syslog(LOG_ALERT, "lmdb vdb_walk mdb_cursor_get: %s",
+                    mdb_strerror(rc));
+            retval = VAC_RESULT_TEMPFAIL;
+        } else if ((retval == VAC_RESULT_OK) && (n > 0)) {
+            resume = yaslcatprintf(
+                    yaslempty(), "%lld:%s", (long long)shard, after);
+            retval = cb(entries, n, resume, ctx);
+            yaslfree(resume);
+        }
+
+        for (; n > 0; n--) {
+            yaslfree(entries[ n - 1 ].rcpt);
+            yaslfree(entries[ n - 1 ].fp);
+        }
+    } while ((rc == 0) && (retval == VAC_RESULT_OK));
+
+    yaslfree(after);
+    free(entries);
+    return retval;
+}
+
+ucl_object_t *
+lmdb_vdb_stats(VDB *vdb) {
+    int64_t       shards, shard;
+    VDB *         shard_vdb;
+    ucl_object_t *stats;
+    yastr         name;
+
+    if ((shards = lmdb_vdb_shards()) <= 1) {
+        return lmdb_vdb_stats_env(vdb);
     }
 
-    if ((rc = mdb_cursor_open(txn, dbi, &cursor)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_gc mdb_cursor_open: %s", mdb_strerror(rc));
+    stats = ucl_object_typed_new(UCL_OBJECT);
+    for (shard = 0; shard < shards; shard++) {
+        if ((shard_vdb = lmdb_vdb_open(vdb->rcpt, shard)) == NULL) {
+            continue;
+        }
+        name = yaslcatprintf(yaslempty(), "shard%03lld", (long long)shard);
+        ucl_object_insert_key(
+                stats, lmdb_vdb_stats_env(shard_vdb), name, 0, true);
+        yaslfree(name);
+        lmdb_vdb_close(shard_vdb);
+    }
+
+    return stats;
+}
+
+static ucl_object_t *
+lmdb_vdb_stats_env(VDB *vdb) {
+    int           rc;
+    MDB_stat      st;
+    MDB_envinfo   info;
+    MDB_txn *     txn;
+    MDB_cursor *  cursor;
+    MDB_val       key, data;
+    MDB_cursor_op op;
+    size_t        pages, free_pages = 0, freelist_entries = 0;
+    const char *  path;
+    yastr         file;
+    struct stat   sb;
+    ucl_object_t *stats;
+
+    stats = ucl_object_typed_new(UCL_OBJECT);
+
+    if (((rc = mdb_env_stat(vdb->lmdb, &st)) != 0) ||
+            ((rc = mdb_env_info(vdb->lmdb, &info)) != 0)) {
+        syslog(LOG_ALERT, "lmdb vdb_stats: %s", mdb_strerror(rc));
+        return stats;
+    }
+
+    ucl_object_insert_key(stats,
+            ucl_object_fromstring(lmdb_vdb_sets_layout() ? "sets" : "keys"),
+            "layout", 0, false);
+    ucl_object_insert_key(
+            stats, ucl_object_fromint(st.ms_entries), "entries", 0, false);
+    ucl_object_insert_key(
+            stats, ucl_object_fromint(st.ms_psize), "page_size", 0, false);
+    ucl_object_insert_key(
+            stats, ucl_object_fromint(st.ms_depth), "depth", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(st.ms_branch_pages),
+            "branch_pages", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(st.ms_leaf_pages),
+            "leaf_pages", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(st.ms_overflow_pages),
+            "overflow_pages", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(info.me_mapsize),
+            "map_size", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(info.me_last_pgno + 1),
+            "used_pages", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(info.me_last_txnid),
+            "last_txnid", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(info.me_numreaders),
+            "readers", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(info.me_maxreaders),
+            "max_readers", 0, false);
+
+    /* The freelist is database 0. Each record holds a list of page numbers
+     * freed by one transaction, prefixed by its length.
+     */
+    if ((rc = lmdb_vdb_txn_begin(vdb, MDB_RDONLY, &txn)) == 0) {
+        if ((rc = mdb_cursor_open(txn, 0, &cursor)) == 0) {
+            for (op = MDB_FIRST;
+                    (rc = mdb_cursor_get(cursor, &key, &data, op)) == 0;
+                    op = MDB_NEXT) {
+                if (data.mv_size >= sizeof(size_t)) {
+                    memcpy(&pages, data.mv_data, sizeof(size_t));
+                    free_pages += pages;
+                }
+                freelist_entries++;
+            }
+            mdb_cursor_close(cursor);
+        }
         mdb_txn_abort(txn);
-        return;
     }
+    if ((rc != 0) && (rc != MDB_NOTFOUND)) {
+        syslog(LOG_ERR, "lmdb vdb_stats freelist: %s", mdb_strerror(rc));
+    }
+
+    ucl_object_insert_key(stats, ucl_object_fromint(free_pages),
+            "free_pages", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(freelist_entries),
+            "freelist_entries", 0, false);
+
+    if (mdb_env_get_path(vdb->lmdb, &path) == 0) {
+        file = yaslcatprintf(yaslempty(), "%s/data.mdb", path);
+        if (stat(file, &sb) == 0) {
+            ucl_object_insert_key(stats, ucl_object_fromint(sb.st_size),
+                    "file_bytes", 0, false);
+            ucl_object_insert_key(stats,
+                    ucl_object_fromint((int64_t)sb.st_blocks * 512),
+                    "disk_bytes", 0, false);
+        }
+        yaslfree(file);
+    }
+
+    return stats;
+}
+
+vac_result
+lmdb_vdb_load(VDB *vdb, const struct vdb_entry *entries, size_t n) {
+    int64_t    shards, shard;
+    VDB *      shard_vdb;
+    vac_result retval = VAC_RESULT_OK;
+
+    if ((shards = lmdb_vdb_shards()) <= 1) {
+        return lmdb_vdb_load_env(vdb, -1, entries, n);
+    }
+
+    for (shard = 0; (shard < shards) && (retval == VAC_RESULT_OK); shard++) {
+        if ((shard_vdb = lmdb_vdb_open(vdb->rcpt, shard)) == NULL) {
+            return VAC_RESULT_TEMPFAIL;
+        }
+        retval = lmdb_vdb_load_env(shard_vdb, shard, entries, n);
+        lmdb_vdb_close(shard_vdb);
+    }
+
+    return retval;
+}
+
+/* The whole batch goes in one write transaction. An entry only replaces one
+ * that is older, so reloading a batch after an interrupted run is harmless.
+ */
+static vac_result
+lmdb_vdb_load_env(
+        VDB *vdb, int64_t shard, const struct vdb_entry *entries, size_t n) {
+    int        rc;
+    size_t     i;
+    MDB_txn *  txn;
+    MDB_dbi    dbi;
+    vac_result retval = VAC_RESULT_TEMPFAIL;
+
+    for (;;) {
+        if ((rc = lmdb_vdb_txn_begin(vdb, 0, &txn)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_load mdb_txn_begin: %s",
+                    mdb_strerror(rc));
+            break;
+        }
 
-    while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
-        if ((strncmp(key.mv_data, "user:", 5) == 0) &&
-                data.mv_size == sizeof(expire) &&
-                (time_t)data.mv_data < expire) {
-            if ((rc = mdb_del(txn, dbi, &key, NULL)) != 0) {
-                syslog(LOG_ALERT, "lmdb vdb_gc mdb_del: %s", mdb_strerror(rc));
+        if ((rc = mdb_dbi_open(txn, NULL, MDB_CREATE, &dbi)) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_load mdb_dbi_open: %s",
+                    mdb_strerror(rc));
+            mdb_txn_abort(txn);
+            break;
+        }
+
+        for (i = 0, rc = 0; (i < n) && (rc == 0); i++) {
+            if ((shard >= 0) &&
+                    (rabin_fingerprint(entries[ i ].rcpt,
+                             yasllen(entries[ i ].rcpt)) %
+                                    lmdb_vdb_shards() !=
+                            shard)) {
+                continue;
             }
+
+            rc = lmdb_vdb_put_ts(vdb, txn, dbi, entries[ i ].rcpt,
+                    entries[ i ].fp, entries[ i ].ts, true);
+        }
+
+        if (rc != 0) {
+            mdb_txn_abort(txn);
+        } else {
+            rc = mdb_txn_commit(txn);
+        }
+
+        if (rc == 0) {
+            retval = VAC_RESULT_OK;
+            break;
+        }
+
+        if ((rc != MDB_MAP_FULL) || (lmdb_vdb_grow(vdb) != 0)) {
+            syslog(LOG_ALERT, "lmdb vdb_load: %s", mdb_strerror(rc));
+            break;
         }
     }
-    if (rc != MDB_NOTFOUND) {
-        syslog(LOG_ALERT, "lmdb vdb_gc mdb_cursor_get: %s", mdb_strerror(rc));
+
+    return retval;
+}
+
+/* Compaction replaces the files underneath the environment, which is only
+ * safe when nothing else has it open, so it's done offline: it needs the
+ * exclusive open lock, and gives up if any other process holds the shared
+ * one. Deliveries that arrive meanwhile wait for it to finish. The caller's
+ * handle is reopened on the compacted files afterwards.
+ */
+vac_result
+lmdb_vdb_compact(VDB *vdb) {
+    VDB *      reopened;
+    vac_result retval;
+
+    if (lmdb_vdb_shards() <= 1) {
+        retval = lmdb_vdb_compact_env(vdb);
+    } else {
+        /* The shards are compacted by children with their own handles, which
+         * our shared lock would keep out.
+         */
+        lmdb_vdb_release(vdb);
+        retval = lmdb_vdb_each_shard(vdb, lmdb_vdb_compact_env);
     }
 
-    if ((rc = mdb_txn_commit(txn)) != 0) {
-        syslog(LOG_ALERT, "lmdb vdb_gc mdb_txn_commit: %s", mdb_strerror(rc));
+    lmdb_vdb_release(vdb);
+    if ((reopened = lmdb_vdb_init(vdb->rcpt)) == NULL) {
+        return VAC_RESULT_TEMPFAIL;
     }
+    vdb->lmdb = reopened->lmdb;
+    reopened->lmdb = NULL;
+    lmdb_vdb_close(reopened);
+
+    return retval;
 }
 
-yastr
-lmdb_vdb_key(const yastr rcpt, const yastr from) {
+static vac_result
+lmdb_vdb_compact_env(VDB *vdb) {
+    int         rc, fd = -1;
+    bool        created = false;
+    const char *dir;
+    yastr       data_path = NULL, lock_path = NULL, tmp_path = NULL;
+    struct stat st_before, st_after;
+    vac_result  retval = VAC_RESULT_TEMPFAIL;
+
+    if ((rc = mdb_env_get_path(vdb->lmdb, &dir)) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact mdb_env_get_path: %s",
+                mdb_strerror(rc));
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    /* Converting our shared lock only succeeds if no one else holds one.
+     * The conversion isn't atomic, and a failed one can leave us with no
+     * lock at all, so the shared lock is taken again before carrying on
+     * with the environment open.
+     */
+    if (flock(lmdb_vdb_lock_fd(vdb), LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK) {
+            syslog(LOG_NOTICE,
+                    "lmdb vdb_compact: %s is open in another process, "
+                    "not compacting",
+                    dir);
+        } else {
+            syslog(LOG_ALERT, "lmdb vdb_compact flock: %m");
+        }
+        if (flock(lmdb_vdb_lock_fd(vdb), LOCK_SH) != 0) {
+            syslog(LOG_ALERT, "lmdb vdb_compact flock: %m");
+        }
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    data_path = yaslcatprintf(yaslempty(), "%s/data.mdb", dir);
+    lock_path = yaslcatprintf(yaslempty(), "%s/lock.mdb", dir);
+    tmp_path = yaslcatprintf(yaslempty(), "%s/data.mdb.compact", dir);
+
+    if (stat(data_path, &st_before) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact stat %s: %m", data_path);
+        goto cleanup;
+    }
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0664)) < 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact open %s: %m", tmp_path);
+        goto cleanup;
+    }
+    created = true;
+
+    if ((rc = mdb_env_copyfd2(vdb->lmdb, fd, MDB_CP_COMPACT)) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact mdb_env_copyfd2: %s",
+                mdb_strerror(rc));
+        goto cleanup;
+    }
+
+    if (fsync(fd) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact fsync %s: %m", tmp_path);
+        goto cleanup;
+    }
+
+    if (close(fd) != 0) {
+        fd = -1;
+        syslog(LOG_ALERT, "lmdb vdb_compact close %s: %m", tmp_path);
+        goto cleanup;
+    }
+    fd = -1;
+
+    if (rename(tmp_path, data_path) != 0) {
+        syslog(LOG_ALERT, "lmdb vdb_compact rename %s: %m", tmp_path);
+        goto cleanup;
+    }
+
+    /* The old lock file describes the old data file. No one else has it
+     * open, and the next process to open the environment will create a new
+     * one.
+     */
+    if ((unlink(lock_path) != 0) && (errno != ENOENT)) {
+        syslog(LOG_ALERT, "lmdb vdb_compact unlink %s: %m", lock_path);
+    }
+
+    if ((fd = open(dir, O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+        fd = -1;
+    }
+
+    if (stat(data_path, &st_after) == 0) {
+        syslog(LOG_INFO, "lmdb vdb_compact: compacted %s from %lld to %lld",
+                data_path, (long long)st_before.st_size,
+                (long long)st_after.st_size);
+    }
+
+    retval = VAC_RESULT_OK;
+
+cleanup:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (created && (retval != VAC_RESULT_OK)) {
+        unlink(tmp_path);
+    }
+    yaslfree(data_path);
+    yaslfree(lock_path);
+    yaslfree(tmp_path);
+    return retval;
+}
+
+static yastr
+lmdb_vdb_fp_key(const char *rcpt, const char *fp) {
     yastr ret = yaslauto("user:");
-    ret = yaslcatprintf(
-            ret, "%s:%lx", rcpt, (long)rabin_fingerprint(from, yasllen(from)));
+    ret = yaslcatprintf(ret, "%s:%s", rcpt, fp);
     /* MDB_MAXKEYSIZE. 511 is the (old?) default and should be safe. */
     yaslrange(ret, 0, 511);
 
-    syslog(LOG_DEBUG, "lmdb_vdb_key: %s", ret);
-
     return ret;
 }
+
+static bool
+lmdb_vdb_sets_layout(void) {
+    const char *layout;
+
+    layout = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "lmdb.layout"));
+    return layout && (strcasecmp(layout, "sets") == 0);
+}
+
+/* Reads the time a reply was last sent to a sender fingerprint. */
+static int
+lmdb_vdb_get_ts(MDB_txn *txn, MDB_dbi dbi, const char *rcpt, const char *fp,
+        time_t *ts) {
+    int     rc;
+    MDB_val key, data;
+    yastr   keyval;
+
+    if (lmdb_vdb_sets_layout()) {
+        return lmdb_vdb_set_get(txn, dbi, rcpt, fp, ts);
+    }
+
+    keyval = lmdb_vdb_fp_key(rcpt, fp);
+    key.mv_size = yasllen(keyval);
+    key.mv_data = keyval;
+
+    if ((rc = mdb_get(txn, dbi, &key, &data)) == 0) {
+        if (data.mv_size == sizeof(*ts)) {
+            memcpy(ts, data.mv_data, sizeof(*ts));
+        } else {
+            syslog(LOG_ALERT, "lmdb vdb_get_ts: retrieved bad data");
+            rc = MDB_NOTFOUND;
+        }
+    }
+
+    yaslfree(keyval);
+    return rc;
+}
+
+/* Records the time a reply was sent to a sender fingerprint. With
+ * keep_newer, a newer time that is already recorded is left alone.
+ */
+static int
+lmdb_vdb_put_ts(VDB *vdb, MDB_txn *txn, MDB_dbi dbi, const char *rcpt,
+        const char *fp, time_t ts, bool keep_newer) {
+    int     rc;
+    time_t  existing;
+    MDB_val key, data;
+    yastr   keyval;
+
+    if (lmdb_vdb_sets_layout()) {
+        return lmdb_vdb_set_store(vdb, txn, dbi, rcpt, fp, ts, keep_newer);
+    }
+
+    keyval = lmdb_vdb_fp_key(rcpt, fp);
+    key.mv_size = yasllen(keyval);
+    key.mv_data = keyval;
+
+    if (keep_newer) {
+        if ((rc = mdb_get(txn, dbi, &key, &data)) == 0) {
+            if (data.mv_size == sizeof(existing)) {
+                memcpy(&existing, data.mv_data, sizeof(existing));
+                if (existing >= ts) {
+                    yaslfree(keyval);
+                    return 0;
+                }
+            }
+        } else if (rc != MDB_NOTFOUND) {
+            yaslfree(keyval);
+            return rc;
+        }
+    }
+
+    data.mv_size = sizeof(ts);
+    data.mv_data = &ts;
+    rc = mdb_put(txn, dbi, &key, &data, 0);
+
+    yaslfree(keyval);
+    return rc;
+}
+
+/* In the sets layout each recipient's senders are split into blocks by
+ * fingerprint range, with a separate run of blocks for each fingerprint
+ * format. A block is keyed by the upper bound of its range, so the first key
+ * at or after a fingerprint is the only block that can hold it, and finding
+ * it takes a single cursor positioning.
+ */
+static yastr
+lmdb_vdb_set_key(const char *rcpt, bool wide, uint64_t bound) {
+    return yaslcatprintf(yaslauto("set:"), "%s:%s:%016llx", rcpt,
+            wide ? "v2" : "v1", (unsigned long long)bound);
+}
+
+/* Whether a key is another block of the same recipient and format. */
+static bool
+lmdb_vdb_set_match(const MDB_val *key, const yastr keyval) {
+    return (key->mv_size == yasllen(keyval)) &&
+           (memcmp(key->mv_data, keyval, yasllen(keyval) - 16) == 0);
+}
+
+static int
+lmdb_vdb_set_get(MDB_txn *txn, MDB_dbi dbi, const char *rcpt, const char *fp,
+        time_t *ts) {
+    int         rc;
+    uint64_t    hi, lo;
+    bool        wide;
+    MDB_cursor *cursor;
+    MDB_val     key, data;
+    yastr       keyval;
+
+    if (!senderset_parse_fp(fp, &hi, &lo, &wide)) {
+        return MDB_NOTFOUND;
+    }
+
+    if ((rc = mdb_cursor_open(txn, dbi, &cursor)) != 0) {
+        return rc;
+    }
+
+    keyval = lmdb_vdb_set_key(rcpt, wide, hi);
+    key.mv_size = yasllen(keyval);
+    key.mv_data = keyval;
+
+    if (((rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE)) == 0) &&
+            (!lmdb_vdb_set_match(&key, keyval) ||
+                    !senderset_lookup(
+                            data.mv_data, data.mv_size, hi, lo, ts))) {
+        rc = MDB_NOTFOUND;
+    }
+
+    mdb_cursor_close(cursor);
+    yaslfree(keyval);
+    return rc;
+}
+
+static int
+lmdb_vdb_set_store(VDB *vdb, MDB_txn *txn, MDB_dbi dbi, const char *rcpt,
+        const char *fp, time_t ts, bool keep_newer) {
+    int              rc;
+    uint64_t         hi, lo, bound;
+    bool             wide, changed;
+    MDB_cursor *     cursor;
+    MDB_val          key, data;
+    MDB_stat         st;
+    yastr            keyval;
+    size_t           limit;
+    struct senderset set;
+
+    if (!senderset_parse_fp(fp, &hi, &lo, &wide)) {
+        syslog(LOG_ERR, "lmdb vdb_set_store: skipping bad fingerprint %s", fp);
+        return 0;
+    }
+
+    if ((rc = mdb_cursor_open(txn, dbi, &cursor)) != 0) {
+        return rc;
+    }
+
+    memset(&set, 0, sizeof(set));
+    set.wide = wide;
+    bound = hi;
+
+    keyval = lmdb_vdb_set_key(rcpt, wide, hi);
+    key.mv_size = yasllen(keyval);
+    key.mv_data = keyval;
+
+    /* The block covering the fingerprint, or if it's beyond the last block
+     * the last block, which is extended to cover it.
+     */
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    if ((rc == 0) && lmdb_vdb_set_match(&key, keyval)) {
+        bound = strtoull((char *)key.mv_data + key.mv_size - 16, NULL, 16);
+    } else if ((rc == 0) || (rc == MDB_NOTFOUND)) {
+        rc = mdb_cursor_get(
+                cursor, &key, &data, (rc == 0) ? MDB_PREV : MDB_LAST);
+        if ((rc == 0) && !lmdb_vdb_set_match(&key, keyval)) {
+            rc = MDB_NOTFOUND;
+        }
+    }
+
+    if (rc == 0) {
+        if (senderset_decode(data.mv_data, data.mv_size, &set) !=
+                VAC_RESULT_OK) {
+            rc = MDB_CORRUPTED;
+            goto done;
+        }
+    } else if (rc == MDB_NOTFOUND) {
+        rc = 0;
+        key.mv_data = NULL;
+    } else {
+        goto done;
+    }
+
+    if ((senderset_update(&set, hi, lo, ts, keep_newer, &changed) !=
+                VAC_RESULT_OK) ||
+            !changed) {
+        goto done;
+    }
+
+    /* The block is rewritten, possibly as several, so the old one goes. */
+    if (key.mv_data && ((rc = mdb_cursor_del(cursor, 0)) != 0)) {
+        goto done;
+    }
+
+    /* LMDB moves a value too big for a node to overflow pages of its own,
+     * and a leaf page has to hold at least two nodes, so blocks are split
+     * before they outgrow half a page.
+     */
+    mdb_env_stat(vdb->lmdb, &st);
+    limit = senderset_block_max(st.ms_psize, yasllen(keyval));
+
+    rc = lmdb_vdb_set_put(txn, dbi, rcpt, &set, 0, set.n, bound, limit);
+
+done:
+    senderset_free(&set);
+    mdb_cursor_close(cursor);
+    yaslfree(keyval);
+    return rc;
+}
+
+/* Writes count members starting at start as blocks no bigger than limit,
+ * the last of them keyed by bound.
+ */
+static int
+lmdb_vdb_set_put(MDB_txn *txn, MDB_dbi dbi, const char *rcpt,
+        const struct senderset *set, size_t start, size_t count,
+        uint64_t bound, size_t limit) {
+    int     rc;
+    size_t  mid;
+    MDB_val key, data;
+    yastr   keyval;
+
+    if ((count > 1) && (senderset_encoded_len(set, start, count) > limit)) {
+        /* Members that share a block key have to share the block. */
+        for (mid = count / 2; (mid < count) &&
+                (set->members[ start + mid - 1 ].hi ==
+                        set->members[ start + mid ].hi);
+                mid++)
+            ;
+        if (mid < count) {
+            if ((rc = lmdb_vdb_set_put(txn, dbi, rcpt, set, start, mid,
+                         set->members[ start + mid - 1 ].hi, limit)) != 0) {
+                return rc;
+            }
+            return lmdb_vdb_set_put(txn, dbi, rcpt, set, start + mid,
+                    count - mid, bound, limit);
+        }
+    }
+
+    keyval = lmdb_vdb_set_key(rcpt, set->wide, bound);
+    key.mv_size = yasllen(keyval);
+    key.mv_data = keyval;
+    data.mv_size = senderset_encoded_len(set, start, count);
+    data.mv_data = NULL;
+
+    if ((rc = mdb_put(txn, dbi, &key, &data, MDB_RESERVE)) == 0) {
+        senderset_encode(set, start, count, data.mv_data);
+    }
+
+    yaslfree(keyval);
+    return rc;
+}
+
+/* Removes a block's expired members during garbage collection, and the
+ * block itself once it's empty. It keeps its key, which is still an upper
+ * bound for what's left.
+ */
+static int
+lmdb_vdb_set_expire(MDB_cursor *cursor, MDB_val *key, MDB_val *data,
+        time_t expire, long *examined, long *removed) {
+    int              rc = 0;
+    size_t           n;
+    MDB_val          k, d;
+    struct senderset set;
+
+    if (senderset_decode(data->mv_data, data->mv_size, &set) !=
+            VAC_RESULT_OK) {
+        return 0;
+    }
+
+    *examined += set.n;
+
+    if ((n = senderset_expire(&set, expire)) > 0) {
+        *removed += n;
+        if (set.n == 0) {
+            rc = mdb_cursor_del(cursor, 0);
+        } else {
+            /* Replacing the value can move the key, so it's copied first. */
+            k.mv_size = key->mv_size;
+            d.mv_size = senderset_encoded_len(&set, 0, set.n);
+            if (((k.mv_data = malloc(k.mv_size + d.mv_size)) == NULL)) {
+                senderset_free(&set);
+                return ENOMEM;
+            }
+            memcpy(k.mv_data, key->mv_data, k.mv_size);
+            d.mv_data = (char *)k.mv_data + k.mv_size;
+            senderset_encode(&set, 0, set.n, d.mv_data);
+            rc = mdb_cursor_put(cursor, &k, &d, MDB_CURRENT);
+            free(k.mv_data);
+        }
+    }
+
+    senderset_free(&set);
+    return rc;
+}
+
+/* Appends the members of a block to a walk batch. */
+static vac_result
+lmdb_vdb_set_entries(const MDB_val *key, const MDB_val *data,
+        struct vdb_entry **entries, size_t *alloc, size_t *n) {
+    struct senderset  set;
+    struct vdb_entry *grown;
+    vac_result        rc;
+    size_t            i;
+
+    /* "set:", the recipient, then ":v1:" or ":v2:" and the bound. */
+    if (key->mv_size <= 4 + 20) {
+        return VAC_RESULT_OK;
+    }
+
+    if ((rc = senderset_decode(data->mv_data, data->mv_size, &set)) !=
+            VAC_RESULT_OK) {
+        /* A bad block has been logged, and is skipped. */
+        return (rc == VAC_RESULT_PERMFAIL) ? VAC_RESULT_OK : rc;
+    }
+
+    if (*n + set.n > *alloc) {
+        if ((grown = realloc(*entries, (*n + set.n) * sizeof(**entries))) ==
+                NULL) {
+            syslog(LOG_ALERT, "lmdb vdb_walk: realloc: %m");
+            senderset_free(&set);
+            return VAC_RESULT_TEMPFAIL;
+        }
+        *entries = grown;
+        *alloc = *n + set.n;
+    }
+
+    for (i = 0; i < set.n; i++) {
+        (*entries)[ *n ].rcpt =
+                yaslnew((char *)key->mv_data + 4, key->mv_size - 4 - 20);
+        (*entries)[ *n ].fp = senderset_format_fp(set.members + i, set.wide);
+        (*entries)[ *n ].ts = set.members[ i ].ts;
+        (*entries)[ *n ].expires = 0;
+        (*n)++;
+    }
+
+    senderset_free(&set);
+    return VAC_RESULT_OK;
+}
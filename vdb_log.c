@@ -0,0 +1,425 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rabin.h"
+#include "simvacation.h"
+#include "vdb.h"
+
+/* Replies are appended as fixed-size records to segment files named after
+ * the log.segment_span period they were written in. A record is a single
+ * O_APPEND write, so concurrent deliveries never coordinate, and each one
+ * carries a checksum so a record torn by a crash is ignored rather than
+ * misread.
+ *
+ * simvacation handles a single message per process, so there is no
+ * long-lived index to keep; a lookup scans the segments that are young
+ * enough to hold a relevant reply, skipping the rest by mtime. simunvacation
+ * drops segments whose records have all expired and rewrites the others
+ * without their expired records.
+ */
+
+#define LOG_SUFFIX ".log"
+
+struct log_record {
+    uint64_t rcpt;
+    uint64_t from;
+    int64_t  ts;
+    uint32_t interval;
+    uint32_t check;
+};
+
+static uint32_t   log_vdb_check(const struct log_record *);
+static int        log_vdb_segment(const struct dirent *);
+static int        log_vdb_open_segment(VDB *, time_t);
+static vac_result log_vdb_compact_segment(VDB *, const char *, time_t);
+static int64_t    log_vdb_config(const char *);
+
+VDB *
+log_vdb_init(const yastr rcpt) {
+    VDB *       vdb;
+    const char *path;
+
+    if ((path = ucl_object_tostring(
+                 ucl_object_lookup_path(vac_config, "log.path"))) == NULL) {
+        syslog(LOG_ALERT, "log vdb_init: no path configured");
+        return NULL;
+    }
+
+    if ((mkdir(path, 0775) != 0) && (errno != EEXIST)) {
+        syslog(LOG_ALERT, "log vdb_init mkdir %s: %m", path);
+        return NULL;
+    }
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "log vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->log = calloc(1, sizeof(struct vdb_log))) == NULL) {
+        syslog(LOG_ALERT, "log vdb_init: calloc: %m");
+        free(vdb);
+        return NULL;
+    }
+
+    vdb->log->path = yaslauto(path);
+    vdb->log->rcpt_hash = rabin_fingerprint(rcpt, yasllen(rcpt));
+    vdb->rcpt = yaslauto(rcpt);
+
+    return vdb;
+}
+
+void
+log_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->log) {
+            yaslfree(vdb->log->path);
+            free(vdb->log);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+log_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    int                      fd, n, i;
+    size_t                   j, nrecords;
+    time_t                   now, last = 0;
+    uint64_t                 from_hash;
+    struct dirent **         segments = NULL;
+    struct stat              st;
+    const struct log_record *records;
+    yastr                    path;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "log vdb_recent time: %m");
+        return VDB_STATUS_OK;
+    }
+
+    if ((n = scandir(vdb->log->path, &segments, log_vdb_segment, NULL)) < 0) {
+        syslog(LOG_ALERT, "log vdb_recent scandir %s: %m", vdb->log->path);
+        return VDB_STATUS_OK;
+    }
+
+    from_hash = rabin_fingerprint(from, yasllen(from));
+    path = yaslempty();
+
+    for (i = 0; i < n; i++) {
+        yaslclear(path);
+        path = yaslcatprintf(
+                path, "%s/%s", vdb->log->path, segments[ i ]->d_name);
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+            if (errno != ENOENT) {
+                syslog(LOG_ERR, "log vdb_recent open %s: %m", path);
+            }
+            continue;
+        }
+
+        /* Nothing in a segment last written before the interval began can
+         * be relevant.
+         */
+        if ((fstat(fd, &st) != 0) || (st.st_mtime < now - interval) ||
+                (st.st_size < (off_t)sizeof(struct log_record))) {
+            close(fd);
+            continue;
+        }
+
+        nrecords = st.st_size / sizeof(struct log_record);
+        if ((records = mmap(NULL, nrecords * sizeof(struct log_record),
+                     PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            syslog(LOG_ERR, "log vdb_recent mmap %s: %m", path);
+            close(fd);
+            continue;
+        }
+        close(fd);
+
+        for (j = 0; j < nrecords; j++) {
+            if ((records[ j ].rcpt == vdb->log->rcpt_hash) &&
+                    (records[ j ].from == from_hash) &&
+                    (records[ j ].ts > last) &&
+                    (records[ j ].check == log_vdb_check(&records[ j ]))) {
+                last = records[ j ].ts;
+            }
+        }
+
+        munmap((void *)records, nrecords * sizeof(struct log_record));
+    }
+
+    for (i = 0; i < n; i++) {
+        free(segments[ i ]);
+    }
+    free(segments);
+    yaslfree(path);
+
+    if (now < (last + interval)) {
+        return VDB_STATUS_RECENT;
+    }
+    return VDB_STATUS_OK;
+}
+
+vac_result
+log_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    int               fd;
+    time_t            now;
+    off_t             end;
+    int64_t           sync_bytes;
+    struct log_record record;
+    vac_result        retval = VAC_RESULT_OK;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "log vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.rcpt = vdb->log->rcpt_hash;
+    record.from = rabin_fingerprint(from, yasllen(from));
+    record.ts = now;
+    record.interval = MIN(MAX(interval, 1), UINT32_MAX);
+    record.check = log_vdb_check(&record);
+
+    if ((fd = log_vdb_open_segment(vdb, now)) < 0) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (write(fd, &record, sizeof(record)) != sizeof(record)) {
+        syslog(LOG_ALERT, "log vdb_store_reply write: %m");
+        retval = VAC_RESULT_TEMPFAIL;
+        goto cleanup;
+    }
+
+    /* Only the writer whose record crosses a log.sync_bytes boundary pays
+     * for the fsync, which also covers everyone else's records before it.
+     */
+    sync_bytes = log_vdb_config("log.sync_bytes");
+    end = lseek(fd, 0, SEEK_CUR);
+    if ((sync_bytes <= 0) || (end < 0) ||
+            ((end / sync_bytes) !=
+                    ((end - (off_t)sizeof(record)) / sync_bytes))) {
+        if (fdatasync(fd) != 0) {
+            syslog(LOG_ALERT, "log vdb_store_reply fdatasync: %m");
+            retval = VAC_RESULT_TEMPFAIL;
+        }
+    }
+
+cleanup:
+    close(fd);
+    return retval;
+}
+
+/* Expired records are dropped by simunvacation. Segments that may still be
+ * appended to are left alone.
+ */
+void
+log_vdb_gc(VDB *vdb) {
+    int             n, i;
+    time_t          now;
+    struct dirent **segments = NULL;
+    yastr           path;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "log vdb_gc time: %m");
+        return;
+    }
+
+    if ((n = scandir(vdb->log->path, &segments, log_vdb_segment, NULL)) < 0) {
+        syslog(LOG_ALERT, "log vdb_gc scandir %s: %m", vdb->log->path);
+        return;
+    }
+
+    path = yaslempty();
+    for (i = 0; i < n; i++) {
+        yaslclear(path);
+        path = yaslcatprintf(
+                path, "%s/%s", vdb->log->path, segments[ i ]->d_name);
+        log_vdb_compact_segment(vdb, path, now);
+        free(segments[ i ]);
+    }
+    free(segments);
+    yaslfree(path);
+}
+
+static vac_result
+log_vdb_compact_segment(VDB *vdb, const char *path, time_t now) {
+    int                fd, out = -1;
+    size_t             i, nrecords, live = 0;
+    struct stat        st;
+    struct log_record *records = MAP_FAILED;
+    yastr              tmp = NULL;
+    vac_result         retval = VAC_RESULT_TEMPFAIL;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        syslog(LOG_ERR, "log vdb_gc open %s: %m", path);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        syslog(LOG_ERR, "log vdb_gc fstat %s: %m", path);
+        goto cleanup;
+    }
+
+    if (st.st_mtime > now - log_vdb_config("log.segment_span")) {
+        retval = VAC_RESULT_OK;
+        goto cleanup;
+    }
+
+    nrecords = st.st_size / sizeof(struct log_record);
+    if ((nrecords > 0) &&
+            ((records = mmap(NULL, nrecords * sizeof(struct log_record),
+                      PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+        syslog(LOG_ERR, "log vdb_gc mmap %s: %m", path);
+        goto cleanup;
+    }
+
+    for (i = 0; i < nrecords; i++) {
+        if ((records[ i ].check == log_vdb_check(&records[ i ])) &&
+                (records[ i ].ts + records[ i ].interval > now)) {
+            live++;
+        }
+    }
+
+    if (live == 0) {
+        if (unlink(path) != 0) {
+            syslog(LOG_ERR, "log vdb_gc unlink %s: %m", path);
+            goto cleanup;
+        }
+        syslog(LOG_INFO, "log vdb_gc: removed %s", path);
+        retval = VAC_RESULT_OK;
+        goto cleanup;
+    }
+
+    if (live == nrecords) {
+        retval = VAC_RESULT_OK;
+        goto cleanup;
+    }
+
+    tmp = yaslcatprintf(yaslauto(path), ".compact");
+    if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0664)) < 0) {
+        syslog(LOG_ERR, "log vdb_gc open %s: %m", tmp);
+        goto cleanup;
+    }
+
+    for (i = 0; i < nrecords; i++) {
+        if ((records[ i ].check == log_vdb_check(&records[ i ])) &&
+                (records[ i ].ts + records[ i ].interval > now) &&
+                (write(out, &records[ i ], sizeof(struct log_record)) !=
+                        sizeof(struct log_record))) {
+            syslog(LOG_ERR, "log vdb_gc write %s: %m", tmp);
+            goto cleanup;
+        }
+    }
+
+    if (fsync(out) != 0) {
+        syslog(LOG_ERR, "log vdb_gc fsync %s: %m", tmp);
+        goto cleanup;
+    }
+
+    /* Lookups that already have the old segment mapped keep reading it. */
+    if (rename(tmp, path) != 0) {
+        syslog(LOG_ERR, "log vdb_gc rename %s: %m", tmp);
+        goto cleanup;
+    }
+
+    syslog(LOG_INFO, "log vdb_gc: compacted %s from %zu to %zu records", path,
+            nrecords, live);
+    retval = VAC_RESULT_OK;
+
+cleanup:
+    if (out >= 0) {
+        close(out);
+        if (retval != VAC_RESULT_OK) {
+            unlink(tmp);
+        }
+    }
+    if (records != MAP_FAILED) {
+        munmap(records, nrecords * sizeof(struct log_record));
+    }
+    yaslfree(tmp);
+    close(fd);
+    return retval;
+}
+
+/* Open the segment for the current period. If a crash left it with a partial
+ * record at the end, appending to it would misalign everything after, so
+ * this process starts a segment of its own instead.
+ */
+static int
+log_vdb_open_segment(VDB *vdb, time_t now) {
+    int         fd, dfd;
+    int64_t     span;
+    struct stat st;
+    yastr       path;
+
+    if ((span = log_vdb_config("log.segment_span")) < 1) {
+        span = 1;
+    }
+
+    path = yaslcatprintf(yaslempty(), "%s/%lld" LOG_SUFFIX, vdb->log->path,
+            (long long)(now / span));
+
+    if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0664)) >= 0) {
+        /* Make sure the new segment's directory entry survives a crash. */
+        if ((dfd = open(vdb->log->path, O_RDONLY)) >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    } else if ((errno != EEXIST) ||
+               ((fd = open(path, O_WRONLY | O_APPEND)) < 0)) {
+        syslog(LOG_ALERT, "log vdb_store_reply open %s: %m", path);
+        goto done;
+    }
+
+    if ((fstat(fd, &st) == 0) && (st.st_size % sizeof(struct log_record))) {
+        syslog(LOG_NOTICE, "log vdb_store_reply: %s has a torn record", path);
+        close(fd);
+        yaslclear(path);
+        path = yaslcatprintf(path, "%s/%lld.%d" LOG_SUFFIX, vdb->log->path,
+                (long long)(now / span), (int)getpid());
+        if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0664)) < 0) {
+            syslog(LOG_ALERT, "log vdb_store_reply open %s: %m", path);
+        }
+    }
+
+done:
+    yaslfree(path);
+    return fd;
+}
+
+static int
+log_vdb_segment(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+
+    return (len > strlen(LOG_SUFFIX)) &&
+           (strcmp(entry->d_name + len - strlen(LOG_SUFFIX), LOG_SUFFIX) == 0);
+}
+
+static uint32_t
+log_vdb_check(const struct log_record *record) {
+    /* Never zero, so that a zero-filled hole doesn't pass. */
+    return (uint32_t)vdb_mix(record->rcpt ^ vdb_mix(record->from) ^
+                             vdb_mix(record->ts) ^ record->interval) |
+           1;
+}
+
+static int64_t
+log_vdb_config(const char *key) {
+    return ucl_object_toint(ucl_object_lookup_path(vac_config, key));
+}
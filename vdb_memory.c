@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rabin.h"
+#include "simvacation.h"
+#include "vdb.h"
+
+/* Replies are kept in a hash table shared by every handle in the process,
+ * and expired through a hierarchical timing wheel: MEMORY_WHEEL_LEVELS
+ * wheels of MEMORY_WHEEL_SLOTS one second (then 64s, 4096s, ...) slots.
+ * Entries sit in the coarsest wheel that can hold their expiry and are moved
+ * down a level each time the finer wheel wraps, so expiring an entry costs a
+ * constant amount of work however long it lives.
+ *
+ * This is only useful to a long-lived process, unless memory.snapshot is
+ * set, in which case the table is loaded from disk on first use and written
+ * back every memory.snapshot_interval. Snapshots are for warming up after a
+ * restart, not for sharing state: concurrent processes overwrite each
+ * other's.
+ */
+
+#define MEMORY_WHEEL_BITS 6
+#define MEMORY_WHEEL_SLOTS (1 << MEMORY_WHEEL_BITS)
+#define MEMORY_WHEEL_MASK (MEMORY_WHEEL_SLOTS - 1)
+#define MEMORY_WHEEL_LEVELS 4
+#define MEMORY_SNAPSHOT_MAGIC 0x73696d766d656d01ULL /* "simvmem" v1 */
+
+struct memory_entry {
+    uint64_t             rcpt;
+    uint64_t             from;
+    time_t               ts;
+    time_t               expires;
+    struct memory_entry *next;
+    struct memory_entry *wheel_next;
+    struct memory_entry *wheel_prev;
+};
+
+struct memory_record {
+    uint64_t rcpt;
+    uint64_t from;
+    int64_t  ts;
+    int64_t  expires;
+};
+
+static struct {
+    bool                  loaded;
+    struct memory_entry **buckets;
+    size_t                nbuckets;
+    size_t                count;
+    time_t                tick;
+    struct memory_entry   wheel[ MEMORY_WHEEL_LEVELS ][ MEMORY_WHEEL_SLOTS ];
+    time_t                snapshot_time;
+    bool                  dirty;
+} memory_table;
+
+static vac_result memory_vdb_table_init(time_t);
+static struct memory_entry **memory_vdb_find(uint64_t, uint64_t);
+static vac_result memory_vdb_insert(uint64_t, uint64_t, time_t, time_t);
+static void       memory_vdb_remove(struct memory_entry *);
+static vac_result memory_vdb_grow(void);
+static void       memory_vdb_wheel_add(struct memory_entry *);
+static void       memory_vdb_wheel_unlink(struct memory_entry *);
+static void       memory_vdb_wheel_advance(time_t);
+static void       memory_vdb_wheel_cascade(int, int);
+static void       memory_vdb_snapshot_load(const char *, time_t);
+static void       memory_vdb_snapshot_save(time_t, bool);
+
+VDB *
+memory_vdb_init(const yastr rcpt) {
+    VDB *  vdb;
+    time_t now;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "memory vdb_init time: %m");
+        return NULL;
+    }
+
+    if (!memory_table.loaded && (memory_vdb_table_init(now) != VAC_RESULT_OK)) {
+        return NULL;
+    }
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "memory vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->memory = calloc(1, sizeof(struct vdb_memory))) == NULL) {
+        syslog(LOG_ALERT, "memory vdb_init: calloc: %m");
+        free(vdb);
+        return NULL;
+    }
+
+    vdb->memory->rcpt_hash = rabin_fingerprint(rcpt, yasllen(rcpt));
+    vdb->rcpt = yaslauto(rcpt);
+
+    return vdb;
+}
+
+void
+memory_vdb_close(VDB *vdb) {
+    time_t now;
+
+    if (vdb) {
+        /* Short-lived processes get their only chance to save here. */
+        if ((now = time(NULL)) >= 0) {
+            memory_vdb_snapshot_save(now, false);
+        }
+        free(vdb->memory);
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+memory_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    time_t               now;
+    struct memory_entry *entry;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "memory vdb_recent time: %m");
+        return VDB_STATUS_OK;
+    }
+
+    memory_vdb_wheel_advance(now);
+
+    if (((entry = *memory_vdb_find(vdb->memory->rcpt_hash,
+                  rabin_fingerprint(from, yasllen(from)))) != NULL) &&
+            (now < entry->ts + interval)) {
+        return VDB_STATUS_RECENT;
+    }
+
+    return VDB_STATUS_OK;
+}
+
+vac_result
+memory_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    time_t     now;
+    vac_result retval;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "memory vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    memory_vdb_wheel_advance(now);
+
+    retval = memory_vdb_insert(vdb->memory->rcpt_hash,
+            rabin_fingerprint(from, yasllen(from)), now,
+            now + MAX(interval, 1));
+
+    if (retval == VAC_RESULT_OK) {
+        memory_table.dirty = true;
+        memory_vdb_snapshot_save(now, false);
+    }
+
+    return retval;
+}
+
+void
+memory_vdb_gc(VDB *vdb) {
+    time_t now;
+
+    /* Expiry happens as the wheel turns; this just brings it up to date. */
+    if ((now = time(NULL)) >= 0) {
+        memory_vdb_wheel_advance(now);
+        memory_vdb_snapshot_save(now, true);
+    }
+}
+
+static vac_result
+memory_vdb_table_init(time_t now) {
+    const char *snapshot;
+    int         level, slot;
+
+    memory_table.nbuckets = 1024;
+    if ((memory_table.buckets = calloc(memory_table.nbuckets,
+                 sizeof(struct memory_entry *))) == NULL) {
+        syslog(LOG_ALERT, "memory vdb_init: calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    for (level = 0; level < MEMORY_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < MEMORY_WHEEL_SLOTS; slot++) {
+            memory_table.wheel[ level ][ slot ].wheel_next =
+                    &memory_table.wheel[ level ][ slot ];
+            memory_table.wheel[ level ][ slot ].wheel_prev =
+                    &memory_table.wheel[ level ][ slot ];
+        }
+    }
+
+    memory_table.tick = now;
+    memory_table.snapshot_time = now;
+    memory_table.loaded = true;
+
+    if (((snapshot = ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "memory.snapshot"))) != NULL) &&
+            (*snapshot != '\0')) {
+        memory_vdb_snapshot_load(snapshot, now);
+    }
+
+    return VAC_RESULT_OK;
+}
+
+static struct memory_entry **
+memory_vdb_find(uint64_t rcpt, uint64_t from) {
+    struct memory_entry **entry;
+
+    entry = &memory_table.buckets[ vdb_mix(rcpt ^ vdb_mix(from)) &
+                                   (memory_table.nbuckets - 1) ];
+    while (*entry && (((*entry)->rcpt != rcpt) || ((*entry)->from != from))) {
+        entry = &(*entry)->next;
+    }
+
+    return entry;
+}
+
+static vac_result
+memory_vdb_insert(uint64_t rcpt, uint64_t from, time_t ts, time_t expires) {
+    struct memory_entry **slot, *entry;
+
+    if ((entry = *(slot = memory_vdb_find(rcpt, from))) != NULL) {
+        memory_vdb_wheel_unlink(entry);
+    } else {
+        if ((memory_table.count >= memory_table.nbuckets) &&
+                (memory_vdb_grow() == VAC_RESULT_OK)) {
+            slot = memory_vdb_find(rcpt, from);
+        }
+        if ((entry = calloc(1, sizeof(struct memory_entry))) == NULL) {
+            syslog(LOG_ALERT, "memory vdb_store_reply: calloc: %m");
+            return VAC_RESULT_TEMPFAIL;
+        }
+        entry->rcpt = rcpt;
+        entry->from = from;
+        *slot = entry;
+        memory_table.count++;
+    }
+
+    entry->ts = ts;
+    entry->expires = expires;
+    memory_vdb_wheel_add(entry);
+
+    return VAC_RESULT_OK;
+}
+
+static void
+memory_vdb_remove(struct memory_entry *entry) {
+    struct memory_entry **slot;
+
+    memory_vdb_wheel_unlink(entry);
+    slot = memory_vdb_find(entry->rcpt, entry->from);
+    *slot = entry->next;
+    memory_table.count--;
+    free(entry);
+}
+
+static vac_result
+memory_vdb_grow(void) {
+    struct memory_entry **buckets, *entry, *next;
+    size_t                nbuckets, i, b;
+
+    nbuckets = memory_table.nbuckets * 2;
+    if ((buckets = calloc(nbuckets, sizeof(struct memory_entry *))) == NULL) {
+        /* Longer chains are slower, but still correct. */
+        syslog(LOG_ERR, "memory vdb_grow: calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    for (i = 0; i < memory_table.nbuckets; i++) {
+        for (entry = memory_table.buckets[ i ]; entry; entry = next) {
+            next = entry->next;
+            b = vdb_mix(entry->rcpt ^ vdb_mix(entry->from)) & (nbuckets - 1);
+            entry->next = buckets[ b ];
+            buckets[ b ] = entry;
+        }
+    }
+
+    free(memory_table.buckets);
+    memory_table.buckets = buckets;
+    memory_table.nbuckets = nbuckets;
+
+    return VAC_RESULT_OK;
+}
+
+static void
+memory_vdb_wheel_add(struct memory_entry *entry) {
+    struct memory_entry *head;
+    time_t               expires, delta;
+    int                  level, slot;
+
+    /* Entries are only ever filed from a cascade, which runs before the
+     * current tick's slot is processed, or with an expiry in the future.
+     */
+    expires = MAX(entry->expires, memory_table.tick);
+    delta = expires - memory_table.tick;
+
+    for (level = 0; level < MEMORY_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1LL << (MEMORY_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    if (delta < (1LL << (MEMORY_WHEEL_BITS * MEMORY_WHEEL_LEVELS))) {
+        slot = (expires >> (MEMORY_WHEEL_BITS * level)) & MEMORY_WHEEL_MASK;
+    } else {
+        /* Beyond the outermost wheel; wait in the slot that comes round
+         * last and be re-filed from there.
+         */
+        slot = ((memory_table.tick >> (MEMORY_WHEEL_BITS * level)) - 1) &
+               MEMORY_WHEEL_MASK;
+    }
+
+    head = &memory_table.wheel[ level ][ slot ];
+    entry->wheel_next = head;
+    entry->wheel_prev = head->wheel_prev;
+    head->wheel_prev->wheel_next = entry;
+    head->wheel_prev = entry;
+}
+
+static void
+memory_vdb_wheel_unlink(struct memory_entry *entry) {
+    entry->wheel_prev->wheel_next = entry->wheel_next;
+    entry->wheel_next->wheel_prev = entry->wheel_prev;
+    entry->wheel_next = entry->wheel_prev = entry;
+}
+
+static void
+memory_vdb_wheel_advance(time_t now) {
+    struct memory_entry *head, *entry;
+    int                  level, slot;
+
+    while (memory_table.tick < now) {
+        if (memory_table.count == 0) {
+            memory_table.tick = now;
+            break;
+        }
+
+        memory_table.tick++;
+
+        /* When a wheel wraps, pull the next slot of the wheel above down
+         * into the finer ones.
+         */
+        if ((memory_table.tick & MEMORY_WHEEL_MASK) == 0) {
+            for (level = 1; level < MEMORY_WHEEL_LEVELS; level++) {
+                slot = (memory_table.tick >> (MEMORY_WHEEL_BITS * level)) &
+                       MEMORY_WHEEL_MASK;
+                memory_vdb_wheel_cascade(level, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+
+        head = &memory_table
+                        .wheel[ 0 ][ memory_table.tick & MEMORY_WHEEL_MASK ];
+        while ((entry = head->wheel_next) != head) {
+            memory_vdb_remove(entry);
+            memory_table.dirty = true;
+        }
+    }
+}
+
+static void
+memory_vdb_wheel_cascade(int level, int slot) {
+    struct memory_entry pending, *head, *entry;
+
+    head = &memory_table.wheel[ level ][ slot ];
+    if (head->wheel_next == head) {
+        return;
+    }
+
+    /* Detach the whole list first, since entries may be re-filed into the
+     * same slot.
+     */
+    pending.wheel_next = head->wheel_next;
+    pending.wheel_prev = head->wheel_prev;
+    pending.wheel_next->wheel_prev = &pending;
+    pending.wheel_prev->wheel_next = &pending;
+    head->wheel_next = head->wheel_prev = head;
+
+    while ((entry = pending.wheel_next) != &pending) {
+        memory_vdb_wheel_unlink(entry);
+        memory_vdb_wheel_add(entry);
+    }
+}
+
+static void
+memory_vdb_snapshot_load(const char *path, time_t now) {
+    FILE *               f;
+    uint64_t             magic;
+    struct memory_record record;
+    size_t               loaded = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "memory vdb_init fopen %s: %m", path);
+        }
+        return;
+    }
+
+    if ((fread(&magic, sizeof(magic), 1, f) != 1) ||
+            (magic != MEMORY_SNAPSHOT_MAGIC)) {
+        syslog(LOG_ERR, "memory vdb_init: %s is not a snapshot", path);
+        fclose(f);
+        return;
+    }
+
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        if ((record.expires > now) &&
+                (memory_vdb_insert(record.rcpt, record.from, record.ts,
+                         record.expires) == VAC_RESULT_OK)) {
+            loaded++;
+        }
+    }
+
+    fclose(f);
+    syslog(LOG_DEBUG, "memory vdb_init: loaded %zu entries from %s", loaded,
+            path);
+}
+
+/* Written to a temporary file and renamed into place, so a crash leaves the
+ * previous snapshot intact.
+ */
+static void
+memory_vdb_snapshot_save(time_t now, bool force) {
+    const char *         path;
+    FILE *               f;
+    uint64_t             magic = MEMORY_SNAPSHOT_MAGIC;
+    struct memory_entry *entry;
+    struct memory_record record;
+    size_t               i;
+    yastr                tmp;
+
+    if (!memory_table.loaded || !memory_table.dirty) {
+        return;
+    }
+
+    if (((path = ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "memory.snapshot"))) == NULL) ||
+            (*path == '\0')) {
+        return;
+    }
+
+    if (!force && (now - memory_table.snapshot_time <
+                          ucl_object_toint(ucl_object_lookup_path(vac_config,
+                                  "memory.snapshot_interval")))) {
+        return;
+    }
+
+    tmp = yaslcatprintf(yaslempty(), "%s.%d", path, (int)getpid());
+    if ((f = fopen(tmp, "w")) == NULL) {
+        syslog(LOG_ERR, "memory vdb snapshot fopen %s: %m", tmp);
+        yaslfree(tmp);
+        return;
+    }
+
+    fwrite(&magic, sizeof(magic), 1, f);
+    for (i = 0; i < memory_table.nbuckets; i++) {
+        for (entry = memory_table.buckets[ i ]; entry; entry = entry->next) {
+            memset(&record, 0, sizeof(record));
+            record.rcpt = entry->rcpt;
+            record.from = entry->from;
+            record.ts = entry->ts;
+            record.expires = entry->expires;
+            fwrite(&record, sizeof(record), 1, f);
+        }
+    }
+
+    if ((fflush(f) != 0) || ferror(f) || (fsync(fileno(f)) != 0)) {
+        syslog(LOG_ERR, "memory vdb snapshot write %s: %m", tmp);
+        fclose(f);
+        unlink(tmp);
+    } else if (fclose(f) != 0) {
+        syslog(LOG_ERR, "memory vdb snapshot fclose %s: %m", tmp);
+        unlink(tmp);
+    } else if (rename(tmp, path) != 0) {
+        syslog(LOG_ERR, "memory vdb snapshot rename %s: %m", tmp);
+        unlink(tmp);
+    } else {
+        memory_table.snapshot_time = now;
+        memory_table.dirty = false;
+    }
+
+    yaslfree(tmp);
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "rabin.h"
+#include "simvacation.h"
+#include "vdb.h"
+
+/* The table is a flat file of 64 byte buckets, each holding four slots. A
+ * slot's key combines a hash of the recipient with a fingerprint of the
+ * sender, and its stamp packs the time of the reply with the interval it was
+ * sent under, so expired slots can be recognised and reused without a
+ * separate GC pass.
+ *
+ * Slots are claimed by swapping the stamp for one with a zero interval, which
+ * readers ignore and other writers leave alone until it is at least a second
+ * old, so a writer that dies mid-update only costs a slot briefly. Readers
+ * load the stamp, the key and the stamp again, and only trust the key if the
+ * stamp didn't change.
+ */
+
+#define MMAPHASH_MAGIC 0x73696d766d6d6801ULL /* "simvmmh" v1 */
+#define MMAPHASH_SLOTS 4
+#define MMAPHASH_INTERVAL_BITS 24
+#define MMAPHASH_INTERVAL_MAX ((1ULL << MMAPHASH_INTERVAL_BITS) - 1)
+
+struct mmaphash_slot {
+    uint64_t key;
+    uint64_t stamp;
+};
+
+struct mmaphash_bucket {
+    struct mmaphash_slot slots[ MMAPHASH_SLOTS ];
+} __attribute__((aligned(64)));
+
+struct mmaphash_header {
+    uint64_t magic;
+    uint64_t nbuckets;
+} __attribute__((aligned(64)));
+
+static uint64_t mmaphash_vdb_key(VDB *, const yastr);
+static uint64_t mmaphash_vdb_stamp(time_t, time_t);
+static time_t   mmaphash_vdb_stamp_time(uint64_t);
+static time_t   mmaphash_vdb_stamp_interval(uint64_t);
+static struct mmaphash_bucket *mmaphash_vdb_bucket(VDB *, uint64_t, uint64_t);
+static int64_t                 mmaphash_vdb_probe(void);
+
+VDB *
+mmaphash_vdb_init(const yastr rcpt) {
+    VDB *                   vdb;
+    const char *            path;
+    int64_t                 buckets;
+    size_t                  len;
+    struct mmaphash_header *header;
+
+    if ((path = ucl_object_tostring(ucl_object_lookup_path(
+                 vac_config, "mmaphash.path"))) == NULL) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: no path configured");
+        return NULL;
+    }
+
+    if ((buckets = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "mmaphash.buckets"))) < 1) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: invalid bucket count");
+        return NULL;
+    }
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->mmaphash = calloc(1, sizeof(struct vdb_mmaphash))) == NULL) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: calloc: %m");
+        goto error;
+    }
+
+    if ((vdb->mmaphash->map = vdb_mmap_file(path,
+                 (buckets + 1) * sizeof(struct mmaphash_bucket), &len)) ==
+            NULL) {
+        goto error;
+    }
+    vdb->mmaphash->len = len;
+
+    if (len < 2 * sizeof(struct mmaphash_bucket)) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: %s is truncated", path);
+        goto error;
+    }
+
+    /* The geometry comes from the file, so that changing mmaphash.buckets
+     * doesn't misread an existing table.
+     */
+    header = vdb->mmaphash->map;
+    buckets = (len / sizeof(struct mmaphash_bucket)) - 1;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == 0) {
+        __atomic_store_n(&header->nbuckets, buckets, __ATOMIC_RELAXED);
+        __atomic_store_n(&header->magic, MMAPHASH_MAGIC, __ATOMIC_RELEASE);
+    }
+    if ((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != MMAPHASH_MAGIC) ||
+            (header->nbuckets != buckets)) {
+        syslog(LOG_ALERT, "mmaphash vdb_init: %s is not a valid table", path);
+        goto error;
+    }
+
+    vdb->mmaphash->buckets = (struct mmaphash_bucket *)vdb->mmaphash->map + 1;
+    vdb->mmaphash->nbuckets = buckets;
+    vdb->mmaphash->rcpt_hash = rabin_fingerprint(rcpt, yasllen(rcpt));
+    vdb->rcpt = yaslauto(rcpt);
+
+    return vdb;
+
+error:
+    mmaphash_vdb_close(vdb);
+    return NULL;
+}
+
+void
+mmaphash_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->mmaphash) {
+            if (vdb->mmaphash->map) {
+                munmap(vdb->mmaphash->map, vdb->mmaphash->len);
+            }
+            free(vdb->mmaphash);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+mmaphash_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    uint64_t                key, slot_key, stamp;
+    int64_t                 probe, i;
+    int                     j;
+    time_t                  now;
+    struct mmaphash_bucket *bucket;
+    struct mmaphash_slot *  slot;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "mmaphash vdb_recent time: %m");
+        return VDB_STATUS_OK;
+    }
+
+    key = mmaphash_vdb_key(vdb, from);
+    probe = mmaphash_vdb_probe();
+
+    for (i = 0; i < probe; i++) {
+        bucket = mmaphash_vdb_bucket(vdb, key, i);
+        for (j = 0; j < MMAPHASH_SLOTS; j++) {
+            slot = &bucket->slots[ j ];
+            stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+            if (mmaphash_vdb_stamp_interval(stamp) == 0) {
+                continue;
+            }
+            slot_key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+            if ((slot_key != key) ||
+                    (__atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE) !=
+                            stamp)) {
+                continue;
+            }
+            if (now < (mmaphash_vdb_stamp_time(stamp) + interval)) {
+                return VDB_STATUS_RECENT;
+            }
+        }
+    }
+
+    return VDB_STATUS_OK;
+}
+
+vac_result
+mmaphash_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    uint64_t                key, stamp, victim_stamp;
+    int64_t                 probe, i;
+    int                     j, victim_live;
+    time_t                  now, ts;
+    struct mmaphash_bucket *bucket;
+    struct mmaphash_slot *  slot, *victim;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "mmaphash vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    /* A zero interval marks a claimed slot. */
+    interval = MAX(1, MIN(interval, (time_t)MMAPHASH_INTERVAL_MAX));
+    key = mmaphash_vdb_key(vdb, from);
+    probe = mmaphash_vdb_probe();
+
+retry:
+    victim = NULL;
+    victim_stamp = 0;
+    victim_live = 0;
+
+    for (i = 0; i < probe; i++) {
+        bucket = mmaphash_vdb_bucket(vdb, key, i);
+        for (j = 0; j < MMAPHASH_SLOTS; j++) {
+            slot = &bucket->slots[ j ];
+            stamp = __atomic_load_n(&slot->stamp, __ATOMIC_ACQUIRE);
+            ts = mmaphash_vdb_stamp_time(stamp);
+
+            if (mmaphash_vdb_stamp_interval(stamp) == 0) {
+                /* Empty, or claimed by a writer that has had long enough
+                 * to finish. Stamps only have whole seconds, so a claim
+                 * made in the previous second may be moments old.
+                 */
+                if (((stamp == 0) || (ts + 1 < now)) &&
+                        ((victim == NULL) || victim_live)) {
+                    victim = slot;
+                    victim_stamp = stamp;
+                    victim_live = 0;
+                }
+                continue;
+            }
+
+            if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) {
+                /* Refresh the existing entry in place. */
+                if (__atomic_compare_exchange_n(&slot->stamp, &stamp,
+                            mmaphash_vdb_stamp(now, interval), false,
+                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    return VAC_RESULT_OK;
+                }
+                goto retry;
+            }
+
+            if (ts + mmaphash_vdb_stamp_interval(stamp) <= now) {
+                /* Expired, reuse it. */
+                if ((victim == NULL) || victim_live) {
+                    victim = slot;
+                    victim_stamp = stamp;
+                    victim_live = 0;
+                }
+            } else if ((victim == NULL) ||
+                       (victim_live &&
+                               (ts < mmaphash_vdb_stamp_time(victim_stamp)))) {
+                /* Fall back to evicting the oldest live entry. */
+                victim = slot;
+                victim_stamp = stamp;
+                victim_live = 1;
+            }
+        }
+    }
+
+    if (victim == NULL) {
+        /* Every candidate is mid-update by another writer. */
+        syslog(LOG_NOTICE, "mmaphash vdb_store_reply: no free slot");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (!__atomic_compare_exchange_n(&victim->stamp, &victim_stamp,
+                mmaphash_vdb_stamp(now, 0), false, __ATOMIC_ACQ_REL,
+                __ATOMIC_ACQUIRE)) {
+        goto retry;
+    }
+
+    if (victim_live) {
+        syslog(LOG_INFO, "mmaphash vdb_store_reply: evicted a live entry");
+    }
+
+    stamp = mmaphash_vdb_stamp(now, interval);
+    __atomic_store_n(&victim->key, key, __ATOMIC_RELEASE);
+    __atomic_store_n(&victim->stamp, stamp, __ATOMIC_RELEASE);
+
+    return VAC_RESULT_OK;
+}
+
+/* Occupancy of the table. Expired slots are reused in place rather than
+ * collected, so they count as used until they're overwritten.
+ */
+ucl_object_t *
+mmaphash_vdb_stats(VDB *vdb) {
+    uint64_t      i, stamp, used = 0, live = 0;
+    int           j;
+    time_t        now;
+    ucl_object_t *stats;
+
+    stats = ucl_object_typed_new(UCL_OBJECT);
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "mmaphash vdb_stats time: %m");
+        return stats;
+    }
+
+    for (i = 0; i < vdb->mmaphash->nbuckets; i++) {
+        for (j = 0; j < MMAPHASH_SLOTS; j++) {
+            stamp = __atomic_load_n(
+                    &vdb->mmaphash->buckets[ i ].slots[ j ].stamp,
+                    __ATOMIC_RELAXED);
+            if (mmaphash_vdb_stamp_interval(stamp) == 0) {
+                continue;
+            }
+            used++;
+            if (now < (mmaphash_vdb_stamp_time(stamp) +
+                              mmaphash_vdb_stamp_interval(stamp))) {
+                live++;
+            }
+        }
+    }
+
+    ucl_object_insert_key(stats, ucl_object_fromint(vdb->mmaphash->len),
+            "file_bytes", 0, false);
+    ucl_object_insert_key(stats, ucl_object_fromint(vdb->mmaphash->nbuckets),
+            "buckets", 0, false);
+    ucl_object_insert_key(stats,
+            ucl_object_fromint(vdb->mmaphash->nbuckets * MMAPHASH_SLOTS),
+            "slots", 0, false);
+    ucl_object_insert_key(
+            stats, ucl_object_fromint(used), "used_slots", 0, false);
+    ucl_object_insert_key(
+            stats, ucl_object_fromint(live), "live_slots", 0, false);
+
+    return stats;
+}
+
+static uint64_t
+mmaphash_vdb_key(VDB *vdb, const yastr from) {
+    uint64_t key;
+
+    key = (vdb->mmaphash->rcpt_hash << 32) |
+          (rabin_fingerprint(from, yasllen(from)) & 0xffffffff);
+
+    /* Zero marks an unused slot. */
+    return key ? key : 1;
+}
+
+static uint64_t
+mmaphash_vdb_stamp(time_t ts, time_t interval) {
+    return ((uint64_t)ts << MMAPHASH_INTERVAL_BITS) | (uint64_t)interval;
+}
+
+static time_t
+mmaphash_vdb_stamp_time(uint64_t stamp) {
+    return (time_t)(stamp >> MMAPHASH_INTERVAL_BITS);
+}
+
+static time_t
+mmaphash_vdb_stamp_interval(uint64_t stamp) {
+    return (time_t)(stamp & MMAPHASH_INTERVAL_MAX);
+}
+
+static struct mmaphash_bucket *
+mmaphash_vdb_bucket(VDB *vdb, uint64_t key, uint64_t probe) {
+    return &vdb->mmaphash->buckets[ (vdb_mix(key) + probe) %
+                                    vdb->mmaphash->nbuckets ];
+}
+
+static int64_t
+mmaphash_vdb_probe(void) {
+    int64_t probe;
+
+    probe = ucl_object_toint(
+            ucl_object_lookup_path(vac_config, "mmaphash.probe"));
+
+    return probe > 0 ? probe : 1;
+}
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/param.h>
 #include <sysexits.h>
 #include <syslog.h>
@@ -17,35 +18,259 @@
 #include <unistd.h>
 
 #include "rabin.h"
+#include "sha1.h"
 #include "simvacation.h"
 #include "vdb.h"
 
-static yastr redis_vdb_key(const yastr, const yastr);
+static struct redis_node *redis_vdb_add_node(
+        struct redis_node **, size_t *, const char *);
+static vac_result  redis_vdb_add_replicas(
+        struct redis_node *, const ucl_object_t *);
+static void        redis_vdb_free_nodes(struct redis_node *, size_t);
+static int         redis_vdb_point_cmp(const void *, const void *);
+static uint64_t    redis_vdb_hash(const char *, size_t);
+static size_t      redis_vdb_owner(VDB *, const char *);
+static urclHandle *redis_vdb_node(VDB *, size_t);
+static urclHandle *redis_vdb_connect(struct redis_node *);
+static urclHandle *redis_vdb_reader(VDB *);
+static bool        redis_vdb_standalone(urclHandle *, const char *);
+static redisReply *redis_vdb_get(urclHandle *, const yastr, const yastr);
+static bool        redis_vdb_hash_layout(void);
+static bool        redis_vdb_legacy_keys(void);
+static int         redis_vdb_batch(void);
+static vdb_status  redis_vdb_recent_fp(VDB *, const yastr, time_t);
+static const char *redis_vdb_store_sha(void);
+static yastr       redis_vdb_key(const yastr, const yastr);
+static yastr       redis_vdb_legacy_key(const yastr, const yastr);
+static yastr       redis_vdb_hash_key(const yastr, const char *);
+static yastr       redis_vdb_key_rcpt(redisReply *, const char *);
+static struct vdb_entry *redis_vdb_entries(redisReply *, size_t *);
+static void redis_vdb_stats_int(ucl_object_t *, const char *, redisReply *);
+
+/* Records a reply in either layout, in one round trip. Each recipient has a
+ * sorted set scoring the sender fields by expiry time, which indexes their
+ * entries for simunvacation and marks them as having state. Fields whose
+ * expiry has passed are pruned, and the sorted set (and hash) expire along
+ * with their newest field so that idle recipients disappear on their own.
+ *
+ * KEYS[1]: entry key or sender hash, KEYS[2]: expiry sorted set
+ * ARGV[1]: layout, ARGV[2]: sender field, ARGV[3]: current time,
+ * ARGV[4]: expiry time
+ */
+static const char *redis_vdb_store_script =
+        "local hash = (ARGV[1] == 'hash')\n"
+        "if hash then\n"
+        "    redis.call('HSET', KEYS[1], ARGV[2], ARGV[3])\n"
+        "else\n"
+        "    redis.call('SET', KEYS[1], ARGV[3], 'EX',\n"
+        "        tonumber(ARGV[4]) - tonumber(ARGV[3]))\n"
+        "end\n"
+        "redis.call('ZADD', KEYS[2], ARGV[4], ARGV[2])\n"
+        "local old = redis.call('ZRANGEBYSCORE', KEYS[2], '-inf', ARGV[3],\n"
+        "    'LIMIT', 0, 100)\n"
+        "if #old > 0 then\n"
+        "    if hash then redis.call('HDEL', KEYS[1], unpack(old)) end\n"
+        "    redis.call('ZREM', KEYS[2], unpack(old))\n"
+        "end\n"
+        "local last = redis.call('ZRANGE', KEYS[2], -1, -1, 'WITHSCORES')\n"
+        "if hash then redis.call('EXPIREAT', KEYS[1], last[2]) end\n"
+        "redis.call('EXPIREAT', KEYS[2], last[2])\n"
+        "return 1\n";
+
+/* Reads back a page of the string key layout for simvacation-vdbtool,
+ * including keys written before the recipient became a hash tag.
+ *
+ * ARGV[1]: newline separated keys
+ * Returns recipient, sender field, timestamp and expiry time for each key.
+ */
+static const char *redis_vdb_walk_keys_script =
+        "local now = tonumber(redis.call('TIME')[1])\n"
+        "local out = {}\n"
+        "for k in string.gmatch(ARGV[1], '[^\\n]+') do\n"
+        "    local r, f = string.match(k,\n"
+        "        '^simvacation:user:{(.*)}:([%w%-]+)$')\n"
+        "    if not r then\n"
+        "        r, f = string.match(k, '^simvacation:user:(.*):([%w%-]+)$')\n"
+        "    end\n"
+        "    local ts = redis.call('GET', k)\n"
+        "    local ttl = redis.call('TTL', k)\n"
+        "    if r and ts and ttl ~= -2 then\n"
+        "        local exp = 0\n"
+        "        if ttl > 0 then exp = now + ttl end\n"
+        "        table.insert(out, r)\n"
+        "        table.insert(out, f)\n"
+        "        table.insert(out, ts)\n"
+        "        table.insert(out, tostring(exp))\n"
+        "    end\n"
+        "end\n"
+        "return out\n";
+
+/* Reads back a page of recipients in the hash layout, with the same result
+ * format as the string key layout.
+ *
+ * ARGV[1]: newline separated recipients
+ */
+static const char *redis_vdb_walk_hash_script =
+        "local out = {}\n"
+        "for r in string.gmatch(ARGV[1], '[^\\n]+') do\n"
+        "    local sk = 'simvacation:{' .. r .. '}:senders'\n"
+        "    local ek = 'simvacation:{' .. r .. '}:expiry'\n"
+        "    local h = redis.call('HGETALL', sk)\n"
+        "    for i = 1, #h, 2 do\n"
+        "        table.insert(out, r)\n"
+        "        table.insert(out, h[i])\n"
+        "        table.insert(out, h[i + 1])\n"
+        "        table.insert(out, redis.call('ZSCORE', ek, h[i]) or '0')\n"
+        "    end\n"
+        "end\n"
+        "return out\n";
+
+/* Loads a batch of entries owned by one node, keeping whichever of the stored
+ * and loaded timestamps is newer.
+ *
+ * ARGV[1]: layout, ARGV[2]: newline separated, tab delimited recipient,
+ * sender field, timestamp and expiry time
+ */
+static const char *redis_vdb_load_script =
+        "local now = tonumber(redis.call('TIME')[1])\n"
+        "for r, f, ts, exp in string.gmatch(ARGV[2],\n"
+        "        '([^\\t\\n]+)\\t([%w%-]+)\\t(%d+)\\t(%d+)\\n') do\n"
+        "    ts = tonumber(ts)\n"
+        "    exp = tonumber(exp)\n"
+        "    if exp > now then\n"
+        "        if ARGV[1] == 'hash' then\n"
+        "            local sk = 'simvacation:{' .. r .. '}:senders'\n"
+        "            local ek = 'simvacation:{' .. r .. '}:expiry'\n"
+        "            local cur = tonumber(redis.call('HGET', sk, f))\n"
+        "            if not cur or cur < ts then\n"
+        "                redis.call('HSET', sk, f, ts)\n"
+        "                redis.call('ZADD', ek, exp, f)\n"
+        "                local last = redis.call('ZRANGE', ek, -1, -1,\n"
+        "                    'WITHSCORES')\n"
+        "                redis.call('EXPIREAT', sk, last[2])\n"
+        "                redis.call('EXPIREAT', ek, last[2])\n"
+        "            end\n"
+        "        else\n"
+        "            local k = 'simvacation:user:{' .. r .. '}:' .. f\n"
+        "            local ek = 'simvacation:{' .. r .. '}:expiry'\n"
+        "            local cur = tonumber(redis.call('GET', k))\n"
+        "            if not cur or cur < ts then\n"
+        "                redis.call('SET', k, ts)\n"
+        "                redis.call('EXPIREAT', k, exp)\n"
+        "                redis.call('ZADD', ek, exp, f)\n"
+        "                local last = redis.call('ZRANGE', ek, -1, -1,\n"
+        "                    'WITHSCORES')\n"
+        "                redis.call('EXPIREAT', ek, last[2])\n"
+        "            end\n"
+        "        end\n"
+        "    end\n"
+        "end\n"
+        "return 1\n";
 
 VDB *
 redis_vdb_init(const yastr rcpt) {
-    VDB *       vdb = NULL;
-    VDB *       res = NULL;
-    const char *host = "127.0.0.1";
-    int64_t     port = 6379;
-
-    if (!ucl_object_tostring_safe(
-                ucl_object_lookup_path(vac_config, "redis.host"), &host)) {
-        syslog(LOG_ERR, "vdb_init: ucl_object_tostring_safe failed");
+    VDB *               vdb = NULL;
+    VDB *               res = NULL;
+    const char *        host = "127.0.0.1";
+    int64_t             port = 6379;
+    int64_t             vnodes;
+    const ucl_object_t *nodes;
+    const ucl_object_t *node;
+    const ucl_object_t *replicas;
+    const char *        spec;
+    struct redis_node * primary;
+    ucl_object_iter_t   i;
+    size_t              n;
+    int                 v;
+    yastr               label;
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
         goto error;
     }
-    if (!ucl_object_toint_safe(
-                ucl_object_lookup_path(vac_config, "redis.port"), &port)) {
-        syslog(LOG_ERR, "vdb_init: ucl_object_toint_safe failed");
+
+    if ((vdb->redis = calloc(1, sizeof(struct vdb_redis))) == NULL) {
         goto error;
     }
 
-    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+    if ((nodes = ucl_object_lookup_path(vac_config, "redis.nodes")) != NULL) {
+        i = ucl_object_iterate_new(nodes);
+        while ((node = ucl_object_iterate_safe(i, true)) != NULL) {
+            /* Nodes are either "host:port", or an object listing the
+             * primary and its replicas.
+             */
+            if (ucl_object_type(node) == UCL_OBJECT) {
+                spec = ucl_object_tostring(ucl_object_lookup(node, "primary"));
+                replicas = ucl_object_lookup(node, "replicas");
+            } else {
+                spec = ucl_object_tostring(node);
+                replicas = NULL;
+            }
+            if (((primary = redis_vdb_add_node(&vdb->redis->nodes,
+                          &vdb->redis->nnodes, spec)) == NULL) ||
+                    (redis_vdb_add_replicas(primary, replicas) !=
+                            VAC_RESULT_OK)) {
+                ucl_object_iterate_free(i);
+                goto error;
+            }
+        }
+        ucl_object_iterate_free(i);
+    }
+
+    if (vdb->redis->nnodes == 0) {
+        if (!ucl_object_tostring_safe(
+                    ucl_object_lookup_path(vac_config, "redis.host"), &host)) {
+            syslog(LOG_ERR, "vdb_init: ucl_object_tostring_safe failed");
+            goto error;
+        }
+        if (!ucl_object_toint_safe(
+                    ucl_object_lookup_path(vac_config, "redis.port"), &port)) {
+            syslog(LOG_ERR, "vdb_init: ucl_object_toint_safe failed");
+            goto error;
+        }
+        label = yaslcatprintf(yaslempty(), "%s:%lld", host, (long long)port);
+        primary = redis_vdb_add_node(
+                &vdb->redis->nodes, &vdb->redis->nnodes, label);
+        yaslfree(label);
+        replicas = ucl_object_lookup_path(vac_config, "redis.replicas");
+        if ((primary == NULL) ||
+                (redis_vdb_add_replicas(primary, replicas) != VAC_RESULT_OK)) {
+            goto error;
+        }
+    }
+
+    /* Each node gets a number of points on the ring, and a recipient belongs
+     * to the node that owns the first point at or after the recipient's hash.
+     * Adding or removing a node only moves the recipients in the arcs next to
+     * its points.
+     */
+    if ((vnodes = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "redis.vnodes"))) < 1) {
+        vnodes = 1;
+    }
+
+    if ((vdb->redis->ring = calloc(vdb->redis->nnodes * vnodes,
+                 sizeof(struct redis_point))) == NULL) {
         goto error;
     }
 
-    if ((vdb->redis = urcl_connect(host, port)) == NULL) {
-        syslog(LOG_ALERT, "redis vdb_init urcl_connect: failed");
+    for (n = 0; n < vdb->redis->nnodes; n++) {
+        for (v = 0; v < vnodes; v++) {
+            label = yaslcatprintf(yaslempty(), "%s:%d-%d",
+                    vdb->redis->nodes[ n ].host, vdb->redis->nodes[ n ].port,
+                    v);
+            vdb->redis->ring[ vdb->redis->npoints ].hash =
+                    redis_vdb_hash(label, yasllen(label));
+            vdb->redis->ring[ vdb->redis->npoints ].node = n;
+            vdb->redis->npoints++;
+            yaslfree(label);
+        }
+    }
+
+    qsort(vdb->redis->ring, vdb->redis->npoints, sizeof(struct redis_point),
+            redis_vdb_point_cmp);
+
+    vdb->redis->owner = redis_vdb_owner(vdb, rcpt);
+    if ((vdb->redis->conn = redis_vdb_node(vdb, vdb->redis->owner)) == NULL) {
         goto error;
     }
 
@@ -65,25 +290,280 @@ void
 redis_vdb_close(VDB *vdb) {
     if (vdb) {
         if (vdb->redis) {
-            urcl_free(vdb->redis);
+            redis_vdb_free_nodes(vdb->redis->nodes, vdb->redis->nnodes);
+            free(vdb->redis->ring);
+            free(vdb->redis);
         }
+        yaslfree(vdb->rcpt);
         free(vdb);
     }
 }
 
+static struct redis_node *
+redis_vdb_add_node(
+        struct redis_node **nodes, size_t *nnodes, const char *spec) {
+    struct redis_node *node;
+    const char *       p;
+
+    if (spec == NULL) {
+        syslog(LOG_ERR, "redis vdb_init: invalid node");
+        return NULL;
+    }
+
+    if ((node = realloc(*nodes, (*nnodes + 1) * sizeof(struct redis_node))) ==
+            NULL) {
+        syslog(LOG_ERR, "redis vdb_init: realloc: %m");
+        return NULL;
+    }
+    *nodes = node;
+
+    node = &(*nodes)[ *nnodes ];
+    memset(node, 0, sizeof(struct redis_node));
+    if ((p = strrchr(spec, ':')) != NULL) {
+        node->host = yaslnew(spec, p - spec);
+        node->port = atoi(p + 1);
+    } else {
+        node->host = yaslauto(spec);
+        node->port = 6379;
+    }
+    (*nnodes)++;
+
+    return node;
+}
+
+static vac_result
+redis_vdb_add_replicas(struct redis_node *node, const ucl_object_t *replicas) {
+    const ucl_object_t *replica;
+    ucl_object_iter_t   i;
+    vac_result          retval = VAC_RESULT_OK;
+
+    if (replicas == NULL) {
+        return VAC_RESULT_OK;
+    }
+
+    i = ucl_object_iterate_new(replicas);
+    while ((replica = ucl_object_iterate_safe(i, true)) != NULL) {
+        if (redis_vdb_add_node(&node->replicas, &node->nreplicas,
+                    ucl_object_tostring(replica)) == NULL) {
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+    }
+    ucl_object_iterate_free(i);
+
+    return retval;
+}
+
+static void
+redis_vdb_free_nodes(struct redis_node *nodes, size_t nnodes) {
+    size_t n;
+
+    for (n = 0; n < nnodes; n++) {
+        if (nodes[ n ].conn) {
+            urcl_free(nodes[ n ].conn);
+        }
+        yaslfree(nodes[ n ].host);
+        redis_vdb_free_nodes(nodes[ n ].replicas, nodes[ n ].nreplicas);
+    }
+    free(nodes);
+}
+
+static int
+redis_vdb_point_cmp(const void *a, const void *b) {
+    const struct redis_point *pa = a;
+    const struct redis_point *pb = b;
+
+    if (pa->hash < pb->hash) {
+        return -1;
+    }
+    return (pa->hash > pb->hash);
+}
+
+/* Rabin fingerprints of similar strings are similar, which is fine for keys
+ * but not for spreading things around the ring, so the bits are mixed.
+ */
+static uint64_t
+redis_vdb_hash(const char *s, size_t len) {
+    return vdb_mix(rabin_fingerprint(s, len));
+}
+
+static size_t
+redis_vdb_owner(VDB *vdb, const char *rcpt) {
+    uint64_t h;
+    size_t   lo = 0, hi, mid;
+
+    if (vdb->redis->nnodes == 1) {
+        return 0;
+    }
+
+    h = redis_vdb_hash(rcpt, strlen(rcpt));
+    hi = vdb->redis->npoints;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (vdb->redis->ring[ mid ].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == vdb->redis->npoints) {
+        lo = 0;
+    }
+
+    return vdb->redis->ring[ lo ].node;
+}
+
+/* Connections are made on first use, so that simvacation only talks to the
+ * node that owns its recipient.
+ */
+static urclHandle *
+redis_vdb_node(VDB *vdb, size_t n) {
+    return redis_vdb_connect(&vdb->redis->nodes[ n ]);
+}
+
+static urclHandle *
+redis_vdb_connect(struct redis_node *node) {
+    if ((node->conn == NULL) &&
+            ((node->conn = urcl_connect(node->host, node->port)) == NULL)) {
+        syslog(LOG_ALERT, "redis vdb urcl_connect %s:%d: failed", node->host,
+                node->port);
+    }
+
+    return node->conn;
+}
+
+/* Lookups can be served by a replica of the recipient's node. Replicas are
+ * expected to run with replica-serve-stale-data off, so one that has lost its
+ * primary answers with an error and the lookup falls back to the primary;
+ * choosing one costs nothing up front. Stores wait for the replicas to catch
+ * up, see redis_vdb_store_reply().
+ */
+static urclHandle *
+redis_vdb_reader(VDB *vdb) {
+    struct redis_node *node = &vdb->redis->nodes[ vdb->redis->owner ];
+    struct redis_node *replica;
+    size_t             i, start;
+
+    if (vdb->redis->reader) {
+        return vdb->redis->reader;
+    }
+
+    vdb->redis->reader = vdb->redis->conn;
+
+    if (node->nreplicas == 0) {
+        return vdb->redis->reader;
+    }
+
+    /* Spread processes across the replicas. */
+    start = getpid() % node->nreplicas;
+    for (i = 0; i < node->nreplicas; i++) {
+        replica = &node->replicas[ (start + i) % node->nreplicas ];
+        if (redis_vdb_connect(replica) != NULL) {
+            vdb->redis->reader = replica->conn;
+            break;
+        }
+    }
+
+    return vdb->redis->reader;
+}
+
+/* Looking recipients up, recording replies and cleaning up after a recipient
+ * only touch keys that share the recipient's hash tag, and work with Redis
+ * Cluster. Finding recipients, walking and loading scan a whole server, and
+ * are refused on one with cluster mode enabled instead of silently covering
+ * only part of the data.
+ */
+static bool
+redis_vdb_standalone(urclHandle *conn, const char *caller) {
+    redisReply *res;
+    bool        retval = false;
+
+    if ((res = urcl_command(conn, "simvacation", "INFO cluster")) == NULL) {
+        syslog(LOG_ALERT, "redis %s: INFO failed", caller);
+    } else if (res->type != REDIS_REPLY_STRING) {
+        syslog(LOG_ALERT, "redis %s: INFO failed: %s", caller,
+                (res->type == REDIS_REPLY_ERROR) ? res->str : "bad reply");
+    } else if (strstr(res->str, "cluster_enabled:1") != NULL) {
+        syslog(LOG_ERR, "redis %s: not supported with Redis Cluster, "
+                        "list standalone servers in redis.nodes",
+                caller);
+    } else {
+        retval = true;
+    }
+
+    urcl_free_result(res);
+    return retval;
+}
+
+static redisReply *
+redis_vdb_get(urclHandle *conn, const yastr key, const yastr field) {
+    if (field) {
+        return urcl_command(conn, key, "HGET %s %s", key, field);
+    }
+    return urcl_command(conn, key, "GET %s", key);
+}
+
 vdb_status
 redis_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    vdb_status retval;
+    yastr      fp;
+
+    fp = vdb_fingerprint(from);
+    retval = redis_vdb_recent_fp(vdb, fp, interval);
+    yaslfree(fp);
+
+    /* During a change of core.fingerprint, also look for a reply recorded
+     * under the previous fingerprint.
+     */
+    if ((retval != VDB_STATUS_RECENT) &&
+            ((fp = vdb_fingerprint_fallback(from)) != NULL)) {
+        retval = redis_vdb_recent_fp(vdb, fp, interval);
+        yaslfree(fp);
+    }
+
+    return retval;
+}
+
+static vdb_status
+redis_vdb_recent_fp(VDB *vdb, const yastr fp, time_t interval) {
     int         retval = VDB_STATUS_OK;
     time_t      last, now;
-    yastr       key;
+    yastr       key, field = NULL;
     redisReply *res = NULL;
+    urclHandle *reader;
+
+    if (redis_vdb_hash_layout()) {
+        key = redis_vdb_hash_key(vdb->rcpt, "senders");
+        field = yasldup(fp);
+    } else {
+        key = redis_vdb_key(vdb->rcpt, fp);
+    }
 
-    if ((key = redis_vdb_key(vdb->rcpt, from)) == NULL) {
-        return retval;
+    reader = redis_vdb_reader(vdb);
+    res = redis_vdb_get(reader, key, field);
+
+    if ((reader != vdb->redis->conn) &&
+            ((res == NULL) || (res->type == REDIS_REPLY_ERROR))) {
+        syslog(LOG_NOTICE, "redis vdb_recent: replica read failed, "
+                           "falling back to primary");
+        urcl_free_result(res);
+        vdb->redis->reader = vdb->redis->conn;
+        res = redis_vdb_get(vdb->redis->conn, key, field);
+    }
+
+    /* Replies stored before the recipient became a hash tag are still
+     * honoured until they expire.
+     */
+    if ((field == NULL) && res && (res->type == REDIS_REPLY_NIL) &&
+            redis_vdb_legacy_keys()) {
+        urcl_free_result(res);
+        yaslfree(key);
+        key = redis_vdb_legacy_key(vdb->rcpt, fp);
+        res = redis_vdb_get(redis_vdb_reader(vdb), key, NULL);
     }
 
-    if (((res = urcl_command(vdb->redis, key, "GET %s", key)) == NULL) ||
-            (res->type != REDIS_REPLY_STRING)) {
+    if ((res == NULL) || (res->type != REDIS_REPLY_STRING)) {
         goto cleanup;
     }
 
@@ -93,44 +573,568 @@ redis_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
         syslog(LOG_ALERT, "redis vdb_recent time: %m");
     } else if (now < (last + interval)) {
         retval = VDB_STATUS_RECENT;
-    } else {
+    } else if (field == NULL) {
         /* This shouldn't happen, so let's clean it up */
-        urcl_free_result(urcl_command(vdb->redis, key, "DEL %s", key));
+        urcl_free_result(urcl_command(vdb->redis->conn, key, "DEL %s", key));
     }
 
 cleanup:
     urcl_free_result(res);
     yaslfree(key);
+    yaslfree(field);
     return retval;
 }
 
 vac_result
-redis_vdb_store_reply(VDB *vdb, const yastr from) {
-    time_t now;
-    yastr  key;
-    char   value[ 16 ];
+redis_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    struct redis_node *node = &vdb->redis->nodes[ vdb->redis->owner ];
+    time_t             now;
+    yastr              key, zkey, fp;
+    const char *       layout;
+    redisReply *       res;
+    vac_result         retval = VAC_RESULT_OK;
 
     if ((now = time(NULL)) < 0) {
         syslog(LOG_ALERT, "redis vdb_store_reply time: %m");
         return VAC_RESULT_TEMPFAIL;
     }
 
-    key = redis_vdb_key(vdb->rcpt, from);
-    snprintf(value, 16, "%lld", (long long)now);
+    /* Entries are only useful for as long as the recipient's interval. */
+    if (interval < 1) {
+        interval = 1;
+    }
+
+    fp = vdb_fingerprint(from);
+    zkey = redis_vdb_hash_key(vdb->rcpt, "expiry");
+    if (redis_vdb_hash_layout()) {
+        layout = "hash";
+        key = redis_vdb_hash_key(vdb->rcpt, "senders");
+    } else {
+        layout = "keys";
+        key = redis_vdb_key(vdb->rcpt, fp);
+    }
+
+    /* The script is sent by its digest, and only in full when the server
+     * hasn't seen it yet.
+     */
+    res = urcl_command(vdb->redis->conn, zkey,
+            "EVALSHA %s 2 %s %s %s %s %lld %lld", redis_vdb_store_sha(), key,
+            zkey, layout, fp, (long long)now, (long long)(now + interval));
+    if (res && (res->type == REDIS_REPLY_ERROR) &&
+            (strncmp(res->str, "NOSCRIPT", 8) == 0)) {
+        urcl_free_result(res);
+        res = urcl_command(vdb->redis->conn, zkey,
+                "EVAL %s 2 %s %s %s %s %lld %lld", redis_vdb_store_script, key,
+                zkey, layout, fp, (long long)now, (long long)(now + interval));
+    }
+    if ((res == NULL) || (res->type == REDIS_REPLY_ERROR)) {
+        syslog(LOG_ALERT, "redis vdb_store_reply: EVAL failed: %s",
+                res ? res->str : "no response");
+        retval = VAC_RESULT_TEMPFAIL;
+    }
+    urcl_free_result(res);
+
+    /* Replication is asynchronous, so give the replicas up to
+     * redis.replica_wait to acknowledge the reply before carrying on. This
+     * closes the window in which a lookup sent to a replica could miss it,
+     * unless a replica is down or badly behind.
+     */
+    if ((retval == VAC_RESULT_OK) && (node->nreplicas > 0)) {
+        res = urcl_command(vdb->redis->conn, zkey, "WAIT %lld %lld",
+                (long long)node->nreplicas,
+                (long long)(ucl_object_todouble(ucl_object_lookup_path(
+                                    vac_config, "redis.replica_wait")) *
+                            1000));
+        if ((res == NULL) || (res->type != REDIS_REPLY_INTEGER)) {
+            syslog(LOG_NOTICE, "redis vdb_store_reply: WAIT failed");
+        } else if (res->integer < (long long)node->nreplicas) {
+            syslog(LOG_NOTICE,
+                    "redis vdb_store_reply: %lld of %zu replicas acknowledged",
+                    res->integer, node->nreplicas);
+        }
+        urcl_free_result(res);
+    }
+
+    yaslfree(key);
+    yaslfree(zkey);
+    yaslfree(fp);
+
+    return retval;
+}
+
+/* Recipients with stored state are found by their expiry sets. Each page of
+ * SCAN is handed over before the next is fetched, so the caller can clean up
+ * the names it gets without them all being held in memory.
+ */
+vac_result
+redis_vdb_get_names(VDB *vdb, size_t batch, vdb_names_cb cb, void *ctx) {
+    urclHandle *conn;
+    redisReply *res;
+    redisReply *keys;
+    yastr       cursor, *names;
+    size_t      i, n, nnames;
+    bool        unreachable = false;
+    vac_result  retval = VAC_RESULT_OK;
+
+    cursor = yaslempty();
+
+    for (n = 0; (n < vdb->redis->nnodes) && (retval == VAC_RESULT_OK); n++) {
+        if ((conn = redis_vdb_node(vdb, n)) == NULL) {
+            /* The other nodes can still be cleaned up. */
+            unreachable = true;
+            continue;
+        }
+
+        if (!redis_vdb_standalone(conn, "vdb_get_names")) {
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        cursor = yaslcpy(cursor, "0");
+        do {
+            res = urcl_command(conn, cursor,
+                    "SCAN %s MATCH simvacation:{*}:expiry COUNT %d", cursor,
+                    (int)batch);
+            if ((res == NULL) || (res->type != REDIS_REPLY_ARRAY) ||
+                    (res->elements != 2)) {
+                syslog(LOG_ALERT, "redis vdb_get_names: SCAN failed");
+                urcl_free_result(res);
+                retval = VAC_RESULT_TEMPFAIL;
+                break;
+            }
+
+            cursor = yaslcpylen(cursor, res->element[ 0 ]->str,
+                    res->element[ 0 ]->len);
+            keys = res->element[ 1 ];
+            if ((names = calloc(keys->elements + 1, sizeof(yastr))) == NULL) {
+                syslog(LOG_ALERT, "redis vdb_get_names: calloc: %m");
+                urcl_free_result(res);
+                retval = VAC_RESULT_TEMPFAIL;
+                break;
+            }
+            for (i = 0, nnames = 0; i < keys->elements; i++) {
+                if ((names[ nnames ] = redis_vdb_key_rcpt(
+                             keys->element[ i ], "expiry")) != NULL) {
+                    nnames++;
+                }
+            }
+            urcl_free_result(res);
+
+            if (nnames > 0) {
+                retval = cb(names, nnames, ctx);
+            }
+
+            for (i = 0; i < nnames; i++) {
+                yaslfree(names[ i ]);
+            }
+            free(names);
+        } while ((retval == VAC_RESULT_OK) && (strcmp(cursor, "0") != 0));
+    }
+
+    yaslfree(cursor);
+    if ((retval == VAC_RESULT_OK) && unreachable) {
+        return VAC_RESULT_TEMPFAIL;
+    }
+    return retval;
+}
+
+/* Deletion uses UNLINK so that the memory is reclaimed in the background.
+ * In the string key layout the recipient's keys are found through their
+ * expiry set, read with ZSCAN in small batches; neither can tie up the server
+ * for long no matter how much state the user has.
+ */
+void
+redis_vdb_clean(VDB *vdb, const yastr user) {
+    urclHandle *conn;
+    redisReply *res, *members;
+    yastr       key, zkey, fp, cursor;
+    size_t      i;
+
+    if ((conn = redis_vdb_node(vdb, redis_vdb_owner(vdb, user))) == NULL) {
+        return;
+    }
+
+    zkey = redis_vdb_hash_key(user, "expiry");
+
+    if (redis_vdb_hash_layout()) {
+        key = redis_vdb_hash_key(user, "senders");
+        urcl_free_result(urcl_command(conn, key, "UNLINK %s", key));
+        yaslfree(key);
+    } else {
+        cursor = yaslauto("0");
+        do {
+            res = urcl_command(conn, zkey, "ZSCAN %s %s COUNT %d", zkey,
+                    cursor, redis_vdb_batch());
+            if ((res == NULL) || (res->type != REDIS_REPLY_ARRAY) ||
+                    (res->elements != 2)) {
+                /* Keep the index so that the next run can try again. */
+                syslog(LOG_ALERT, "redis vdb_clean: ZSCAN failed");
+                urcl_free_result(res);
+                yaslfree(cursor);
+                yaslfree(zkey);
+                return;
+            }
+
+            cursor = yaslcpylen(cursor, res->element[ 0 ]->str,
+                    res->element[ 0 ]->len);
+            /* Members alternate with their scores. */
+            members = res->element[ 1 ];
+            for (i = 0; i < members->elements; i += 2) {
+                fp = yaslnew(members->element[ i ]->str,
+                        members->element[ i ]->len);
+                key = redis_vdb_key(user, fp);
+                urcl_free_result(urcl_command(conn, key, "UNLINK %s", key));
+                yaslfree(key);
+                yaslfree(fp);
+            }
+            urcl_free_result(res);
+        } while (strcmp(cursor, "0") != 0);
+
+        yaslfree(cursor);
+    }
+
+    urcl_free_result(urcl_command(conn, zkey, "UNLINK %s", zkey));
+    yaslfree(zkey);
+}
+
+/* Pages through each node with SCAN and reads each page back with a single
+ * script call. The resume cursor is the node number and its SCAN cursor.
+ * Neither SCAN nor the script, which reads keys it isn't given, work across
+ * Redis Cluster, so the nodes must be standalone servers.
+ */
+vac_result
+redis_vdb_walk(VDB *vdb, const yastr resume, size_t batch, vdb_walk_cb cb,
+        void *ctx) {
+    urclHandle *      conn;
+    redisReply *      res;
+    struct vdb_entry *entries;
+    size_t            n = 0, i, nentries;
+    char *            p;
+    bool              hash = redis_vdb_hash_layout();
+    yastr             cursor, page, next, rcpt;
+    vac_result        retval = VAC_RESULT_OK;
+
+    cursor = yaslauto("0");
+    if (resume && ((p = strchr(resume, ':')) != NULL)) {
+        n = strtoull(resume, NULL, 10);
+        cursor = yaslcpy(cursor, p + 1);
+    }
+
+    for (; (n < vdb->redis->nnodes) && (retval == VAC_RESULT_OK); n++) {
+        if (((conn = redis_vdb_node(vdb, n)) == NULL) ||
+                !redis_vdb_standalone(conn, "vdb_walk")) {
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        do {
+            if (hash) {
+                res = urcl_command(conn, cursor,
+                        "SCAN %s MATCH simvacation:{*}:senders COUNT %d",
+                        cursor, (int)batch);
+            } else {
+                res = urcl_command(conn, cursor,
+                        "SCAN %s MATCH simvacation:user:* COUNT %d",
+                        cursor, (int)batch);
+            }
+            if ((res == NULL) || (res->type != REDIS_REPLY_ARRAY) ||
+                    (res->elements != 2)) {
+                syslog(LOG_ALERT, "redis vdb_walk: SCAN failed");
+                urcl_free_result(res);
+                retval = VAC_RESULT_TEMPFAIL;
+                break;
+            }
+
+            cursor = yaslcpylen(
+                    cursor, res->element[ 0 ]->str, res->element[ 0 ]->len);
+            /* The hash layout's script is given recipients. */
+            page = yaslempty();
+            for (i = 0; i < res->element[ 1 ]->elements; i++) {
+                if (!hash) {
+                    page = yaslcatlen(page,
+                            res->element[ 1 ]->element[ i ]->str,
+                            res->element[ 1 ]->element[ i ]->len);
+                } else if ((rcpt = redis_vdb_key_rcpt(
+                                    res->element[ 1 ]->element[ i ],
+                                    "senders")) != NULL) {
+                    page = yaslcatyasl(page, rcpt);
+                    yaslfree(rcpt);
+                } else {
+                    continue;
+                }
+                page = yaslcatlen(page, "\n", 1);
+            }
+            urcl_free_result(res);
 
-    urcl_free_result(urcl_command(vdb->redis, key, "SET %s %s", key, value));
-    /* expire entries after 7 days. */
-    urcl_free_result(urcl_command(vdb->redis, key, "EXPIRE %s 604800", key));
+            entries = NULL;
+            nentries = 0;
+            if (yasllen(page) > 0) {
+                res = urcl_command(conn, page, "EVAL %s 0 %s",
+                        hash ? redis_vdb_walk_hash_script
+                             : redis_vdb_walk_keys_script,
+                        page);
+                entries = redis_vdb_entries(res, &nentries);
+                urcl_free_result(res);
+                if (entries == NULL) {
+                    syslog(LOG_ALERT, "redis vdb_walk: EVAL failed");
+                    yaslfree(page);
+                    retval = VAC_RESULT_TEMPFAIL;
+                    break;
+                }
+            }
+            yaslfree(page);
 
-    return VAC_RESULT_OK;
+            /* Point the cursor at whatever comes after this page. */
+            if (strcmp(cursor, "0") == 0) {
+                next = yaslcatprintf(yaslempty(), "%zu:0", n + 1);
+            } else {
+                next = yaslcatprintf(yaslempty(), "%zu:%s", n, cursor);
+            }
+            retval = cb(entries, nentries, next, ctx);
+            yaslfree(next);
+            vdb_entries_free(entries, nentries);
+        } while ((retval == VAC_RESULT_OK) && (strcmp(cursor, "0") != 0));
+
+        cursor = yaslcpy(cursor, "0");
+    }
+
+    yaslfree(cursor);
+    return retval;
 }
 
+/* Memory use and key counts for each node. */
+ucl_object_t *
+redis_vdb_stats(VDB *vdb) {
+    ucl_object_t *stats, *node;
+    urclHandle *  conn;
+    redisReply *  res;
+    const char *  fields[] = {"used_memory", "used_memory_rss",
+            "used_memory_peak", "maxmemory", NULL};
+    const char *  p;
+    yastr         name, field;
+    size_t        n, i;
+
+    stats = ucl_object_typed_new(UCL_OBJECT);
+
+    for (n = 0; n < vdb->redis->nnodes; n++) {
+        if ((conn = redis_vdb_node(vdb, n)) == NULL) {
+            continue;
+        }
+        node = ucl_object_typed_new(UCL_OBJECT);
+
+        res = urcl_command(conn, "simvacation", "INFO memory");
+        if (res && (res->type == REDIS_REPLY_STRING)) {
+            for (i = 0; fields[ i ]; i++) {
+                field = yaslcatprintf(yaslempty(), "\n%s:", fields[ i ]);
+                if ((p = strstr(res->str, field)) != NULL) {
+                    ucl_object_insert_key(node,
+                            ucl_object_fromint(strtoll(
+                                    p + yasllen(field), NULL, 10)),
+                            fields[ i ], 0, false);
+                }
+                yaslfree(field);
+            }
+        }
+        urcl_free_result(res);
+
+        redis_vdb_stats_int(
+                node, "keys", urcl_command(conn, "simvacation", "DBSIZE"));
+
+        name = yaslcatprintf(yaslempty(), "%s:%d", vdb->redis->nodes[ n ].host,
+                vdb->redis->nodes[ n ].port);
+        ucl_object_insert_key(stats, node, name, 0, true);
+        yaslfree(name);
+    }
+
+    return stats;
+}
+
+static void
+redis_vdb_stats_int(ucl_object_t *stats, const char *key, redisReply *res) {
+    if (res && (res->type == REDIS_REPLY_INTEGER)) {
+        ucl_object_insert_key(
+                stats, ucl_object_fromint(res->integer), key, 0, false);
+    }
+    urcl_free_result(res);
+}
+
+static struct vdb_entry *
+redis_vdb_entries(redisReply *res, size_t *nentries) {
+    struct vdb_entry *entries;
+    redisReply **     e;
+    size_t            i;
+
+    if ((res == NULL) || (res->type != REDIS_REPLY_ARRAY) ||
+            (res->elements % 4 != 0)) {
+        return NULL;
+    }
+
+    *nentries = res->elements / 4;
+    if ((entries = calloc(*nentries + 1, sizeof(struct vdb_entry))) == NULL) {
+        syslog(LOG_ALERT, "redis vdb_walk: calloc: %m");
+        return NULL;
+    }
+
+    for (i = 0; i < *nentries; i++) {
+        e = res->element + (i * 4);
+        entries[ i ].rcpt = yaslnew(e[ 0 ]->str, e[ 0 ]->len);
+        entries[ i ].fp = yaslnew(e[ 1 ]->str, e[ 1 ]->len);
+        entries[ i ].ts = strtoll(e[ 2 ]->str, NULL, 10);
+        entries[ i ].expires = strtoll(e[ 3 ]->str, NULL, 10);
+    }
+
+    return entries;
+}
+
+/* Entries are grouped by the node that owns their recipient and sent to it
+ * in a single script call. The script writes keys it isn't given, so like
+ * walking this is only for standalone servers.
+ */
+vac_result
+redis_vdb_load(VDB *vdb, const struct vdb_entry *entries, size_t n) {
+    yastr *     pages;
+    urclHandle *conn;
+    redisReply *res;
+    size_t      i, node;
+    time_t      interval;
+    vac_result  retval = VAC_RESULT_OK;
+
+    if ((pages = calloc(vdb->redis->nnodes, sizeof(yastr))) == NULL) {
+        syslog(LOG_ALERT, "redis vdb_load: calloc: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    interval = (time_t)ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, "core.interval"));
+
+    for (i = 0; i < n; i++) {
+        node = redis_vdb_owner(vdb, entries[ i ].rcpt);
+        if (pages[ node ] == NULL) {
+            pages[ node ] = yaslempty();
+        }
+        pages[ node ] = yaslcatprintf(pages[ node ], "%s\t%s\t%lld\t%lld\n",
+                entries[ i ].rcpt, entries[ i ].fp,
+                (long long)entries[ i ].ts,
+                (long long)(entries[ i ].expires ? entries[ i ].expires
+                                                 : entries[ i ].ts + interval));
+    }
+
+    for (node = 0; node < vdb->redis->nnodes; node++) {
+        if (pages[ node ] == NULL) {
+            continue;
+        }
+        if (((conn = redis_vdb_node(vdb, node)) == NULL) ||
+                !redis_vdb_standalone(conn, "vdb_load")) {
+            retval = VAC_RESULT_TEMPFAIL;
+        } else {
+            res = urcl_command(conn, pages[ node ], "EVAL %s 0 %s %s",
+                    redis_vdb_load_script,
+                    redis_vdb_hash_layout() ? "hash" : "keys", pages[ node ]);
+            if ((res == NULL) || (res->type == REDIS_REPLY_ERROR)) {
+                syslog(LOG_ALERT, "redis vdb_load: EVAL failed: %s",
+                        res ? res->str : "no reply");
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+            urcl_free_result(res);
+        }
+        yaslfree(pages[ node ]);
+    }
+
+    free(pages);
+    return retval;
+}
+
+static bool
+redis_vdb_hash_layout(void) {
+    const char *layout;
+
+    layout = ucl_object_tostring(
+            ucl_object_lookup_path(vac_config, "redis.layout"));
+    return layout && (strcasecmp(layout, "hash") == 0);
+}
+
+static bool
+redis_vdb_legacy_keys(void) {
+    return ucl_object_toboolean(
+            ucl_object_lookup_path(vac_config, "redis.legacy_keys"));
+}
+
+static int
+redis_vdb_batch(void) {
+    int64_t batch;
+
+    if ((batch = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "redis.batch"))) < 1) {
+        batch = 1;
+    }
+
+    return batch;
+}
+
+/* The digest of the store script, which names it for EVALSHA. */
+static const char *
+redis_vdb_store_sha(void) {
+    static char sha[ (SHA1_LEN * 2) + 1 ];
+    uint8_t     digest[ SHA1_LEN ];
+    int         i;
+
+    if (sha[ 0 ] == '\0') {
+        sha1(redis_vdb_store_script, strlen(redis_vdb_store_script), digest);
+        for (i = 0; i < SHA1_LEN; i++) {
+            snprintf(sha + (i * 2), 3, "%02x", digest[ i ]);
+        }
+    }
+
+    return sha;
+}
+
+/* The string key layout uses the recipient as a hash tag, like the hash
+ * layout, so that all of a recipient's keys land on the same cluster node.
+ */
 static yastr
-redis_vdb_key(const yastr rcpt, const yastr from) {
-    yastr key = yaslauto("simvacation:user:");
-    key = yaslcatprintf(
-            key, "%s:%lx", rcpt, (long)rabin_fingerprint(from, yasllen(from)));
+redis_vdb_key(const yastr rcpt, const yastr fp) {
+    yastr key = yaslauto("simvacation:user:{");
+    key = yaslcatprintf(key, "%s}:%s", rcpt, fp);
     syslog(LOG_DEBUG, "redis_vdb_key: %s", key);
 
     return key;
 }
+
+/* The key used by the string key layout before it had a hash tag. These
+ * were stored with a seven day expiry and aren't in any recipient's expiry
+ * set, so they're only looked up, walked and left to expire.
+ */
+static yastr
+redis_vdb_legacy_key(const yastr rcpt, const yastr fp) {
+    return yaslcatprintf(yaslauto("simvacation:user:"), "%s:%s", rcpt, fp);
+}
+
+/* The hash layout keeps one hash per recipient mapping sender fingerprints to
+ * timestamps, with a companion sorted set that scores the same fingerprints by
+ * expiry time. The recipient is used as a hash tag so that both keys land on
+ * the same cluster node.
+ */
+static yastr
+redis_vdb_hash_key(const yastr rcpt, const char *type) {
+    yastr key = yaslauto("simvacation:{");
+    key = yaslcatprintf(key, "%s}:%s", rcpt, type);
+    syslog(LOG_DEBUG, "redis_vdb_hash_key: %s", key);
+
+    return key;
+}
+
+/* Extracts the recipient from one of its hash layout or expiry keys. */
+static yastr
+redis_vdb_key_rcpt(redisReply *key, const char *type) {
+    size_t prefix = strlen("simvacation:{");
+    size_t suffix = strlen(type) + 2;
+
+    if ((key->type != REDIS_REPLY_STRING) || (key->len <= prefix + suffix) ||
+            (strncmp(key->str, "simvacation:{", prefix) != 0) ||
+            (strncmp(key->str + key->len - suffix, "}:", 2) != 0) ||
+            (strcmp(key->str + key->len - suffix + 2, type) != 0)) {
+        return NULL;
+    }
+
+    return yaslnew(key->str + prefix, key->len - prefix - suffix);
+}
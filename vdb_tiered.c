@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+#include "vjournal.h"
+#include "vutil.h"
+
+/* A host-local backend (tiered.local) in front of a shared one
+ * (tiered.remote). Replies are written to both, and a lookup that the local
+ * tier can answer positively never reaches the remote one; misses still go
+ * to the remote tier, since the reply may have been sent from another host.
+ *
+ * With tiered.journal set, an unreachable remote tier doesn't stop replies.
+ * Lookups are answered by the local tier alone and replies are journalled,
+ * to be replayed into the remote tier once it is back. A failed connection
+ * is recorded in the journal directory, so that other deliveries back off
+ * instead of all retrying it at once.
+ */
+
+#define TIERED_DOWN "down"
+#define TIERED_REPLAY_LOCK "replay.lock"
+#define TIERED_REPLAY_POS "replay.pos"
+
+static struct vdb_backend *tiered_vdb_backend(const char *);
+static bool                tiered_vdb_backoff(VDB *);
+static void                tiered_vdb_down(VDB *);
+static vac_result tiered_vdb_journal(VDB *, const yastr, time_t);
+static void       tiered_vdb_replay(VDB *, double);
+static time_t     tiered_vdb_config(const char *);
+
+VDB *
+tiered_vdb_init(const yastr rcpt) {
+    VDB *       vdb;
+    const char *journal;
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "tiered vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->tiered = calloc(1, sizeof(struct vdb_tiered))) == NULL) {
+        syslog(LOG_ALERT, "tiered vdb_init: calloc: %m");
+        goto error;
+    }
+
+    vdb->rcpt = yaslauto(rcpt);
+
+    if (((journal = ucl_object_tostring(ucl_object_lookup_path(
+                  vac_config, "tiered.journal"))) != NULL) &&
+            (*journal != '\0')) {
+        vdb->tiered->journal = yaslauto(journal);
+        if (tiered_vdb_config("tiered.journal_span") < 1) {
+            syslog(LOG_ERR, "tiered vdb_init: tiered.journal_span must be at "
+                            "least 1s");
+            goto error;
+        }
+    }
+
+    if ((vdb->tiered->remote_backend = tiered_vdb_backend("tiered.remote")) ==
+            NULL) {
+        goto error;
+    }
+
+    if (vdb->tiered->journal == NULL) {
+        if ((vdb->tiered->remote = vdb->tiered->remote_backend->init(rcpt)) ==
+                NULL) {
+            goto error;
+        }
+    } else if (tiered_vdb_backoff(vdb)) {
+        syslog(LOG_INFO, "tiered vdb_init: remote tier is down, not retrying "
+                         "yet");
+    } else if ((vdb->tiered->remote = vdb->tiered->remote_backend->init(
+                        rcpt)) == NULL) {
+        tiered_vdb_down(vdb);
+    }
+
+    /* The local tier is only an optimisation, so carry on without it. */
+    if (((vdb->tiered->local_backend = tiered_vdb_backend("tiered.local")) !=
+                NULL) &&
+            ((vdb->tiered->local = vdb->tiered->local_backend->init(rcpt)) ==
+                    NULL)) {
+        syslog(LOG_NOTICE, "tiered vdb_init: continuing without local tier");
+    }
+
+    /* Unless it's all there is. */
+    if ((vdb->tiered->remote == NULL) && (vdb->tiered->local == NULL)) {
+        syslog(LOG_ALERT, "tiered vdb_init: no tier is available");
+        goto error;
+    }
+
+    return vdb;
+
+error:
+    tiered_vdb_close(vdb);
+    return NULL;
+}
+
+static struct vdb_backend *
+tiered_vdb_backend(const char *key) {
+    const char *provider;
+
+    if ((provider = ucl_object_tostring(
+                 ucl_object_lookup_path(vac_config, key))) == NULL) {
+        syslog(LOG_ALERT, "tiered vdb_init: %s is not set", key);
+        return NULL;
+    }
+
+    if (strcasecmp(provider, "tiered") == 0) {
+        syslog(LOG_ALERT, "tiered vdb_init: %s cannot be tiered", key);
+        return NULL;
+    }
+
+    return vdb_backend(provider);
+}
+
+void
+tiered_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->tiered) {
+            /* Deliveries that find the remote tier back chip away at the
+             * journal once they are done, for a bounded time, so that it
+             * doesn't hold up the reply.
+             */
+            if (vdb->tiered->remote && vdb->tiered->pending) {
+                tiered_vdb_replay(vdb,
+                        ucl_object_todouble(ucl_object_lookup_path(
+                                vac_config, "tiered.replay_time")));
+            }
+            if (vdb->tiered->local) {
+                vdb->tiered->local_backend->close(vdb->tiered->local);
+            }
+            if (vdb->tiered->remote) {
+                vdb->tiered->remote_backend->close(vdb->tiered->remote);
+            }
+            free(vdb->tiered->local_backend);
+            free(vdb->tiered->remote_backend);
+            yaslfree(vdb->tiered->journal);
+            free(vdb->tiered);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+tiered_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    if (vdb->tiered->local && (vdb->tiered->local_backend->recent(
+                                       vdb->tiered->local, from, interval) ==
+                                      VDB_STATUS_RECENT)) {
+        return VDB_STATUS_RECENT;
+    }
+
+    if (vdb->tiered->remote == NULL) {
+        return VDB_STATUS_OK;
+    }
+
+    /* A remote hit isn't copied into the local tier: we don't know when the
+     * reply was actually sent, and stamping it with the current time would
+     * extend the suppression.
+     */
+    return vdb->tiered->remote_backend->recent(
+            vdb->tiered->remote, from, interval);
+}
+
+vac_result
+tiered_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    vac_result retval = VAC_RESULT_TEMPFAIL;
+
+    if (vdb->tiered->remote) {
+        retval = vdb->tiered->remote_backend->store_reply(
+                vdb->tiered->remote, from, interval);
+        if ((retval != VAC_RESULT_OK) && vdb->tiered->journal) {
+            tiered_vdb_down(vdb);
+        }
+    }
+
+    if ((retval != VAC_RESULT_OK) && vdb->tiered->journal) {
+        retval = tiered_vdb_journal(vdb, from, interval);
+    }
+
+    if (vdb->tiered->local &&
+            (vdb->tiered->local_backend->store_reply(
+                     vdb->tiered->local, from, interval) != VAC_RESULT_OK)) {
+        syslog(LOG_NOTICE, "tiered vdb_store_reply: local tier failed");
+    }
+
+    return retval;
+}
+
+vac_result
+tiered_vdb_get_names(VDB *vdb, size_t batch, vdb_names_cb cb, void *ctx) {
+    if (vdb->tiered->remote == NULL) {
+        return VAC_RESULT_OK;
+    }
+    return vdb->tiered->remote_backend->get_names(
+            vdb->tiered->remote, batch, cb, ctx);
+}
+
+ucl_object_t *
+tiered_vdb_stats(VDB *vdb) {
+    ucl_object_t *stats;
+
+    stats = ucl_object_typed_new(UCL_OBJECT);
+    if (vdb->tiered->local) {
+        ucl_object_insert_key(stats,
+                vdb->tiered->local_backend->stats(vdb->tiered->local), "local",
+                0, false);
+    }
+    if (vdb->tiered->remote) {
+        ucl_object_insert_key(stats,
+                vdb->tiered->remote_backend->stats(vdb->tiered->remote),
+                "remote", 0, false);
+    }
+    ucl_object_insert_key(stats, ucl_object_frombool(vdb->tiered->pending),
+            "degraded", 0, false);
+    return stats;
+}
+
+void
+tiered_vdb_clean(VDB *vdb, const yastr user) {
+    if (vdb->tiered->local) {
+        vdb->tiered->local_backend->clean(vdb->tiered->local, user);
+    }
+    if (vdb->tiered->remote) {
+        vdb->tiered->remote_backend->clean(vdb->tiered->remote, user);
+    }
+}
+
+void
+tiered_vdb_gc(VDB *vdb) {
+    time_t now;
+
+    if (vdb->tiered->local) {
+        vdb->tiered->local_backend->gc(vdb->tiered->local);
+    }
+
+    if (vdb->tiered->remote == NULL) {
+        return;
+    }
+
+    vdb->tiered->remote_backend->gc(vdb->tiered->remote);
+
+    if (vdb->tiered->journal) {
+        /* Catch up on everything the deliveries haven't replayed. */
+        tiered_vdb_replay(vdb, -1);
+
+        if ((now = time(NULL)) >= 0) {
+            vjournal_expire(vdb->tiered->journal,
+                    tiered_vdb_config("tiered.journal_span"),
+                    now - tiered_vdb_config("core.interval"));
+        }
+    }
+}
+
+vac_result
+tiered_vdb_compact(VDB *vdb) {
+    vac_result retval = VAC_RESULT_OK;
+
+    if (vdb->tiered->local) {
+        retval = vdb->tiered->local_backend->compact(vdb->tiered->local);
+    }
+    if (vdb->tiered->remote &&
+            (vdb->tiered->remote_backend->compact(vdb->tiered->remote) !=
+                    VAC_RESULT_OK)) {
+        retval = VAC_RESULT_TEMPFAIL;
+    }
+
+    return retval;
+}
+
+/* Returns true if a recent failure means the remote tier shouldn't be tried
+ * yet. The failure record also says whether there are journalled replies
+ * that haven't been replayed.
+ */
+static bool
+tiered_vdb_backoff(VDB *vdb) {
+    FILE *    f;
+    long long retry, failures;
+    time_t    now;
+    yastr     path;
+    bool      retval = false;
+
+    path = yaslcatprintf(
+            yaslempty(), "%s/" TIERED_DOWN, vdb->tiered->journal);
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "tiered vdb_init fopen %s: %m", path);
+        }
+        yaslfree(path);
+        return false;
+    }
+
+    vdb->tiered->pending = true;
+
+    if ((fscanf(f, "%lld %lld", &retry, &failures) == 2) &&
+            ((now = time(NULL)) >= 0) && (now < retry)) {
+        retval = true;
+    }
+
+    fclose(f);
+    yaslfree(path);
+    return retval;
+}
+
+/* Records a failure to reach the remote tier, doubling the time until the
+ * next attempt. Concurrent failures may overwrite each other, which at
+ * worst loses a doubling.
+ */
+static void
+tiered_vdb_down(VDB *vdb) {
+    FILE *    f;
+    long long retry, failures = 0;
+    time_t    now, delay;
+    yastr     path, tmp;
+
+    vdb->tiered->pending = true;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ERR, "tiered vdb_down time: %m");
+        return;
+    }
+
+    if ((mkdir(vdb->tiered->journal, 0775) != 0) && (errno != EEXIST)) {
+        syslog(LOG_ERR, "tiered vdb_down mkdir %s: %m", vdb->tiered->journal);
+        return;
+    }
+
+    path = yaslcatprintf(
+            yaslempty(), "%s/" TIERED_DOWN, vdb->tiered->journal);
+    tmp = yaslcatprintf(yaslempty(), "%s.%d", path, (int)getpid());
+
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fscanf(f, "%lld %lld", &retry, &failures) != 2) {
+            failures = 0;
+        }
+        fclose(f);
+    }
+
+    delay = tiered_vdb_config("tiered.backoff");
+    for (; (failures > 0) && (delay < tiered_vdb_config("tiered.backoff_max"));
+            failures--) {
+        delay *= 2;
+    }
+    delay = MIN(delay, tiered_vdb_config("tiered.backoff_max"));
+
+    syslog(LOG_WARNING,
+            "tiered: remote tier is unreachable, journalling replies and "
+            "retrying in %llds",
+            (long long)delay);
+
+    if ((f = fopen(tmp, "w")) == NULL) {
+        syslog(LOG_ERR, "tiered vdb_down fopen %s: %m", tmp);
+    } else {
+        fprintf(f, "%lld %lld\n", (long long)(now + delay),
+                (long long)(failures + 1));
+        if (fclose(f) != 0) {
+            syslog(LOG_ERR, "tiered vdb_down fclose %s: %m", tmp);
+            unlink(tmp);
+        } else if (rename(tmp, path) != 0) {
+            syslog(LOG_ERR, "tiered vdb_down rename %s: %m", tmp);
+            unlink(tmp);
+        }
+    }
+
+    yaslfree(path);
+    yaslfree(tmp);
+}
+
+static vac_result
+tiered_vdb_journal(VDB *vdb, const yastr from, time_t interval) {
+    struct vdb_entry entry;
+    vac_result       retval;
+
+    if ((entry.ts = time(NULL)) < 0) {
+        syslog(LOG_ERR, "tiered vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    entry.rcpt = vdb->rcpt;
+    entry.fp = vdb_fingerprint(from);
+    entry.expires = entry.ts + interval;
+
+    retval = vjournal_append(vdb->tiered->journal,
+            tiered_vdb_config("tiered.journal_span"), &entry, 1);
+
+    yaslfree(entry.fp);
+    return retval;
+}
+
+/* Replays batches of journalled replies into the remote tier until it has
+ * caught up, or once limit seconds have passed unless it's negative. Only one
+ * process replays at a time; the others don't wait for it. Once the journal
+ * has been caught up with the failure record is removed, which stops further
+ * deliveries from looking.
+ */
+static void
+tiered_vdb_replay(VDB *vdb, double limit) {
+    int                 fd;
+    int64_t             batch;
+    size_t              n, i, live, replayed = 0;
+    time_t              now, span;
+    double              start;
+    bool                caught_up = false;
+    yastr               path;
+    struct vjournal_pos pos;
+    struct vdb_entry *  entries;
+    vac_result          rc = VAC_RESULT_OK;
+
+    path = yaslcatprintf(
+            yaslempty(), "%s/" TIERED_REPLAY_LOCK, vdb->tiered->journal);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0664)) < 0) {
+        syslog(LOG_ERR, "tiered vdb_replay open %s: %m", path);
+        yaslfree(path);
+        return;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "tiered vdb_replay flock %s: %m", path);
+        }
+        close(fd);
+        yaslfree(path);
+        return;
+    }
+
+    yaslclear(path);
+    path = yaslcatprintf(path, "%s/" TIERED_REPLAY_POS, vdb->tiered->journal);
+
+    span = tiered_vdb_config("tiered.journal_span");
+    if ((batch = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "tiered.replay_batch"))) < 1) {
+        batch = 1;
+    }
+    start = monotonic_seconds();
+
+    if ((vjournal_pos_load(path, &pos) != VAC_RESULT_OK) ||
+            ((entries = calloc(batch, sizeof(struct vdb_entry))) == NULL)) {
+        close(fd);
+        yaslfree(path);
+        return;
+    }
+
+    for (;;) {
+        if (((rc = vjournal_read(vdb->tiered->journal, span, &pos, entries,
+                      batch, &n)) != VAC_RESULT_OK) ||
+                ((now = time(NULL)) < 0)) {
+            rc = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        /* Replies that have already expired don't need to be sent. */
+        for (i = 0, live = 0; i < n; i++) {
+            if (entries[ i ].expires > now) {
+                entries[ live++ ] = entries[ i ];
+            } else {
+                yaslfree(entries[ i ].rcpt);
+                yaslfree(entries[ i ].fp);
+            }
+        }
+
+        if (live > 0) {
+            rc = vdb->tiered->remote_backend->load(
+                    vdb->tiered->remote, entries, live);
+        }
+
+        for (i = 0; i < live; i++) {
+            yaslfree(entries[ i ].rcpt);
+            yaslfree(entries[ i ].fp);
+        }
+
+        if ((rc != VAC_RESULT_OK) ||
+                ((rc = vjournal_pos_save(path, &pos)) != VAC_RESULT_OK)) {
+            break;
+        }
+
+        replayed += live;
+
+        if (n < (size_t)batch) {
+            caught_up = true;
+            break;
+        }
+
+        if ((limit >= 0) && (monotonic_seconds() - start >= limit)) {
+            break;
+        }
+    }
+
+    if (replayed > 0) {
+        syslog(LOG_INFO, "tiered vdb_replay: replayed %zu replies", replayed);
+    }
+
+    /* The journal has been caught up with, so deliveries can stop looking.
+     * Any that were still backing off may journal a few more replies after
+     * this; simunvacation replays those.
+     */
+    if (caught_up) {
+        yaslclear(path);
+        path = yaslcatprintf(path, "%s/" TIERED_DOWN, vdb->tiered->journal);
+        if ((unlink(path) != 0) && (errno != ENOENT)) {
+            syslog(LOG_ERR, "tiered vdb_replay unlink %s: %m", path);
+        }
+        vdb->tiered->pending = false;
+    }
+
+    free(entries);
+    close(fd);
+    yaslfree(path);
+}
+
+static time_t
+tiered_vdb_config(const char *key) {
+    return (time_t)ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, key));
+}
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+#include "vjournal.h"
+
+/* Takes the write to another backend (writebehind.backend) off the delivery
+ * path. A reply is appended to a journal in writebehind.path, which is a
+ * single local write, and a background flusher loads the journal into the
+ * backend in batches. The journal outlives a delivery or flusher that dies;
+ * the flusher records how far it has got, and loading the same replies twice
+ * is harmless. It isn't fsynced, so replies queued just before the host
+ * itself goes down can be lost, which at worst means a duplicate reply.
+ *
+ * A delivery that queues a reply starts a flusher as it exits, unless one is
+ * already running. Counts of queued and flushed replies are kept in a small
+ * shared file, and once writebehind.max_pending replies are waiting,
+ * deliveries write directly to the backend instead, so the queue is bounded.
+ *
+ * Lookups go straight to the backend and don't see queued replies. Putting
+ * this behind a tiered VDB's local cache (tiered.remote = writebehind)
+ * covers the gap.
+ */
+
+#define WRITEBEHIND_QUEUE "queue"
+#define WRITEBEHIND_LOCK "flush.lock"
+#define WRITEBEHIND_POS "flush.pos"
+
+struct writebehind_queue {
+    uint64_t submitted;
+    uint64_t flushed;
+    uint8_t  pad[ 48 ];
+};
+
+static uint64_t   writebehind_vdb_pending(VDB *);
+static void       writebehind_vdb_spawn(VDB *);
+static int        writebehind_vdb_lock(VDB *);
+static void       writebehind_vdb_drain(VDB *, VDB *, int);
+static vac_result writebehind_vdb_flush(VDB *, VDB *);
+static time_t     writebehind_vdb_config(const char *);
+
+VDB *
+writebehind_vdb_init(const yastr rcpt) {
+    VDB *       vdb;
+    const char *provider, *path;
+    yastr       queue;
+    size_t      len;
+
+    if ((vdb = calloc(1, sizeof(VDB))) == NULL) {
+        syslog(LOG_ALERT, "writebehind vdb_init: calloc: %m");
+        return NULL;
+    }
+
+    if ((vdb->writebehind = calloc(1, sizeof(struct vdb_writebehind))) ==
+            NULL) {
+        syslog(LOG_ALERT, "writebehind vdb_init: calloc: %m");
+        goto error;
+    }
+
+    vdb->rcpt = yaslauto(rcpt);
+
+    if ((path = ucl_object_tostring(ucl_object_lookup_path(
+                 vac_config, "writebehind.path"))) == NULL) {
+        syslog(LOG_ALERT, "writebehind vdb_init: no path configured");
+        goto error;
+    }
+    vdb->writebehind->path = yaslauto(path);
+
+    if (writebehind_vdb_config("writebehind.segment_span") < 1) {
+        syslog(LOG_ERR, "writebehind vdb_init: writebehind.segment_span must "
+                        "be at least 1s");
+        goto error;
+    }
+
+    if ((mkdir(path, 0775) != 0) && (errno != EEXIST)) {
+        syslog(LOG_ALERT, "writebehind vdb_init mkdir %s: %m", path);
+        goto error;
+    }
+
+    queue = yaslcatprintf(yaslempty(), "%s/" WRITEBEHIND_QUEUE, path);
+    vdb->writebehind->queue = vdb_mmap_file(
+            queue, sizeof(struct writebehind_queue), &len);
+    yaslfree(queue);
+    if (vdb->writebehind->queue == NULL) {
+        goto error;
+    }
+    if (len < sizeof(struct writebehind_queue)) {
+        syslog(LOG_ALERT, "writebehind vdb_init: %s/" WRITEBEHIND_QUEUE
+                          " is too short",
+                path);
+        munmap(vdb->writebehind->queue, len);
+        vdb->writebehind->queue = NULL;
+        goto error;
+    }
+
+    if ((provider = ucl_object_tostring(ucl_object_lookup_path(
+                 vac_config, "writebehind.backend"))) == NULL) {
+        syslog(LOG_ALERT, "writebehind vdb_init: writebehind.backend is not "
+                          "set");
+        goto error;
+    }
+
+    if (strcasecmp(provider, "writebehind") == 0) {
+        syslog(LOG_ALERT, "writebehind vdb_init: writebehind.backend cannot "
+                          "be writebehind");
+        goto error;
+    }
+
+    if (((vdb->writebehind->backend = vdb_backend(provider)) == NULL) ||
+            ((vdb->writebehind->inner = vdb->writebehind->backend->init(
+                      rcpt)) == NULL)) {
+        goto error;
+    }
+
+    return vdb;
+
+error:
+    writebehind_vdb_close(vdb);
+    return NULL;
+}
+
+void
+writebehind_vdb_close(VDB *vdb) {
+    if (vdb) {
+        if (vdb->writebehind) {
+            if (vdb->writebehind->inner) {
+                vdb->writebehind->backend->close(vdb->writebehind->inner);
+            }
+            /* The reply has been sent by now, so the flusher can start. */
+            if (vdb->writebehind->submitted) {
+                writebehind_vdb_spawn(vdb);
+            }
+            if (vdb->writebehind->queue) {
+                munmap(vdb->writebehind->queue,
+                        sizeof(struct writebehind_queue));
+            }
+            free(vdb->writebehind->backend);
+            yaslfree(vdb->writebehind->path);
+            free(vdb->writebehind);
+        }
+        yaslfree(vdb->rcpt);
+        free(vdb);
+    }
+}
+
+vdb_status
+writebehind_vdb_recent(VDB *vdb, const yastr from, time_t interval) {
+    return vdb->writebehind->backend->recent(
+            vdb->writebehind->inner, from, interval);
+}
+
+vac_result
+writebehind_vdb_store_reply(VDB *vdb, const yastr from, time_t interval) {
+    struct vdb_entry entry;
+    vac_result       retval;
+
+    if (writebehind_vdb_pending(vdb) >=
+            (uint64_t)ucl_object_toint(ucl_object_lookup_path(
+                    vac_config, "writebehind.max_pending"))) {
+        syslog(LOG_NOTICE,
+                "writebehind vdb_store_reply: queue is full, writing directly");
+        return vdb->writebehind->backend->store_reply(
+                vdb->writebehind->inner, from, interval);
+    }
+
+    if ((entry.ts = time(NULL)) < 0) {
+        syslog(LOG_ALERT, "writebehind vdb_store_reply time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    entry.rcpt = vdb->rcpt;
+    entry.fp = vdb_fingerprint(from);
+    entry.expires = entry.ts + interval;
+
+    retval = vjournal_append(vdb->writebehind->path,
+            writebehind_vdb_config("writebehind.segment_span"), &entry, 1);
+    yaslfree(entry.fp);
+
+    if (retval != VAC_RESULT_OK) {
+        return vdb->writebehind->backend->store_reply(
+                vdb->writebehind->inner, from, interval);
+    }
+
+    __atomic_add_fetch(&vdb->writebehind->queue->submitted, 1,
+            __ATOMIC_RELEASE);
+    vdb->writebehind->submitted = true;
+
+    return VAC_RESULT_OK;
+}
+
+vac_result
+writebehind_vdb_get_names(VDB *vdb, size_t batch, vdb_names_cb cb, void *ctx) {
+    return vdb->writebehind->backend->get_names(
+            vdb->writebehind->inner, batch, cb, ctx);
+}
+
+ucl_object_t *
+writebehind_vdb_stats(VDB *vdb) {
+    ucl_object_t *stats;
+
+    stats = vdb->writebehind->backend->stats(vdb->writebehind->inner);
+    ucl_object_insert_key(stats,
+            ucl_object_fromint(writebehind_vdb_pending(vdb)), "pending", 0,
+            false);
+    return stats;
+}
+
+void
+writebehind_vdb_clean(VDB *vdb, const yastr user) {
+    vdb->writebehind->backend->clean(vdb->writebehind->inner, user);
+}
+
+void
+writebehind_vdb_gc(VDB *vdb) {
+    time_t now;
+    int    lock;
+
+    /* Flush anything left behind by a flusher that failed. */
+    if ((lock = writebehind_vdb_lock(vdb)) >= 0) {
+        writebehind_vdb_drain(vdb, vdb->writebehind->inner, lock);
+    }
+
+    vdb->writebehind->backend->gc(vdb->writebehind->inner);
+
+    if ((now = time(NULL)) >= 0) {
+        vjournal_expire(vdb->writebehind->path,
+                writebehind_vdb_config("writebehind.segment_span"),
+                now - writebehind_vdb_config("core.interval"));
+    }
+}
+
+vac_result
+writebehind_vdb_compact(VDB *vdb) {
+    return vdb->writebehind->backend->compact(vdb->writebehind->inner);
+}
+
+static uint64_t
+writebehind_vdb_pending(VDB *vdb) {
+    uint64_t submitted, flushed;
+
+    flushed = __atomic_load_n(&vdb->writebehind->queue->flushed,
+            __ATOMIC_ACQUIRE);
+    submitted = __atomic_load_n(&vdb->writebehind->queue->submitted,
+            __ATOMIC_ACQUIRE);
+
+    return (submitted > flushed) ? submitted - flushed : 0;
+}
+
+/* Starts a detached flusher. It has its own connection to the backend, and
+ * doesn't hold on to the MTA's descriptors, so the delivery isn't kept
+ * waiting for it. The flusher's lock is taken before forking and handed to
+ * the child, so a delivery that finds a flusher already running does
+ * nothing.
+ */
+static void
+writebehind_vdb_spawn(VDB *vdb) {
+    pid_t pid;
+    int   fd, lock;
+    VDB * inner;
+
+    if ((lock = writebehind_vdb_lock(vdb)) < 0) {
+        return;
+    }
+
+    if ((pid = fork()) < 0) {
+        syslog(LOG_ERR, "writebehind: fork: %m");
+        close(lock);
+        return;
+    }
+
+    if (pid > 0) {
+        /* The child's copy of the descriptor keeps the lock held. */
+        close(lock);
+        return;
+    }
+
+    setsid();
+    if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2) {
+            close(fd);
+        }
+    }
+
+    if ((inner = vdb->writebehind->backend->init(vdb->rcpt)) != NULL) {
+        writebehind_vdb_drain(vdb, inner, lock);
+        vdb->writebehind->backend->close(inner);
+    }
+
+    _exit(0);
+}
+
+/* Returns a descriptor holding the flusher's lock, or -1 if another process
+ * has it.
+ */
+static int
+writebehind_vdb_lock(VDB *vdb) {
+    int   fd;
+    yastr path;
+
+    path = yaslcatprintf(
+            yaslempty(), "%s/" WRITEBEHIND_LOCK, vdb->writebehind->path);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0664)) < 0) {
+        syslog(LOG_ERR, "writebehind lock open %s: %m", path);
+    } else if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        if (errno != EWOULDBLOCK) {
+            syslog(LOG_ERR, "writebehind lock flock %s: %m", path);
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    yaslfree(path);
+    return fd;
+}
+
+/* Flushes until nothing is pending, or another flusher has taken over. The
+ * lock is released, and closed, on return.
+ */
+static void
+writebehind_vdb_drain(VDB *vdb, VDB *inner, int lock) {
+    vac_result rc;
+
+    for (;;) {
+        rc = writebehind_vdb_flush(vdb, inner);
+        close(lock);
+
+        /* A reply queued while the lock was held has seen it held and left
+         * the flushing to us, so look again once it has been released.
+         */
+        if ((rc != VAC_RESULT_OK) || (writebehind_vdb_pending(vdb) == 0) ||
+                ((lock = writebehind_vdb_lock(vdb)) < 0)) {
+            return;
+        }
+    }
+}
+
+/* Loads everything journalled since the last flush. The caller holds the
+ * flusher's lock.
+ */
+static vac_result
+writebehind_vdb_flush(VDB *vdb, VDB *inner) {
+    int64_t             batch;
+    size_t              n, i, live;
+    uint64_t            submitted;
+    time_t              now, span;
+    yastr               path;
+    struct vjournal_pos pos;
+    struct vdb_entry *  entries;
+    vac_result          retval = VAC_RESULT_OK;
+
+    path = yaslcatprintf(
+            yaslempty(), "%s/" WRITEBEHIND_POS, vdb->writebehind->path);
+
+    span = writebehind_vdb_config("writebehind.segment_span");
+    if ((batch = ucl_object_toint(ucl_object_lookup_path(
+                 vac_config, "writebehind.batch"))) < 1) {
+        batch = 1;
+    }
+
+    if (((retval = vjournal_pos_load(path, &pos)) != VAC_RESULT_OK) ||
+            ((entries = calloc(batch, sizeof(struct vdb_entry))) == NULL)) {
+        yaslfree(path);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    for (;;) {
+        /* Everything counted here was appended before it was counted, so a
+         * read that reaches the end of the journal has seen all of it.
+         */
+        submitted = __atomic_load_n(
+                &vdb->writebehind->queue->submitted, __ATOMIC_ACQUIRE);
+
+        if (((retval = vjournal_read(vdb->writebehind->path, span, &pos,
+                      entries, batch, &n)) != VAC_RESULT_OK) ||
+                ((now = time(NULL)) < 0)) {
+            retval = VAC_RESULT_TEMPFAIL;
+            break;
+        }
+
+        for (i = 0, live = 0; i < n; i++) {
+            if (entries[ i ].expires > now) {
+                entries[ live++ ] = entries[ i ];
+            } else {
+                yaslfree(entries[ i ].rcpt);
+                yaslfree(entries[ i ].fp);
+            }
+        }
+
+        if (live > 0) {
+            retval = vdb->writebehind->backend->load(inner, entries, live);
+        }
+
+        for (i = 0; i < live; i++) {
+            yaslfree(entries[ i ].rcpt);
+            yaslfree(entries[ i ].fp);
+        }
+
+        if ((retval != VAC_RESULT_OK) ||
+                ((retval = vjournal_pos_save(path, &pos)) != VAC_RESULT_OK)) {
+            syslog(LOG_ERR, "writebehind flush: failed, %llu replies pending",
+                    (unsigned long long)writebehind_vdb_pending(vdb));
+            break;
+        }
+
+        if (n < (size_t)batch) {
+            __atomic_store_n(&vdb->writebehind->queue->flushed, submitted,
+                    __ATOMIC_RELEASE);
+            break;
+        }
+
+        __atomic_add_fetch(
+                &vdb->writebehind->queue->flushed, n, __ATOMIC_RELEASE);
+    }
+
+    free(entries);
+    yaslfree(path);
+    return retval;
+}
+
+static time_t
+writebehind_vdb_config(const char *key) {
+    return (time_t)ucl_object_todouble(
+            ucl_object_lookup_path(vac_config, key));
+}
@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <config.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+#include "vjournal.h"
+
+/* A journal is a directory of append-only segment files, each named after
+ * the span of time it was written in. Records are the tab separated lines
+ * that simvacation-vdbtool exports, and a batch of them is written with a
+ * single O_APPEND write so that concurrent writers never interleave.
+ *
+ * Readers only consume whole lines, so a record that is still being written
+ * is picked up on the next read. A segment is left behind once its span is
+ * over (plus a grace period for writers that started just before the end),
+ * and whole segments are expired, so a reader that falls behind never has
+ * more to catch up on than the journal retains.
+ */
+
+#define VJOURNAL_SUFFIX ".journal"
+#define VJOURNAL_GRACE 60
+
+static int     vjournal_segment(const struct dirent *);
+static int64_t vjournal_next(const char *, int64_t);
+
+yastr
+vjournal_format(yastr buf, const struct vdb_entry *entry) {
+    return yaslcatprintf(buf, "%s\t%s\t%lld\t%lld\n", entry->rcpt, entry->fp,
+            (long long)entry->ts, (long long)entry->expires);
+}
+
+/* Parses a record with its newline removed. The line is modified. */
+vac_result
+vjournal_parse(char *line, struct vdb_entry *entry) {
+    char *fields[ 4 ];
+    char *p, *end;
+    int   i;
+
+    for (i = 0, p = line; (i < 4) && p; i++) {
+        fields[ i ] = strsep(&p, "\t");
+    }
+    if ((i < 4) || (p != NULL) || (*fields[ 0 ] == '\0') ||
+            (*fields[ 1 ] == '\0')) {
+        return VAC_RESULT_PERMFAIL;
+    }
+
+    entry->ts = strtoll(fields[ 2 ], &end, 10);
+    if ((end == fields[ 2 ]) || (*end != '\0')) {
+        return VAC_RESULT_PERMFAIL;
+    }
+    entry->expires = strtoll(fields[ 3 ], &end, 10);
+    if ((end == fields[ 3 ]) || (*end != '\0')) {
+        return VAC_RESULT_PERMFAIL;
+    }
+
+    entry->rcpt = yaslauto(fields[ 0 ]);
+    entry->fp = yaslauto(fields[ 1 ]);
+
+    return VAC_RESULT_OK;
+}
+
+vac_result
+vjournal_append(const char *dir, time_t span, const struct vdb_entry *entries,
+        size_t n) {
+    int        fd;
+    size_t     i;
+    ssize_t    rc;
+    time_t     now;
+    yastr      buf, path;
+    vac_result retval = VAC_RESULT_TEMPFAIL;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ERR, "vjournal_append time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    path = yaslcatprintf(yaslempty(), "%s/%lld" VJOURNAL_SUFFIX, dir,
+            (long long)(now / span));
+
+    if (((fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0664)) < 0) &&
+            (errno == ENOENT)) {
+        if ((mkdir(dir, 0775) != 0) && (errno != EEXIST)) {
+            syslog(LOG_ERR, "vjournal_append mkdir %s: %m", dir);
+            yaslfree(path);
+            return VAC_RESULT_TEMPFAIL;
+        }
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0664);
+    }
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "vjournal_append open %s: %m", path);
+        yaslfree(path);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    buf = yaslempty();
+    for (i = 0; i < n; i++) {
+        buf = vjournal_format(buf, entries + i);
+    }
+
+    if ((rc = write(fd, buf, yasllen(buf))) < 0) {
+        syslog(LOG_ERR, "vjournal_append write %s: %m", path);
+    } else if ((size_t)rc != yasllen(buf)) {
+        syslog(LOG_ERR, "vjournal_append write %s: short write", path);
+    } else {
+        retval = VAC_RESULT_OK;
+    }
+
+    if (close(fd) != 0) {
+        syslog(LOG_ERR, "vjournal_append close %s: %m", path);
+        retval = VAC_RESULT_TEMPFAIL;
+    }
+
+    yaslfree(buf);
+    yaslfree(path);
+    return retval;
+}
+
+/* Reads up to max records from pos onwards into entries, advancing pos past
+ * the records returned. The caller frees the strings in the entries.
+ */
+vac_result
+vjournal_read(const char *dir, time_t span, struct vjournal_pos *pos,
+        struct vdb_entry *entries, size_t max, size_t *n) {
+    FILE *     f;
+    char *     line = NULL;
+    size_t     cap = 0;
+    ssize_t    len;
+    int64_t    next;
+    time_t     now;
+    yastr      path;
+    vac_result retval = VAC_RESULT_OK;
+
+    *n = 0;
+
+    if ((now = time(NULL)) < 0) {
+        syslog(LOG_ERR, "vjournal_read time: %m");
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    path = yaslempty();
+
+    while ((*n < max) && (retval == VAC_RESULT_OK)) {
+        yaslclear(path);
+        path = yaslcatprintf(path, "%s/%lld" VJOURNAL_SUFFIX, dir,
+                (long long)pos->segment);
+
+        if ((f = fopen(path, "r")) != NULL) {
+            if (fseeko(f, pos->offset, SEEK_SET) != 0) {
+                syslog(LOG_ERR, "vjournal_read fseeko %s: %m", path);
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+
+            while ((retval == VAC_RESULT_OK) && (*n < max) &&
+                    ((len = getline(&line, &cap, f)) > 0)) {
+                /* The rest of this record hasn't been written yet. */
+                if (line[ len - 1 ] != '\n') {
+                    break;
+                }
+                pos->offset += len;
+                line[ len - 1 ] = '\0';
+
+                if (vjournal_parse(line, entries + *n) != VAC_RESULT_OK) {
+                    syslog(LOG_WARNING,
+                            "vjournal_read %s: skipping malformed record at "
+                            "%lld",
+                            path, (long long)(pos->offset - len));
+                    continue;
+                }
+                (*n)++;
+            }
+
+            if (ferror(f)) {
+                syslog(LOG_ERR, "vjournal_read %s: %m", path);
+                retval = VAC_RESULT_TEMPFAIL;
+            }
+            fclose(f);
+        } else if (errno != ENOENT) {
+            syslog(LOG_ERR, "vjournal_read fopen %s: %m", path);
+            retval = VAC_RESULT_TEMPFAIL;
+        }
+
+        /* Writers may still be adding to a segment whose span has only just
+         * finished, so don't leave it until they can't be.
+         */
+        if ((retval != VAC_RESULT_OK) || (*n == max) ||
+                ((pos->segment + 1) * span + VJOURNAL_GRACE > now) ||
+                ((next = vjournal_next(dir, pos->segment)) < 0)) {
+            break;
+        }
+
+        pos->segment = next;
+        pos->offset = 0;
+    }
+
+    free(line);
+    yaslfree(path);
+
+    if (retval != VAC_RESULT_OK) {
+        for (; *n > 0; (*n)--) {
+            yaslfree(entries[ *n - 1 ].rcpt);
+            yaslfree(entries[ *n - 1 ].fp);
+        }
+    }
+
+    return retval;
+}
+
+/* Removes the segments whose span finished before the given time. */
+void
+vjournal_expire(const char *dir, time_t span, time_t before) {
+    struct dirent **segments;
+    int             i, n;
+    yastr           path;
+
+    if ((n = scandir(dir, &segments, vjournal_segment, NULL)) < 0) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "vjournal_expire scandir %s: %m", dir);
+        }
+        return;
+    }
+
+    path = yaslempty();
+    for (i = 0; i < n; i++) {
+        if ((strtoll(segments[ i ]->d_name, NULL, 10) + 1) * span <= before) {
+            yaslclear(path);
+            path = yaslcatprintf(path, "%s/%s", dir, segments[ i ]->d_name);
+            syslog(LOG_DEBUG, "vjournal_expire: removing %s", path);
+            if ((unlink(path) != 0) && (errno != ENOENT)) {
+                syslog(LOG_ERR, "vjournal_expire unlink %s: %m", path);
+            }
+        }
+        free(segments[ i ]);
+    }
+    free(segments);
+    yaslfree(path);
+}
+
+vac_result
+vjournal_pos_load(const char *path, struct vjournal_pos *pos) {
+    FILE *     f;
+    long long  segment, offset;
+    vac_result retval = VAC_RESULT_OK;
+
+    pos->segment = 0;
+    pos->offset = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT) {
+            return VAC_RESULT_OK;
+        }
+        syslog(LOG_ERR, "vjournal_pos_load fopen %s: %m", path);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    if (fscanf(f, "%lld %lld", &segment, &offset) == 2) {
+        pos->segment = segment;
+        pos->offset = offset;
+    } else {
+        syslog(LOG_ERR, "vjournal_pos_load %s: malformed position", path);
+        retval = VAC_RESULT_PERMFAIL;
+    }
+
+    fclose(f);
+    return retval;
+}
+
+/* The position is replaced atomically, so a crash leaves either the old or
+ * the new one.
+ */
+vac_result
+vjournal_pos_save(const char *path, const struct vjournal_pos *pos) {
+    FILE *     f;
+    yastr      tmp;
+    vac_result retval = VAC_RESULT_TEMPFAIL;
+
+    tmp = yaslcatprintf(yaslauto(path), ".tmp");
+
+    if ((f = fopen(tmp, "w")) == NULL) {
+        syslog(LOG_ERR, "vjournal_pos_save fopen %s: %m", tmp);
+        yaslfree(tmp);
+        return VAC_RESULT_TEMPFAIL;
+    }
+
+    fprintf(f, "%lld %lld\n", (long long)pos->segment,
+            (long long)pos->offset);
+    if ((fflush(f) != 0) || ferror(f) || (fsync(fileno(f)) != 0)) {
+        syslog(LOG_ERR, "vjournal_pos_save write %s: %m", tmp);
+        fclose(f);
+    } else if (fclose(f) != 0) {
+        syslog(LOG_ERR, "vjournal_pos_save fclose %s: %m", tmp);
+    } else if (rename(tmp, path) != 0) {
+        syslog(LOG_ERR, "vjournal_pos_save rename %s: %m", tmp);
+    } else {
+        retval = VAC_RESULT_OK;
+    }
+
+    yaslfree(tmp);
+    return retval;
+}
+
+static int
+vjournal_segment(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+
+    return (len > strlen(VJOURNAL_SUFFIX)) &&
+           (strcmp(entry->d_name + len - strlen(VJOURNAL_SUFFIX),
+                    VJOURNAL_SUFFIX) == 0);
+}
+
+/* Returns the oldest segment after the given one, or -1 if there isn't
+ * one.
+ */
+static int64_t
+vjournal_next(const char *dir, int64_t after) {
+    struct dirent **segments;
+    int             i, n;
+    int64_t         segment, next = -1;
+
+    if ((n = scandir(dir, &segments, vjournal_segment, NULL)) < 0) {
+        if (errno != ENOENT) {
+            syslog(LOG_ERR, "vjournal_read scandir %s: %m", dir);
+        }
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        segment = strtoll(segments[ i ]->d_name, NULL, 10);
+        if ((segment > after) && ((next < 0) || (segment < next))) {
+            next = segment;
+        }
+        free(segments[ i ]);
+    }
+    free(segments);
+
+    return next;
+}
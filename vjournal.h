@@ -0,0 +1,28 @@
+#ifndef VJOURNAL_H
+#define VJOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "simvacation.h"
+#include "vdb.h"
+
+/* How far a reader has got through a journal: the segment it is in, and the
+ * byte offset of the next unread record.
+ */
+struct vjournal_pos {
+    int64_t segment;
+    int64_t offset;
+};
+
+yastr      vjournal_format(yastr, const struct vdb_entry *);
+vac_result vjournal_parse(char *, struct vdb_entry *);
+vac_result vjournal_append(
+        const char *, time_t, const struct vdb_entry *, size_t);
+vac_result vjournal_read(const char *, time_t, struct vjournal_pos *,
+        struct vdb_entry *, size_t, size_t *);
+void       vjournal_expire(const char *, time_t, time_t);
+vac_result vjournal_pos_load(const char *, struct vjournal_pos *);
+vac_result vjournal_pos_save(const char *, const struct vjournal_pos *);
+
+#endif /* VJOURNAL_H */
@@ -105,9 +105,16 @@ vlu_interval(VLU *vlu, const yastr rcpt) {
             ucl_object_lookup_path(vac_config, "core.interval"));
 }
 
+/* The name suppression state is kept under. Local parts are matched without
+ * regard to case, so neither is this.
+ */
 yastr
 vlu_name(VLU *vlu, const yastr rcpt) {
-    return yaslauto(rcpt);
+    yastr name;
+
+    name = yaslauto(rcpt);
+    yasltolower(name);
+    return name;
 }
 
 yastr
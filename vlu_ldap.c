@@ -392,6 +392,10 @@ ldap_vlu_interval(VLU *vlu, const yastr rcpt) {
     return vlu->ldap->interval;
 }
 
+/* The first RDN of the entry that matched: the uid for a person, however the
+ * recipient was spelled, and the cn for a group, written the way it is
+ * addressed ("some group" becomes "some.group").
+ */
 yastr
 ldap_vlu_name(VLU *vlu, const yastr rcpt) {
     char * dn;
@@ -402,11 +406,13 @@ ldap_vlu_name(VLU *vlu, const yastr rcpt) {
     if (ldap_str2dn(dn, &ldn, LDAP_DN_FORMAT_LDAPV3) != LDAP_SUCCESS) {
         syslog(LOG_ERR,
                 "Liberror: ldap_vlu_name ldap_str2dn: failed to parse %s", dn);
-        retval = rcpt;
+        retval = yaslauto(rcpt);
     } else {
         retval = yaslnew(
                 (*ldn[ 0 ])->la_value.bv_val, (*ldn[ 0 ])->la_value.bv_len);
+        yaslmapchars(retval, " ", ".", 1);
     }
+    yasltolower(retval);
     ldap_dnfree(ldn);
     ldap_memfree(dn);
     return (retval);
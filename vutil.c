@@ -5,16 +5,33 @@
 
 #include <config.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "embedded_config.h"
 #include "simvacation.h"
 #include "vutil.h"
 
+/* Read size for a header that isn't mapped, and the most a single field
+ * may take up before the reader gives up on the rest of the header.
+ */
+#define HEADER_READER_BLOCK (64 * 1024)
+#define HEADER_READER_MAX (1024 * 1024)
+
 ucl_object_t *vac_config = NULL;
 
+static bool  header_reader_fill(struct header_reader *);
+static char *header_reader_unfold(char *, size_t);
+static void  header_reader_finish(struct header_reader *);
+
 vac_result
 read_vacation_config(const char *config_file) {
     struct ucl_parser *parser;
@@ -53,6 +70,242 @@ read_vacation_config(const char *config_file) {
     return VAC_RESULT_OK;
 }
 
+double
+monotonic_seconds(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+struct header_reader *
+header_reader_new(int fd) {
+    struct header_reader *r;
+    struct stat           st;
+    off_t                 off;
+    void *                map;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+        syslog(LOG_ERR, "header_reader_new: calloc: %m");
+        return NULL;
+    }
+    r->fd = fd;
+
+    /* A spooled message can be scanned where it lies. The mapping is private
+     * so that fields can be unfolded in place; only the pages holding the
+     * header are ever touched, let alone copied.
+     */
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0) &&
+            ((off = lseek(fd, 0, SEEK_CUR)) >= 0) && (off < st.st_size)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                0);
+        if (map != MAP_FAILED) {
+            r->buf = map;
+            r->len = r->alloc = st.st_size;
+            r->pos = off;
+            r->mapped = true;
+            r->eof = true;
+            return r;
+        }
+        syslog(LOG_INFO, "header_reader_new: mmap: %m");
+    }
+
+    /* One byte more than is read, so that a final field without a newline
+     * can still be terminated in place.
+     */
+    if ((r->buf = malloc(HEADER_READER_BLOCK + 1)) == NULL) {
+        syslog(LOG_ERR, "header_reader_new: malloc: %m");
+        free(r);
+        return NULL;
+    }
+    r->alloc = HEADER_READER_BLOCK;
+
+    return r;
+}
+
+/* Returns the next header field, unfolded and without its line ending, or
+ * NULL once the blank line that ends the header has been reached. The field
+ * points into the reader's buffer and is only valid until the next call.
+ *
+ * RFC 5322 2.2.3
+ *  Unfolding is accomplished by simply removing any CRLF that is
+ *  immediately followed by WSP.
+ */
+char *
+header_reader_next(struct header_reader *r) {
+    char * start, *nl;
+    size_t avail, end, scan = 0;
+
+    if (r->done) {
+        return NULL;
+    }
+
+    for (;;) {
+        start = r->buf + r->pos;
+        avail = r->len - r->pos;
+
+        if (((avail > 0) && (start[ 0 ] == '\n')) ||
+                ((avail > 1) && (start[ 0 ] == '\r') && (start[ 1 ] == '\n'))) {
+            r->pos += (start[ 0 ] == '\r') ? 2 : 1;
+            header_reader_finish(r);
+            return NULL;
+        }
+
+        /* A line ends the field unless the next one starts with whitespace,
+         * so the byte after the newline has to be seen before the field is
+         * known to be complete.
+         */
+        if ((nl = memchr(start + scan, '\n', avail - scan)) != NULL) {
+            end = nl - start;
+            if (end + 1 < avail) {
+                if ((nl[ 1 ] == ' ') || (nl[ 1 ] == '\t')) {
+                    scan = end + 1;
+                    continue;
+                }
+                break;
+            }
+            if (r->eof) {
+                break;
+            }
+            scan = end;
+        } else if (r->eof) {
+            if (avail == 0) {
+                header_reader_finish(r);
+                return NULL;
+            }
+            end = avail;
+            break;
+        } else {
+            scan = avail;
+        }
+
+        if (!header_reader_fill(r)) {
+            header_reader_finish(r);
+            return NULL;
+        }
+    }
+
+    r->pos += (end < avail) ? end + 1 : end;
+
+    /* A mapped file can't be terminated past its end. */
+    if (r->mapped && (end == avail)) {
+        yaslfree(r->last);
+        r->last = yaslnew(start, end);
+        return header_reader_unfold(r->last, end);
+    }
+
+    return header_reader_unfold(start, end);
+}
+
+void
+header_reader_free(struct header_reader *r) {
+    if (r == NULL) {
+        return;
+    }
+    if (r->mapped) {
+        munmap(r->buf, r->alloc);
+    } else {
+        free(r->buf);
+    }
+    yaslfree(r->last);
+    free(r);
+}
+
+/* Moves the unconsumed data to the front of the buffer and reads more after
+ * it, growing the buffer if a single field has filled it. When that fails
+ * the reader is marked as truncated, since the rest of the header is lost.
+ */
+static bool
+header_reader_fill(struct header_reader *r) {
+    char *  buf;
+    ssize_t n;
+
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+
+    if (r->len == r->alloc) {
+        if (r->alloc >= HEADER_READER_MAX) {
+            syslog(LOG_NOTICE, "header_reader_fill: field longer than %d bytes",
+                    HEADER_READER_MAX);
+            r->truncated = true;
+            return false;
+        }
+        if ((buf = realloc(r->buf, (r->alloc * 2) + 1)) == NULL) {
+            syslog(LOG_ERR, "header_reader_fill: realloc: %m");
+            r->truncated = true;
+            return false;
+        }
+        r->buf = buf;
+        r->alloc *= 2;
+    }
+
+    while ((n = read(r->fd, r->buf + r->len, r->alloc - r->len)) < 0) {
+        if (errno != EINTR) {
+            syslog(LOG_ERR, "header_reader_fill: read: %m");
+            r->truncated = true;
+            return false;
+        }
+    }
+
+    if (n == 0) {
+        r->eof = true;
+    }
+    r->len += n;
+    return true;
+}
+
+/* Unfolds a field of len bytes in place and terminates it. Each line break
+ * that's followed by more of the field is dropped, along with the CR of a
+ * CRLF; unfolded fields only lose their line ending.
+ */
+static char *
+header_reader_unfold(char *field, size_t len) {
+    char * p = field, *q = field, *nl;
+    size_t n;
+
+    while ((nl = memchr(p, '\n', (field + len) - p)) != NULL) {
+        n = nl - p;
+        if ((n > 0) && (nl[ -1 ] == '\r')) {
+            n--;
+        }
+        if (q != p) {
+            memmove(q, p, n);
+        }
+        q += n;
+        p = nl + 1;
+    }
+
+    n = (field + len) - p;
+    if ((n > 0) && (p[ n - 1 ] == '\r')) {
+        n--;
+    }
+    if (q != p) {
+        memmove(q, p, n);
+    }
+    q[ n ] = '\0';
+
+    return field;
+}
+
+/* Leaves the descriptor at the start of the body, when it can seek, so that
+ * nothing past the header is consumed.
+ */
+static void
+header_reader_finish(struct header_reader *r) {
+    r->done = true;
+    if (r->mapped) {
+        lseek(r->fd, r->pos, SEEK_SET);
+    } else if (r->len > r->pos) {
+        lseek(r->fd, -(off_t)(r->len - r->pos), SEEK_CUR);
+    }
+}
+
 vac_result
 pexecv(yastr *argv) {
     yastr binary;
@@ -1,12 +1,35 @@
 #ifndef VUTIL_H
 #define VUTIL_H
 
+#include <stddef.h>
+
 #include "simvacation.h"
 
+/* Reads a message header from a file descriptor, one unfolded field at a
+ * time. A regular file is mapped; anything else is read in large blocks.
+ */
+struct header_reader {
+    int    fd;
+    char * buf;
+    size_t len;
+    size_t alloc;
+    size_t pos;
+    bool   mapped;
+    bool   eof;
+    bool   done;
+    bool   truncated;
+    yastr  last;
+};
+
 vac_result read_vacation_config(const char *);
 vac_result pexecv(yastr *);
 yastr      canon_from(const yastr);
 yastr      check_from(const yastr);
 bool       is_substring(const char *, const char *, bool);
+double     monotonic_seconds(void);
+
+struct header_reader *header_reader_new(int);
+char *                header_reader_next(struct header_reader *);
+void                  header_reader_free(struct header_reader *);
 
 #endif /* VUTIL_H */